@@ -32,6 +32,8 @@
 #include <pthread.h>
 #include <syslog.h>
 #include <sys/signal.h>
+#include <sys/epoll.h>
+#include <unistd.h>
 #include "alsaloop.h"
 
 struct loopback_thread {
@@ -126,9 +128,11 @@ static int create_loopback(struct loopback **_handle,
 	handle->loop_limit = ~0ULL;
 	handle->output = output;
 	handle->state = output;
-#ifdef USE_SAMPLERATE
 	handle->src_enable = 1;
+#ifdef USE_SAMPLERATE
 	handle->src_converter_type = SRC_SINC_BEST_QUALITY;
+#else
+	handle->src_converter_type = SRC_BUILTIN;
 #endif
 	*_handle = handle;
 	return 0;
@@ -177,7 +181,8 @@ void help(void)
 "-r,--rate      rate\n"
 "-n,--resample  resample in alsa-lib\n"
 "-A,--samplerate use converter (0=sincbest,1=sincmedium,2=sincfastest,\n"
-"                               3=zerohold,4=linear)\n"
+"                               3=zerohold,4=linear,5=builtin,\n"
+"                               6=builtinfast)\n"
 "-B,--buffer    buffer size in frames\n"
 "-E,--period    period size in frames\n"
 "-s,--seconds   duration of loop in seconds\n"
@@ -192,9 +197,13 @@ void help(void)
 "		    ALSA_ID@OSS_ID  (for example: \"Master@VOLUME\")\n"
 "-e,--effect    apply an effect (bandpass filter sweep)\n"
 "-v,--verbose   verbose mode (more -v means more verbose)\n"
-"-w,--workaround use workaround (serialopen)\n"
+"-w,--workaround use workaround (serialopen, poll)\n"
 "-U,--xrun      xrun profiling\n"
 "-W,--wake      process wake timeout in ms\n"
+"-M,--mmap      use mmap access, copy directly between the capture and\n"
+"               playback rings when the stream parameters match\n"
+"-K,--pibw      clock drift PI controller bandwidth in Hz (0=step mode)\n"
+"-H,--tstamp    estimate the clock drift from the driver timestamps\n"
 );
 	printf("\nRecognized sample formats are:");
 	for (k = 0; k < SND_PCM_FORMAT_LAST; ++k) {
@@ -368,6 +377,9 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		{"ossmixer", 1, NULL, 'O'},
 		{"workaround", 1, NULL, 'w'},
 		{"xrun", 0, NULL, 'U'},
+		{"mmap", 0, NULL, 'M'},
+		{"pibw", 1, NULL, 'K'},
+		{"tstamp", 0, NULL, 'H'},
 		{NULL, 0, NULL, 0},
 	};
 	int err, morehelp;
@@ -387,7 +399,11 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 	int arg_nblock = 0;
 	int arg_effect = 0;
 	int arg_resample = 0;
+#ifdef USE_SAMPLERATE
 	int arg_samplerate = SRC_SINC_FASTEST + 1;
+#else
+	int arg_samplerate = SRC_BUILTIN + 1;
+#endif
 	int arg_sync = SYNC_TYPE_AUTO;
 	int arg_slave = SLAVE_TYPE_AUTO;
 	int arg_thread = 0;
@@ -398,12 +414,15 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 	int arg_ossmixers_count = 0;
 	int arg_xrun = arg_default_xrun;
 	int arg_wake = arg_default_wake;
+	int arg_mmap = 0;
+	double arg_pitch_bw = 0;
+	int arg_tstamp = 0;
 
 	morehelp = 0;
 	while (1) {
 		int c;
 		if ((c = getopt_long(argc, argv,
-				"hdg:P:C:X:Y:l:t:F:f:c:r:s:benvA:S:a:m:T:O:w:UW:",
+				"hdg:P:C:X:Y:l:t:F:f:c:r:s:benvA:S:a:m:T:O:w:UW:MK:H",
 				long_option, NULL)) < 0)
 			break;
 		switch (c) {
@@ -485,10 +504,14 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 				arg_samplerate = SRC_ZERO_ORDER_HOLD;
 			else if (strcasecmp(optarg, "linear") == 0)
 				arg_samplerate = SRC_LINEAR;
+			else if (strcasecmp(optarg, "builtin") == 0)
+				arg_samplerate = SRC_BUILTIN;
+			else if (strcasecmp(optarg, "builtinfast") == 0)
+				arg_samplerate = SRC_BUILTIN_FAST;
 			else
 				arg_samplerate = atoi(optarg);
-			if (arg_samplerate < 0 || arg_samplerate > SRC_LINEAR)
-				arg_sync = SRC_SINC_FASTEST;
+			if (arg_samplerate < 0 || arg_samplerate > SRC_BUILTIN_FAST)
+				arg_samplerate = SRC_SINC_FASTEST;
 			arg_samplerate += 1;
 			break;
 		case 'S':
@@ -546,6 +569,8 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		case 'w':
 			if (strcasecmp(optarg, "serialopen") == 0)
 				workarounds |= WORKAROUND_SERIALOPEN;
+			else if (strcasecmp(optarg, "poll") == 0)
+				workarounds |= WORKAROUND_POLL;
 			break;
 		case 'U':
 			arg_xrun = 1;
@@ -557,6 +582,17 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 			if (cmdline)
 				arg_default_wake = arg_wake;
 			break;
+		case 'M':
+			arg_mmap = 1;
+			break;
+		case 'K':
+			arg_pitch_bw = atof(optarg);
+			if (arg_pitch_bw < 0)
+				arg_pitch_bw = 0;
+			break;
+		case 'H':
+			arg_tstamp = 1;
+			break;
 		}
 	}
 
@@ -589,6 +625,9 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		play->period_size_req = capt->period_size_req = arg_period_size;
 		play->resample = capt->resample = arg_resample;
 		play->nblock = capt->nblock = arg_nblock ? 1 : 0;
+		if (arg_mmap)
+			play->access = capt->access =
+				SND_PCM_ACCESS_MMAP_INTERLEAVED;
 		loop->latency_req = arg_latency_req;
 		loop->latency_reqtime = arg_latency_reqtime;
 		loop->sync = arg_sync;
@@ -596,6 +635,9 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		loop->thread = arg_thread;
 		loop->xrun = arg_xrun;
 		loop->wake = arg_wake;
+		loop->mmap = arg_mmap;
+		loop->pitch_bw = arg_pitch_bw;
+		loop->tstamp = arg_tstamp;
 		err = add_mixers(loop, arg_mixers, arg_mixers_count);
 		if (err < 0) {
 			logit(LOG_CRIT, "Unable to add mixer controls.\n");
@@ -606,12 +648,11 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 			logit(LOG_CRIT, "Unable to add ossmixer controls.\n");
 			exit(EXIT_FAILURE);
 		}
-#ifdef USE_SAMPLERATE
 		loop->src_enable = arg_samplerate > 0;
 		if (loop->src_enable)
 			loop->src_converter_type = arg_samplerate - 1;
-#else
-		if (arg_samplerate > 0) {
+#ifndef USE_SAMPLERATE
+		if (loop->src_enable && loop->src_converter_type < SRC_BUILTIN) {
 			logit(LOG_CRIT, "No libsamplerate support.\n");
 			exit(EXIT_FAILURE);
 		}
@@ -694,6 +735,134 @@ static int parse_config_file(const char *file, snd_output_t *output)
 	return err;
 }
 
+#define EPOLL_EVENTS	64
+
+/*
+ * The epoll loop keeps the poll descriptors of every loopback registered,
+ * they are re-registered only when the loopback is restarted. The event
+ * data carries the loopback index (upper 32 bits) and the descriptor index.
+ */
+static int epoll_register(int epfd, struct loopback_thread *thread, int idx)
+{
+	struct loopback *loop = thread->loopbacks[idx];
+	struct pollfd *fds;
+	struct epoll_event ev;
+	int i, err;
+
+	for (i = 0; i < loop->epoll_fds_count; i++)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, loop->epoll_fds[i].fd, NULL);
+	loop->epoll_fds_count = 0;
+	loop->pollfd_reinit = 0;
+	fds = realloc(loop->epoll_fds, (loop->pollfd_count + 1) * sizeof(*fds));
+	if (fds == NULL)
+		return -ENOMEM;
+	loop->epoll_fds = fds;
+	err = pcmjob_pollfds_init(loop, fds);
+	if (err < 0)
+		return err;
+	for (i = 0; i < err; i++) {
+		fds[i].revents = 0;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = fds[i].events;
+		ev.data.u64 = ((unsigned long long)idx << 32) | i;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i].fd, &ev) < 0)
+			return -errno;
+		loop->epoll_fds_count++;
+	}
+	return 0;
+}
+
+static int epoll_handle(struct loopback *loop)
+{
+	int i, err;
+
+	err = pcmjob_pollfds_handle(loop, loop->epoll_fds);
+	for (i = 0; i < loop->epoll_fds_count; i++)
+		loop->epoll_fds[i].revents = 0;
+	return err;
+}
+
+/*
+ * Returns an error when the descriptors cannot be registered, the caller
+ * falls back to the poll loop then.
+ */
+static int thread_epoll(struct loopback_thread *thread, int wake)
+{
+	snd_output_t *output = thread->output;
+	struct epoll_event events[EPOLL_EVENTS];
+	struct loopback *loop;
+	int i, idx, count, ready_count, err, epfd, *ready;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		return -errno;
+	ready = calloc(thread->loopbacks_count, sizeof(*ready));
+	if (ready == NULL) {
+		err = -ENOMEM;
+		goto __error;
+	}
+	for (i = 0; i < thread->loopbacks_count; i++) {
+		err = epoll_register(epfd, thread, i);
+		if (err < 0)
+			goto __error;
+	}
+	while (!quit) {
+		struct timeval tv1, tv2;
+		if (verbose > 10)
+			gettimeofday(&tv1, NULL);
+		count = epoll_wait(epfd, events, EPOLL_EVENTS, wake);
+		if (count < 0)
+			err = -errno;
+		if (verbose > 10) {
+			gettimeofday(&tv2, NULL);
+			snd_output_printf(output, "epoll took %lius\n", timediff(tv2, tv1));
+		}
+		if (count < 0) {
+			if (err == -EINTR || err == -ERESTART)
+				continue;
+			logit(LOG_CRIT, "Epoll failed: %s\n", strerror(-err));
+			my_exit(thread, EXIT_FAILURE);
+		}
+		ready_count = 0;
+		if (count == 0) {
+			/* wake timeout, serve all loopbacks */
+			for (i = 0; i < thread->loopbacks_count; i++)
+				ready[ready_count++] = i;
+		}
+		for (i = 0; i < count; i++) {
+			idx = events[i].data.u64 >> 32;
+			loop = thread->loopbacks[idx];
+			loop->epoll_fds[events[i].data.u64 & 0xffffffff].revents =
+							events[i].events;
+			if (!loop->epoll_ready) {
+				loop->epoll_ready = 1;
+				ready[ready_count++] = idx;
+			}
+		}
+		for (i = 0; i < ready_count; i++) {
+			loop = thread->loopbacks[ready[i]];
+			loop->epoll_ready = 0;
+			if (epoll_handle(loop) < 0) {
+				logit(LOG_CRIT, "pcmjob failed.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		for (i = 0; i < ready_count; i++) {
+			if (!thread->loopbacks[ready[i]]->pollfd_reinit)
+				continue;
+			if (epoll_register(epfd, thread, ready[i]) < 0) {
+				logit(LOG_CRIT, "Epoll FD registration failed.\n");
+				my_exit(thread, EXIT_FAILURE);
+			}
+		}
+	}
+	err = 0;
+      __error:
+	free(ready);
+	close(epfd);
+	return err;
+}
+
 static void thread_job1(void *_data)
 {
 	struct loopback_thread *thread = _data;
@@ -724,6 +893,12 @@ static void thread_job1(void *_data)
 	}
 	if (wake >= 1000000)
 		wake = -1;
+	if (!(workarounds & WORKAROUND_POLL)) {
+		err = thread_epoll(thread, wake);
+		if (err >= 0)
+			my_exit(thread, EXIT_SUCCESS);
+		logit(LOG_WARNING, "Epoll setup failed (%s), using poll.\n", strerror(-err));
+	}
 	pfds = calloc(pfds_count, sizeof(struct pollfd));
 	if (pfds == NULL || pfds_count <= 0) {
 		logit(LOG_CRIT, "Poll FDs allocation failed.\n");
@@ -31,6 +31,9 @@ enum {
 	SRC_LINEAR		= 4
 };
 #endif
+/* converters of the built-in resampler, after the libsamplerate ones */
+#define SRC_BUILTIN		(SRC_LINEAR + 1)
+#define SRC_BUILTIN_FAST	(SRC_LINEAR + 2)
 
 #define MAX_ARGS	128
 #define MAX_MIXERS	64
@@ -41,6 +44,7 @@ enum {
 #endif
 
 #define WORKAROUND_SERIALOPEN	(1<<0)
+#define WORKAROUND_POLL		(1<<1)
 
 typedef enum _sync_type {
 	SYNC_TYPE_NONE = 0,
@@ -116,6 +120,16 @@ struct loopback_handle {
 	snd_pcm_sframes_t last_delay;
 	double pitch;
 	snd_pcm_uframes_t total_queued;
+	/* timestamp drift estimation */
+	unsigned long long tstamp_appl;	/* transferred frames */
+	snd_htimestamp_t tstamp_trigger;
+	unsigned int tstamp_n;
+	double tstamp_start;		/* in seconds from the trigger */
+	double tstamp_last;
+	double tstamp_mean_t;
+	double tstamp_mean_pos;
+	double tstamp_cxx;
+	double tstamp_cxy;
 	/* control */
 	snd_ctl_t *ctl;
 	unsigned int ctl_pollfd_count;
@@ -140,10 +154,17 @@ struct loopback {
 	snd_output_t *state;
 	int pollfd_count;
 	int active_pollfd_count;
+	unsigned int pollfd_reinit:1;	/* poll descriptors changed */
+	/* epoll */
+	struct pollfd *epoll_fds;	/* registered descriptors */
+	int epoll_fds_count;
+	unsigned int epoll_ready:1;
 	unsigned int linked:1;		/* linked streams */
 	unsigned int reinit:1;
 	unsigned int running:1;
 	unsigned int stop_pending:1;
+	unsigned int mmap:1;		/* use mmap access */
+	unsigned int mmap_direct:1;	/* ring to ring transfers */
 	snd_pcm_uframes_t stop_count;
 	sync_type_t sync;		/* type of sync */
 	slave_type_t slave;
@@ -152,6 +173,11 @@ struct loopback {
 	/* statistics */
 	double pitch;
 	double pitch_delta;
+	double pitch_bw;		/* PI controller bandwidth in Hz, 0 = off */
+	double pitch_integral;		/* PI controller integrator */
+	unsigned int tstamp:1;		/* timestamp drift estimation */
+	double tstamp_ratio;		/* capture/playback clock, 0 = unknown */
+	double pitch_step;		/* step correction on top of tstamp_ratio */
 	snd_pcm_sframes_t pitch_diff;
 	snd_pcm_sframes_t pitch_diff_min;
 	snd_pcm_sframes_t pitch_diff_max;
@@ -177,12 +203,13 @@ struct loopback {
 	struct loopback_ossmixer *oss_controls;
 	/* sample rate */
 	unsigned int use_samplerate:1;
-#ifdef USE_SAMPLERATE
 	unsigned int src_enable:1;
 	int src_converter_type;
+	unsigned int src_out_frames;
+	struct resample *resample;	/* built-in resampler */
+#ifdef USE_SAMPLERATE
 	SRC_STATE *src_state;
 	SRC_DATA src_data;
-	unsigned int src_out_frames;
 #endif
 #ifdef FILE_CWRITE
 	FILE *cfile;
@@ -211,6 +238,15 @@ int pcmjob_pollfds_init(struct loopback *loop, struct pollfd *fds);
 int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds);
 void pcmjob_state(struct loopback *loop);
 
+int resample_init(struct resample **rs, snd_pcm_format_t format,
+		  unsigned int channels, double ratio, int converter);
+void resample_done(struct resample *rs);
+void resample_set_ratio(struct resample *rs, double ratio);
+snd_pcm_uframes_t resample_delay(struct resample *rs);
+snd_pcm_uframes_t resample_process(struct resample *rs,
+				   const char *in, snd_pcm_uframes_t *in_frames,
+				   char *out, snd_pcm_uframes_t out_frames);
+
 int control_parse_id(const char *str, snd_ctl_elem_id_t *id);
 int control_id_match(snd_ctl_elem_id_t *id1, snd_ctl_elem_id_t *id2);
 int control_init(struct loopback *loop);
@@ -35,9 +35,13 @@
 #include "alsaloop.h"
 
 #define XRUN_PROFILE_UNKNOWN (-10000000)
+#define PITCH_DEVIATION_MAX 0.02	/* PI controller output limit */
+#define TSTAMP_MIN_SAMPLES 16
+#define TSTAMP_SPAN_MAX 60.0		/* in seconds */
 
 static int set_rate_shift(struct loopback_handle *lhandle, double pitch);
 static int get_rate(struct loopback_handle *lhandle);
+static void tstamp_reset(struct loopback_handle *lhandle);
 
 #define SYNCTYPE(v) [SYNC_TYPE_##v] = #v
 
@@ -52,15 +56,15 @@ static const char *sync_types[] = {
 
 #define SRCTYPE(v) [SRC_##v] = "SRC_" #v
 
-#ifdef USE_SAMPLERATE
 static const char *src_types[] = {
 	SRCTYPE(SINC_BEST_QUALITY),
 	SRCTYPE(SINC_MEDIUM_QUALITY),
 	SRCTYPE(SINC_FASTEST),
 	SRCTYPE(ZERO_ORDER_HOLD),
-	SRCTYPE(LINEAR)
+	SRCTYPE(LINEAR),
+	SRCTYPE(BUILTIN),
+	SRCTYPE(BUILTIN_FAST)
 };
-#endif
 
 static pthread_mutex_t pcm_open_mutex =
                                 PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
@@ -136,10 +140,7 @@ static int setparams_stream(struct loopback_handle *lhandle,
 	rrate = 0;
 	snd_pcm_hw_params_get_rate(params, &rrate, 0);
 	lhandle->rate = rrate;
-	if (
-#ifdef USE_SAMPLERATE
-	    !lhandle->loopback->src_enable &&
-#endif
+	if (!lhandle->loopback->src_enable &&
 	    (int)rrate != lhandle->rate) {
 		logit(LOG_CRIT, "Rate does not match (requested %iHz, got %iHz, resample %i)\n", lhandle->rate, rrate, lhandle->resample);
 		return -EINVAL;
@@ -261,6 +262,13 @@ static int setparams_set(struct loopback_handle *lhandle,
 		if (verbose > 6)
 			snd_output_printf(lhandle->loopback->output, "%s: avail_min2=%li\n", lhandle->id, val);
 	}
+	if (lhandle->loopback->tstamp) {
+		err = snd_pcm_sw_params_set_tstamp_mode(handle, swparams, SND_PCM_TSTAMP_ENABLE);
+		if (err < 0) {
+			logit(LOG_CRIT, "Unable to enable timestamps for %s: %s\n", lhandle->id, snd_strerror(err));
+			return err;
+		}
+	}
 	err = snd_pcm_sw_params_set_avail_min(handle, swparams, val);
 	if (err < 0) {
 		logit(LOG_CRIT, "Unable to set avail min for %s: %s\n", lhandle->id, snd_strerror(err));
@@ -378,9 +386,7 @@ static void xrun_profile0(struct loopback *loop)
 		loop->xrun_last_cdelay = cdelay;
 		loop->xrun_buf_pcount = loop->play->buf_count;
 		loop->xrun_buf_ccount = loop->capt->buf_count;
-#ifdef USE_SAMPLERATE
 		loop->xrun_out_frames = loop->src_out_frames;
-#endif
 	}
 }
 
@@ -585,6 +591,40 @@ static void buf_add_src(struct loopback *loop)
 }
 #endif
 
+/* the built-in resampler reads and writes the ring buffers directly */
+static void buf_add_resample(struct loopback *loop)
+{
+	struct loopback_handle *capt = loop->capt;
+	struct loopback_handle *play = loop->play;
+	snd_pcm_uframes_t cpos, ppos, count, used;
+
+	cpos = (capt->buf_pos + capt->buf_size - capt->buf_count) %
+							capt->buf_size;
+	ppos = (play->buf_pos + play->buf_count) % play->buf_size;
+	while (buf_avail(play) > 0) {
+		used = capt->buf_count;
+		if (used + cpos > capt->buf_size)
+			used = capt->buf_size - cpos;
+		count = buf_avail(play);
+		if (count + ppos > play->buf_size)
+			count = play->buf_size - ppos;
+		count = resample_process(loop->resample,
+					 capt->buf + cpos * capt->frame_size,
+					 &used,
+					 play->buf + ppos * play->frame_size,
+					 count);
+		capt->buf_count -= used;
+		cpos += used;
+		cpos %= capt->buf_size;
+		play->buf_count += count;
+		ppos += count;
+		ppos %= play->buf_size;
+		if (used == 0 && count == 0)
+			break;
+	}
+	loop->src_out_frames = resample_delay(loop->resample);
+}
+
 static void buf_add(struct loopback *loop, snd_pcm_uframes_t count)
 {
 	/* copy samples from capture to playback buffer */
@@ -592,6 +632,8 @@ static void buf_add(struct loopback *loop, snd_pcm_uframes_t count)
 		return;
 	if (loop->play->buf == loop->capt->buf) {
 		loop->play->buf_count += count;
+	} else if (loop->resample) {
+		buf_add_resample(loop);
 	} else {
 		buf_add_src(loop);
 	}
@@ -628,6 +670,22 @@ static int suspend(struct loopback_handle *lhandle)
 	return 0;
 }
 
+static inline snd_pcm_sframes_t pcm_readi(struct loopback_handle *lhandle,
+					   void *buf, snd_pcm_uframes_t size)
+{
+	if (lhandle->access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+		return snd_pcm_mmap_readi(lhandle->handle, buf, size);
+	return snd_pcm_readi(lhandle->handle, buf, size);
+}
+
+static inline snd_pcm_sframes_t pcm_writei(struct loopback_handle *lhandle,
+					    const void *buf, snd_pcm_uframes_t size)
+{
+	if (lhandle->access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+		return snd_pcm_mmap_writei(lhandle->handle, buf, size);
+	return snd_pcm_writei(lhandle->handle, buf, size);
+}
+
 static int readit(struct loopback_handle *lhandle)
 {
 	snd_pcm_sframes_t r, res = 0;
@@ -656,10 +714,10 @@ static int readit(struct loopback_handle *lhandle)
 			r = lhandle->buf_size - lhandle->buf_pos;
 		if (r > avail)
 			r = avail;
-		r = snd_pcm_readi(lhandle->handle,
-				  lhandle->buf +
-				  lhandle->buf_pos *
-				  lhandle->frame_size, r);
+		r = pcm_readi(lhandle,
+			      lhandle->buf +
+			      lhandle->buf_pos *
+			      lhandle->frame_size, r);
 		if (r == 0)
 			return res;
 		if (r < 0) {
@@ -683,6 +741,7 @@ static int readit(struct loopback_handle *lhandle)
 		if (lhandle->max < res)
 			lhandle->max = res;
 		lhandle->counter += r;
+		lhandle->tstamp_appl += r;
 		lhandle->buf_count += r;
 		lhandle->buf_pos += r;
 		lhandle->buf_pos %= lhandle->buf_size;
@@ -714,10 +773,10 @@ static int writeit(struct loopback_handle *lhandle)
 			r = lhandle->buf_size - lhandle->buf_pos;
 		if (r > avail)
 			r = avail;
-		r = snd_pcm_writei(lhandle->handle,
-				   lhandle->buf +
-				   lhandle->buf_pos *
-				   lhandle->frame_size, r);
+		r = pcm_writei(lhandle,
+			       lhandle->buf +
+			       lhandle->buf_pos *
+			       lhandle->frame_size, r);
 		if (r <= 0) {
 			if (r == -EPIPE) {
 				if ((err = xrun(lhandle)) < 0)
@@ -734,6 +793,7 @@ static int writeit(struct loopback_handle *lhandle)
 #endif
 		res += r;
 		lhandle->counter += r;
+		lhandle->tstamp_appl += r;
 		lhandle->buf_count -= r;
 		lhandle->buf_pos += r;
 		lhandle->buf_pos %= lhandle->buf_size;
@@ -751,6 +811,101 @@ static int writeit(struct loopback_handle *lhandle)
 	return res;
 }
 
+/*
+ * Move the captured samples from the capture ring straight to the playback
+ * ring (mmap_direct). The samples which do not fit to the playback ring are
+ * left in the capture ring for the next round.
+ */
+static snd_pcm_sframes_t copyit(struct loopback *loop)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *capt = loop->capt;
+	const snd_pcm_channel_area_t *careas, *pareas;
+	snd_pcm_uframes_t coffset, poffset, frames;
+	snd_pcm_sframes_t cavail, pavail, r, res = 0;
+	int err;
+
+	cavail = snd_pcm_avail_update(capt->handle);
+	if (cavail == -EPIPE) {
+		return xrun(capt);
+	} else if (cavail == -ESTRPIPE) {
+		return suspend(capt);
+	} else if (cavail < 0) {
+		return cavail;
+	} else if (cavail == 0) {
+		if (snd_pcm_state(capt->handle) == SND_PCM_STATE_DRAINING)
+			loop->reinit = 1;
+		return 0;
+	}
+      __again:
+	pavail = snd_pcm_avail_update(play->handle);
+	if (pavail == -EPIPE) {
+		return xrun(play);
+	} else if (pavail == -ESTRPIPE) {
+		if ((err = suspend(play)) < 0)
+			return err;
+		goto __again;
+	} else if (pavail < 0) {
+		return pavail;
+	}
+	while (cavail > 0 && pavail > 0) {
+		frames = cavail < pavail ? cavail : pavail;
+		err = snd_pcm_mmap_begin(capt->handle, &careas, &coffset, &frames);
+		if (err < 0) {
+			logit(LOG_CRIT, "%s mmap begin failed: %s\n", capt->id, snd_strerror(err));
+			return res > 0 ? res : err;
+		}
+		err = snd_pcm_mmap_begin(play->handle, &pareas, &poffset, &frames);
+		if (err < 0) {
+			logit(LOG_CRIT, "%s mmap begin failed: %s\n", play->id, snd_strerror(err));
+			return res > 0 ? res : err;
+		}
+		snd_pcm_areas_copy(pareas, poffset, careas, coffset,
+				   play->channels, frames, play->format);
+		r = snd_pcm_mmap_commit(play->handle, poffset, frames);
+		if (r >= 0 && (snd_pcm_uframes_t)r != frames)
+			r = -EPIPE;
+		if (r < 0) {
+			if (r == -EPIPE || r == -ESTRPIPE) {
+				if ((err = xrun(play)) < 0)
+					return err;
+				return res;
+			}
+			return res > 0 ? res : r;
+		}
+		r = snd_pcm_mmap_commit(capt->handle, coffset, frames);
+		if (r >= 0 && (snd_pcm_uframes_t)r != frames)
+			r = -EPIPE;
+		if (r < 0) {
+			if (r == -EPIPE || r == -ESTRPIPE) {
+				if ((err = xrun(capt)) < 0)
+					return err;
+				return res;
+			}
+			return res > 0 ? res : r;
+		}
+		res += frames;
+		if (capt->max < res)
+			capt->max = res;
+		capt->counter += frames;
+		play->counter += frames;
+		capt->tstamp_appl += frames;
+		play->tstamp_appl += frames;
+		cavail -= frames;
+		pavail -= frames;
+		xrun_profile(loop);
+		if (loop->stop_pending) {
+			loop->stop_count += frames;
+			if (loop->stop_count * play->pitch > loop->latency * 3) {
+				loop->stop_pending = 0;
+				loop->reinit = 1;
+				break;
+			}
+		}
+	}
+	return res;
+}
+
 static snd_pcm_sframes_t remove_samples(struct loopback *loop,
 					int capture_preferred,
 					snd_pcm_sframes_t count)
@@ -843,9 +998,7 @@ static int xrun_sync(struct loopback *loop)
 	if (play->buf != capt->buf)
 		cdelay += capt->buf_count;
 	pdelay += play->buf_count;
-#ifdef USE_SAMPLERATE
 	pdelay += loop->src_out_frames;
-#endif
 	cdelay1 = cdelay * capt->pitch;
 	pdelay1 = pdelay * play->pitch;
 	delay1 = cdelay1 + pdelay1;
@@ -856,16 +1009,9 @@ static int xrun_sync(struct loopback *loop)
 	if (verbose > 6) {
 		snd_output_printf(loop->output,
 			"sync: cdelay=%li(%li), pdelay=%li(%li), fill=%li (delay=%li)"
-#ifdef USE_SAMPLERATE
-			", src_out=%li"
-#endif
-			"\n",
+			", src_out=%li\n",
 			(long)cdelay, (long)cdelay1, (long)pdelay, (long)pdelay1,
-			(long)fill, (long)delay1
-#ifdef USE_SAMPLERATE
-			, (long)loop->src_out_frames
-#endif
-			);
+			(long)fill, (long)delay1, (long)loop->src_out_frames);
 		snd_output_printf(loop->output,
 			"sync: cbufcount=%li, pbufcount=%li\n",
 			(long)capt->buf_count, (long)play->buf_count);
@@ -960,9 +1106,7 @@ static int xrun_sync(struct loopback *loop)
 			if (play->buf != capt->buf)
 				cdelay += capt->buf_count;
 			pdelay += play->buf_count;
-#ifdef USE_SAMPLERATE
 			pdelay += loop->src_out_frames;
-#endif
 			cdelay1 = cdelay * capt->pitch;
 			pdelay1 = pdelay * play->pitch;
 			delay1 = cdelay1 + pdelay1;
@@ -1008,41 +1152,75 @@ static int set_rate_shift(struct loopback_handle *lhandle, double pitch)
 	return 0;
 }
 
+/*
+ * PI controller for the average latency error. The closed loop is a second
+ * order system with the natural frequency 2*pi*pitch_bw and the damping
+ * 1/sqrt(2). The error is taken in seconds, so the gains do not depend
+ * on the rate. With a timestamp ratio, the controller works on top of it
+ * and removes only the latency error.
+ */
+static void pitch_control(struct loopback *loop, snd_pcm_sframes_t diff)
+{
+	struct loopback_handle *play = loop->play;
+	double wn = 2 * M_PI * loop->pitch_bw;
+	double interval = (double)play->sync_point / play->rate;
+	double err = (double)diff / play->rate;
+	double pitch, ratio = loop->tstamp_ratio > 0 ? loop->tstamp_ratio : 1.0;
+
+	loop->pitch_integral += wn * wn * err * interval;
+	if (loop->pitch_integral > PITCH_DEVIATION_MAX)
+		loop->pitch_integral = PITCH_DEVIATION_MAX;
+	else if (loop->pitch_integral < -PITCH_DEVIATION_MAX)
+		loop->pitch_integral = -PITCH_DEVIATION_MAX;
+	pitch = ratio * (1.0 + M_SQRT2 * wn * err + loop->pitch_integral);
+	if (pitch > 1.0 + PITCH_DEVIATION_MAX)
+		pitch = 1.0 + PITCH_DEVIATION_MAX;
+	else if (pitch < 1.0 - PITCH_DEVIATION_MAX)
+		pitch = 1.0 - PITCH_DEVIATION_MAX;
+	loop->pitch = pitch;
+}
+
+static void set_src_ratio(struct loopback *loop, double ratio)
+{
+	if (loop->resample)
+		resample_set_ratio(loop->resample, ratio);
+#ifdef USE_SAMPLERATE
+	else
+		loop->src_data.src_ratio = ratio;
+#endif
+}
+
 void update_pitch(struct loopback *loop)
 {
 	double pitch = loop->pitch;
+	double ratio;
 
-#ifdef USE_SAMPLERATE
 	if (loop->sync == SYNC_TYPE_SAMPLERATE) {
-		loop->src_data.src_ratio = (double)1.0 / (pitch *
+		ratio = (double)1.0 / (pitch *
 				loop->play->pitch * loop->capt->pitch);
+		set_src_ratio(loop, ratio);
 		if (verbose > 2)
-			snd_output_printf(loop->output, "%s: Samplerate src_ratio update1: %.8f\n", loop->id, loop->src_data.src_ratio);
+			snd_output_printf(loop->output, "%s: Samplerate src_ratio update1: %.8f\n", loop->id, ratio);
 	} else
-#endif
 	if (loop->sync == SYNC_TYPE_CAPTRATESHIFT) {
 		set_rate_shift(loop->capt, pitch);
-#ifdef USE_SAMPLERATE
 		if (loop->use_samplerate) {
-			loop->src_data.src_ratio = 
-				(double)1.0 /
+			ratio = (double)1.0 /
 					(loop->play->pitch * loop->capt->pitch);
+			set_src_ratio(loop, ratio);
 			if (verbose > 2)
-				snd_output_printf(loop->output, "%s: Samplerate src_ratio update2: %.8f\n", loop->id, loop->src_data.src_ratio);
+				snd_output_printf(loop->output, "%s: Samplerate src_ratio update2: %.8f\n", loop->id, ratio);
 		}
-#endif
 	}
 	else if (loop->sync == SYNC_TYPE_PLAYRATESHIFT) {
 		set_rate_shift(loop->play, pitch);
-#ifdef USE_SAMPLERATE
 		if (loop->use_samplerate) {
-			loop->src_data.src_ratio = 
-				(double)1.0 /
+			ratio = (double)1.0 /
 					(loop->play->pitch * loop->capt->pitch);
+			set_src_ratio(loop, ratio);
 			if (verbose > 2)
-				snd_output_printf(loop->output, "%s: Samplerate src_ratio update3: %.8f\n", loop->id, loop->src_data.src_ratio);
+				snd_output_printf(loop->output, "%s: Samplerate src_ratio update3: %.8f\n", loop->id, ratio);
 		}
-#endif
 	}
 	if (verbose)
 		snd_output_printf(loop->output, "New pitch for %s: %.8f (min/max samples = %li/%li)\n", loop->id, pitch, loop->pitch_diff_min, loop->pitch_diff_max);
@@ -1241,6 +1419,15 @@ static int init_handle(struct loopback_handle *lhandle, int alloc)
 	lhandle->frame_size = (snd_pcm_format_width(lhandle->format) / 8) *
 							   lhandle->channels;
 	lhandle->sync_point = lhandle->rate * 15;	/* every 15 seconds */
+	if (lhandle->loopback->pitch_bw > 0) {
+		/* sample the error well above the controller bandwidth */
+		lhandle->sync_point = lhandle->rate /
+					(lhandle->loopback->pitch_bw * 20);
+		if (lhandle->sync_point > lhandle->rate * 15)
+			lhandle->sync_point = lhandle->rate * 15;
+		if (lhandle->sync_point < lhandle->rate / 10)
+			lhandle->sync_point = lhandle->rate / 10;
+	}
 	lat = lhandle->loopback->latency;
 	if (lhandle->buffer_size > lat)
 		lat = lhandle->buffer_size;
@@ -1275,10 +1462,8 @@ int pcmjob_init(struct loopback *loop)
 		loop->sync = SYNC_TYPE_CAPTRATESHIFT;
 	if (loop->sync == SYNC_TYPE_AUTO && loop->play->ctl_rate_shift)
 		loop->sync = SYNC_TYPE_PLAYRATESHIFT;
-#ifdef USE_SAMPLERATE
 	if (loop->sync == SYNC_TYPE_AUTO && loop->src_enable)
 		loop->sync = SYNC_TYPE_SAMPLERATE;
-#endif
 	if (loop->sync == SYNC_TYPE_AUTO)
 		loop->sync = SYNC_TYPE_SIMPLE;
 	if (loop->slave == SLAVE_TYPE_AUTO &&
@@ -1310,6 +1495,8 @@ int pcmjob_init(struct loopback *loop)
 
 static void freeloop(struct loopback *loop)
 {
+	resample_done(loop->resample);
+	loop->resample = NULL;
 #ifdef USE_SAMPLERATE
 	if (loop->use_samplerate) {
 		if (loop->src_state)
@@ -1335,6 +1522,9 @@ int pcmjob_done(struct loopback *loop)
 	freeloop(loop);
 	free(loop->id);
 	loop->id = NULL;
+	free(loop->epoll_fds);
+	loop->epoll_fds = NULL;
+	loop->epoll_fds_count = 0;
 #ifdef FILE_PWRITE
 	if (loop->pfile) {
 		fclose(loop->pfile);
@@ -1363,6 +1553,7 @@ int pcmjob_start(struct loopback *loop)
 	snd_pcm_uframes_t count;
 	int err;
 
+	loop->pollfd_reinit = 1;
 	loop->pollfd_count = loop->play->ctl_pollfd_count +
 			     loop->capt->ctl_pollfd_count;
 	if ((err = snd_pcm_poll_descriptors_count(loop->play->handle)) < 0)
@@ -1407,10 +1598,11 @@ int pcmjob_start(struct loopback *loop)
 	if (loop->play->access == loop->capt->access &&
 	    loop->play->format == loop->capt->format &&
 	    loop->play->rate == loop->capt->rate &&
-	    loop->play->channels == loop->play->channels &&
+	    loop->play->channels == loop->capt->channels &&
 	    loop->sync != SYNC_TYPE_SAMPLERATE) {
 		if (verbose > 1)
 			snd_output_printf(loop->output, "shared buffer!!!\n");
+		loop->mmap_direct = loop->mmap;
 		if ((err = init_handle(loop->play, 1)) < 0)
 			goto __error;
 		if ((err = init_handle(loop->capt, 0)) < 0)
@@ -1438,6 +1630,9 @@ int pcmjob_start(struct loopback *loop)
 		}
 		loop->capt->buf = loop->play->buf;
 	} else {
+		if (loop->mmap)
+			logit(LOG_WARNING, "%s: stream parameters differ, mmap transfers use the intermediate buffer\n", loop->id);
+		loop->mmap_direct = 0;
 		if ((err = init_handle(loop->play, 1)) < 0)
 			goto __error;
 		if ((err = init_handle(loop->capt, 1)) < 0)
@@ -1447,7 +1642,6 @@ int pcmjob_start(struct loopback *loop)
 		if (loop->capt->rate_req != loop->capt->rate)
 			loop->use_samplerate = 1;
 	}
-#ifdef USE_SAMPLERATE
 	if (loop->sync == SYNC_TYPE_SAMPLERATE)
 		loop->use_samplerate = 1;
 	if (loop->use_samplerate && !loop->src_enable) {
@@ -1456,7 +1650,31 @@ int pcmjob_start(struct loopback *loop)
 		err = -EIO;
 		goto __error;		
 	}
-	if (loop->use_samplerate) {
+	if (loop->use_samplerate && loop->src_converter_type >= SRC_BUILTIN) {
+		if (loop->capt->format != loop->play->format ||
+		    loop->capt->channels != loop->play->channels) {
+			logit(LOG_CRIT, "built-in samplerate conversion requires the same format and channels (play=%s/%i, capt=%s/%i)\n", snd_pcm_format_name(loop->play->format), loop->play->channels, snd_pcm_format_name(loop->capt->format), loop->capt->channels);
+			loop->use_samplerate = 0;
+			err = -EIO;
+			goto __error;
+		}
+		err = resample_init(&loop->resample, loop->play->format,
+				    loop->play->channels,
+				    (double)loop->play->rate /
+				    (double)loop->capt->rate,
+				    loop->src_converter_type);
+		if (err == -EINVAL) {
+			logit(LOG_CRIT, "built-in samplerate conversion supports only %s, %s or %s formats (play=%s)\n", snd_pcm_format_name(SND_PCM_FORMAT_S16), snd_pcm_format_name(SND_PCM_FORMAT_S32), snd_pcm_format_name(SND_PCM_FORMAT_FLOAT), snd_pcm_format_name(loop->play->format));
+			loop->use_samplerate = 0;
+			err = -EIO;
+			goto __error;
+		}
+		if (err < 0)
+			goto __error;
+		loop->src_out_frames = 0;
+	}
+#ifdef USE_SAMPLERATE
+	else if (loop->use_samplerate) {
 		if ((loop->capt->format != SND_PCM_FORMAT_S16 ||
 		    loop->play->format != SND_PCM_FORMAT_S16) &&
 		    (loop->capt->format != SND_PCM_FORMAT_S32 ||
@@ -1486,7 +1704,7 @@ int pcmjob_start(struct loopback *loop)
 		loop->src_state = NULL;
 	}
 #else
-	if (loop->sync == SYNC_TYPE_SAMPLERATE || loop->use_samplerate) {
+	else if (loop->use_samplerate) {
 		logit(LOG_CRIT, "alsaloop is compiled without libsamplerate support\n");
 		err = -EIO;
 		goto __error;
@@ -1494,10 +1712,8 @@ int pcmjob_start(struct loopback *loop)
 #endif
 	if (verbose) {
 		snd_output_printf(loop->output, "%s sync type: %s", loop->id, sync_types[loop->sync]);
-#ifdef USE_SAMPLERATE
 		if (loop->sync == SYNC_TYPE_SAMPLERATE)
 			snd_output_printf(loop->output, " (%s)", src_types[loop->src_converter_type]);
-#endif
 		snd_output_printf(loop->output, "\n");
 	}
 	lhandle_start(loop->play);
@@ -1513,6 +1729,11 @@ int pcmjob_start(struct loopback *loop)
 	loop->pitch = 1.0;
 	update_pitch(loop);
 	loop->pitch_delta = 1.0 / ((double)loop->capt->rate * 4);
+	loop->pitch_integral = 0;
+	loop->pitch_step = 0;
+	loop->tstamp_ratio = 0;
+	tstamp_reset(loop->play);
+	tstamp_reset(loop->capt);
 	loop->total_queued_count = 0;
 	loop->pitch_diff = 0;
 	count = get_whole_latency(loop) / loop->play->pitch;
@@ -1567,6 +1788,7 @@ int pcmjob_stop(struct loopback *loop)
 		if ((err = snd_pcm_hw_free(loop->play->handle)) < 0)
 			logit(LOG_WARNING, "pcm hw_free %s error: %s\n", loop->play->id, snd_strerror(err));
 		loop->running = 0;
+		loop->pollfd_reinit = 1;
 	}
 	freeloop(loop);
 	return 0;
@@ -1613,9 +1835,7 @@ static snd_pcm_sframes_t get_queued_playback_samples(struct loopback *loop)
 		return 0;
 	loop->play->last_delay = delay;
 	delay += loop->play->buf_count;
-#ifdef USE_SAMPLERATE
 	delay += loop->src_out_frames;
-#endif
 	return delay;
 }
 
@@ -1631,6 +1851,107 @@ static snd_pcm_sframes_t get_queued_capture_samples(struct loopback *loop)
 	return delay;
 }
 
+static void tstamp_reset(struct loopback_handle *lhandle)
+{
+	lhandle->tstamp_n = 0;
+	lhandle->tstamp_mean_t = 0;
+	lhandle->tstamp_mean_pos = 0;
+	lhandle->tstamp_cxx = 0;
+	lhandle->tstamp_cxy = 0;
+}
+
+/*
+ * Collect the (timestamp, stream position) pairs taken by the driver at
+ * the pointer update. The position is the transferred frames plus avail,
+ * it differs from the hardware pointer only by a constant. A new trigger
+ * timestamp means that the stream was restarted.
+ */
+static void tstamp_sample(struct loopback_handle *lhandle)
+{
+	snd_pcm_status_t *status;
+	snd_htimestamp_t trigger, ts;
+	double t, pos, dt;
+
+	snd_pcm_status_alloca(&status);
+	if (snd_pcm_status(lhandle->handle, status) < 0)
+		return;
+	if (snd_pcm_status_get_state(status) != SND_PCM_STATE_RUNNING)
+		return;
+	snd_pcm_status_get_trigger_htstamp(status, &trigger);
+	snd_pcm_status_get_htstamp(status, &ts);
+	if (trigger.tv_sec != lhandle->tstamp_trigger.tv_sec ||
+	    trigger.tv_nsec != lhandle->tstamp_trigger.tv_nsec) {
+		lhandle->tstamp_trigger = trigger;
+		tstamp_reset(lhandle);
+	}
+	t = (double)(ts.tv_sec - trigger.tv_sec) +
+	    (double)(ts.tv_nsec - trigger.tv_nsec) / 1000000000.0;
+	if (lhandle->tstamp_n > 0 && t <= lhandle->tstamp_last)
+		return;
+	if (lhandle->tstamp_n == 0)
+		lhandle->tstamp_start = t;
+	lhandle->tstamp_last = t;
+	pos = (double)lhandle->tstamp_appl + snd_pcm_status_get_avail(status);
+	/* running least squares fit of pos = rate * t + offset */
+	lhandle->tstamp_n++;
+	dt = t - lhandle->tstamp_mean_t;
+	lhandle->tstamp_mean_t += dt / lhandle->tstamp_n;
+	lhandle->tstamp_mean_pos += (pos - lhandle->tstamp_mean_pos) /
+							lhandle->tstamp_n;
+	lhandle->tstamp_cxx += dt * (t - lhandle->tstamp_mean_t);
+	lhandle->tstamp_cxy += dt * (pos - lhandle->tstamp_mean_pos);
+}
+
+/* the measured rate relative to the nominal one, 0 = not enough data */
+static double tstamp_rate(struct loopback_handle *lhandle)
+{
+	double span = (double)lhandle->loopback->play->sync_point /
+					lhandle->loopback->play->rate;
+
+	if (lhandle->tstamp_n < TSTAMP_MIN_SAMPLES ||
+	    lhandle->tstamp_last - lhandle->tstamp_start < span * 0.8 ||
+	    lhandle->tstamp_cxx <= 0)
+		return 0;
+	return lhandle->tstamp_cxy / lhandle->tstamp_cxx / lhandle->rate;
+}
+
+/*
+ * The rate shift sync modes change the clock of the shifted device, so the
+ * measured ratio is the error of the current pitch and the fit restarts
+ * after every pitch change. With the samplerate sync, the device clocks are
+ * not touched and the fit is kept up to TSTAMP_SPAN_MAX seconds.
+ */
+static void tstamp_update(struct loopback *loop)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *capt = loop->capt;
+	double prate = tstamp_rate(play), crate = tstamp_rate(capt);
+	double ratio;
+
+	/* the last estimate stays in use until the next fit is ready */
+	if (prate <= 0 || crate <= 0)
+		return;
+	ratio = crate / prate;
+	if (loop->sync == SYNC_TYPE_CAPTRATESHIFT ||
+	    loop->sync == SYNC_TYPE_PLAYRATESHIFT)
+		ratio *= loop->pitch;
+	if (loop->tstamp_ratio == 0) {
+		/* the drift moves from the controllers to the ratio */
+		loop->pitch_integral = 0;
+		loop->pitch_step = 0;
+	}
+	loop->tstamp_ratio = ratio;
+	if (loop->sync != SYNC_TYPE_CAPTRATESHIFT &&
+	    loop->sync != SYNC_TYPE_PLAYRATESHIFT &&
+	    capt->tstamp_last - capt->tstamp_start < TSTAMP_SPAN_MAX &&
+	    play->tstamp_last - play->tstamp_start < TSTAMP_SPAN_MAX)
+		return;
+	tstamp_reset(play);
+	tstamp_reset(capt);
+	if (verbose > 3)
+		snd_output_printf(loop->output, "%s: timestamp clock ratio %.8f\n", loop->id, loop->tstamp_ratio);
+}
+
 static int ctl_event_check(snd_ctl_elem_value_t *val, snd_ctl_event_t *ev)
 {
 	snd_ctl_elem_id_t *id1, *id2;
@@ -1790,7 +2111,20 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 	if (!loop->running)
 		goto __pcm_end;
 	do {
-		ccount = readit(capt);
+		if (loop->mmap_direct && play->buf_count == 0) {
+			err = copyit(loop);
+			if (err < 0)
+				return err;
+			ccount = pcount = err;
+			if (capt->xrun_pending || play->xrun_pending ||
+			    loop->reinit)
+				break;
+			loopcount--;
+			continue;
+		}
+		/* with mmap_direct, the intermediate buffer holds only
+		   the silence queued by the xrun recovery, drain it first */
+		ccount = loop->mmap_direct ? 0 : readit(capt);
 		buf_add(loop, ccount);
 		if (capt->xrun_pending || loop->reinit)
 			break;
@@ -1821,19 +2155,32 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 		diff = ((double)(((double)play->total_queued * play->pitch) +
 				 ((double)capt->total_queued * capt->pitch)) /
 			(double)loop->total_queued_count) - lat;
-		/* FIXME: this algorithm may be slightly better */
 		if (verbose > 3)
 			snd_output_printf(loop->output, "%s: sync diff %li old diff %li\n", loop->id, diff, loop->pitch_diff);
-		if (diff > 0) {
-			if (diff == loop->pitch_diff)
-				loop->pitch += loop->pitch_delta;
-			else if (diff > loop->pitch_diff)
-				loop->pitch += loop->pitch_delta*2;
-		} else if (diff < 0) {
-			if (diff == loop->pitch_diff)
-				loop->pitch -= loop->pitch_delta;
-			else if (diff < loop->pitch_diff)
-				loop->pitch -= loop->pitch_delta*2;
+		if (loop->tstamp)
+			tstamp_update(loop);
+		if (loop->pitch_bw > 0) {
+			pitch_control(loop, diff);
+		} else {
+			double step = 0;
+			if (diff > 0) {
+				if (diff == loop->pitch_diff)
+					step = loop->pitch_delta;
+				else if (diff > loop->pitch_diff)
+					step = loop->pitch_delta*2;
+			} else if (diff < 0) {
+				if (diff == loop->pitch_diff)
+					step = -loop->pitch_delta;
+				else if (diff < loop->pitch_diff)
+					step = -loop->pitch_delta*2;
+			}
+			if (loop->tstamp_ratio > 0) {
+				/* the timestamps remove the drift, the steps the latency */
+				loop->pitch_step += step;
+				loop->pitch = loop->tstamp_ratio * (1.0 + loop->pitch_step);
+			} else {
+				loop->pitch += step;
+			}
 		}
 		loop->pitch_diff = diff;
 		if (loop->pitch_diff_min > diff)
@@ -1851,6 +2198,10 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 		snd_pcm_sframes_t pqueued, cqueued;
 		pqueued = get_queued_playback_samples(loop);
 		cqueued = get_queued_capture_samples(loop);
+		if (loop->tstamp) {
+			tstamp_sample(play);
+			tstamp_sample(capt);
+		}
 		if (verbose > 4)
 			snd_output_printf(loop->output, "%s: queued %li/%li samples\n", loop->id, pqueued, cqueued);
 		if (pqueued > 0)
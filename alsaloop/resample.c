@@ -0,0 +1,330 @@
+/*
+ *  A simple PCM loopback utility - built-in resampler
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * A polyphase resampler with a continuously variable ratio. A Kaiser
+ * windowed sinc is split into RESAMPLE_PHASES phases, every output frame
+ * is interpolated between the two phases nearest to its position. The ring
+ * buffer samples (S16, S32 or FLOAT) are converted to float only once, on
+ * the way into the per channel history, and the output is written directly
+ * in the stream format.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <alsa/asoundlib.h>
+#include <pthread.h>
+#include <syslog.h>
+#include "alsaloop.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define RESAMPLE_SIMD_X86
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__)
+#define RESAMPLE_ATTR_generic	__attribute__((optimize("tree-vectorize")))
+#define RESAMPLE_ATTR_avx2	__attribute__((target("avx2"), optimize("tree-vectorize")))
+#else
+#define RESAMPLE_ATTR_generic
+#define RESAMPLE_ATTR_avx2	__attribute__((target("avx2")))
+#endif
+
+#define RESAMPLE_PHASES		256
+#define RESAMPLE_CHUNK		1024	/* input frames per history refill */
+#define RESAMPLE_MAX_TAPS	256
+
+static const struct resample_quality {
+	unsigned int taps;	/* at the unity ratio, a multiple of 8 */
+	double cutoff;		/* of the Nyquist frequency */
+	double beta;		/* Kaiser window */
+} resample_qualities[] = {
+	[0] = { 32, 0.91, 8.0 },	/* SRC_BUILTIN */
+	[1] = { 16, 0.85, 6.0 },	/* SRC_BUILTIN_FAST */
+};
+
+struct resample {
+	snd_pcm_format_t format;
+	unsigned int channels;
+	unsigned int taps;
+	float *filter;		/* (RESAMPLE_PHASES + 1) * taps */
+	float *hist;		/* channels * hist_size, planar */
+	unsigned int hist_size;
+	unsigned int fill;	/* frames in the history */
+	double pos;		/* history position of the next output frame */
+	double step;		/* input frames per output frame */
+	float (*dot)(const float *h, const float *x, unsigned int n);
+};
+
+/* n is a multiple of 8, eight partial sums keep the loop vectorizable */
+#define RESAMPLE_DOT(isa) \
+static RESAMPLE_ATTR_##isa float resample_dot_##isa(const float *h, const float *x, unsigned int n) \
+{ \
+	float acc[8] = { 0 }; \
+	unsigned int i, j; \
+	for (i = 0; i < n; i += 8) \
+		for (j = 0; j < 8; j++) \
+			acc[j] += h[i + j] * x[i + j]; \
+	return ((acc[0] + acc[4]) + (acc[1] + acc[5])) + \
+		((acc[2] + acc[6]) + (acc[3] + acc[7])); \
+}
+RESAMPLE_DOT(generic)
+#ifdef RESAMPLE_SIMD_X86
+RESAMPLE_DOT(avx2)
+#endif
+
+/* zeroth order modified Bessel function for the Kaiser window */
+static double bessel_i0(double x)
+{
+	double sum = 1.0, term = 1.0;
+	unsigned int k;
+
+	for (k = 1; k < 64 && term > sum * 1e-12; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+static void resample_filter(struct resample *rs, double cutoff, double beta)
+{
+	double u, x, w, v, sum, i0 = bessel_i0(beta);
+	unsigned int p, k;
+	float *h;
+
+	for (p = 0; p <= RESAMPLE_PHASES; p++) {
+		h = rs->filter + (size_t)p * rs->taps;
+		sum = 0;
+		for (k = 0; k < rs->taps; k++) {
+			/* distance of the history frame k from the output */
+			u = rs->taps / 2 - 1.0 - k + (double)p / RESAMPLE_PHASES;
+			x = u / (rs->taps / 2);
+			w = x * x < 1.0 ? bessel_i0(beta * sqrt(1.0 - x * x)) / i0 : 0;
+			v = u == 0 ? cutoff : sin(M_PI * cutoff * u) / (M_PI * u);
+			h[k] = v * w;
+			sum += h[k];
+		}
+		/* unity gain for every phase */
+		for (k = 0; k < rs->taps; k++)
+			h[k] /= sum;
+	}
+}
+
+static int resample_format_ok(snd_pcm_format_t format)
+{
+	return format == SND_PCM_FORMAT_S16 ||
+	       format == SND_PCM_FORMAT_S32 ||
+	       format == SND_PCM_FORMAT_FLOAT;
+}
+
+int resample_init(struct resample **_rs, snd_pcm_format_t format,
+		  unsigned int channels, double ratio, int converter)
+{
+	const struct resample_quality *q;
+	struct resample *rs;
+	double cutoff;
+
+	if (!resample_format_ok(format) || channels == 0 || ratio <= 0)
+		return -EINVAL;
+	if (converter == SRC_BUILTIN_FAST)
+		q = &resample_qualities[1];
+	else
+		q = &resample_qualities[0];
+	rs = calloc(1, sizeof(*rs));
+	if (rs == NULL)
+		return -ENOMEM;
+	rs->format = format;
+	rs->channels = channels;
+	/* the filter gets longer with the lower cutoff of decimation */
+	rs->taps = q->taps;
+	cutoff = q->cutoff;
+	if (ratio < 1.0) {
+		cutoff *= ratio;
+		rs->taps = ((unsigned int)(q->taps / ratio) + 7) & ~7;
+		if (rs->taps > RESAMPLE_MAX_TAPS)
+			rs->taps = RESAMPLE_MAX_TAPS;
+	}
+	rs->hist_size = rs->taps + RESAMPLE_CHUNK;
+	rs->filter = malloc((size_t)(RESAMPLE_PHASES + 1) * rs->taps * sizeof(float));
+	rs->hist = calloc((size_t)channels * rs->hist_size, sizeof(float));
+	if (rs->filter == NULL || rs->hist == NULL) {
+		resample_done(rs);
+		return -ENOMEM;
+	}
+	resample_filter(rs, cutoff, q->beta);
+	rs->dot = resample_dot_generic;
+#ifdef RESAMPLE_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		rs->dot = resample_dot_avx2;
+#endif
+	/* the output of frame 0 is centered on the first input frame */
+	rs->fill = rs->taps / 2 - 1;
+	rs->pos = 0;
+	resample_set_ratio(rs, ratio);
+	*_rs = rs;
+	return 0;
+}
+
+void resample_done(struct resample *rs)
+{
+	if (rs == NULL)
+		return;
+	free(rs->filter);
+	free(rs->hist);
+	free(rs);
+}
+
+/* ratio is output rate / input rate, it may change at any time */
+void resample_set_ratio(struct resample *rs, double ratio)
+{
+	rs->step = 1.0 / ratio;
+}
+
+/* the input frames held in the history, in the output frames */
+snd_pcm_uframes_t resample_delay(struct resample *rs)
+{
+	double pending = rs->fill - rs->pos - (rs->taps / 2 - 1);
+
+	return pending > 0 ? pending / rs->step : 0;
+}
+
+static void resample_decode(struct resample *rs, const char *src,
+			    unsigned int frames)
+{
+	unsigned int channels = rs->channels, c, i;
+	float *x;
+
+	for (c = 0; c < channels; c++) {
+		x = rs->hist + (size_t)c * rs->hist_size + rs->fill;
+		switch (rs->format) {
+		case SND_PCM_FORMAT_S16: {
+			const short *s = (const short *)src + c;
+			for (i = 0; i < frames; i++, s += channels)
+				x[i] = *s * (1.0f / 32768.0f);
+			break;
+		}
+		case SND_PCM_FORMAT_S32: {
+			const int *s = (const int *)src + c;
+			for (i = 0; i < frames; i++, s += channels)
+				x[i] = *s * (1.0f / 2147483648.0f);
+			break;
+		}
+		default: {
+			const float *s = (const float *)src + c;
+			for (i = 0; i < frames; i++, s += channels)
+				x[i] = *s;
+			break;
+		}
+		}
+	}
+	rs->fill += frames;
+}
+
+static void resample_encode(struct resample *rs, char *dst, unsigned int c,
+			    float v)
+{
+	switch (rs->format) {
+	case SND_PCM_FORMAT_S16:
+		v = v * 32768.0f;
+		((short *)dst)[c] = v >= 32767.0f ? 32767 :
+				    v <= -32768.0f ? -32768 : (short)lrintf(v);
+		break;
+	case SND_PCM_FORMAT_S32: {
+		double d = (double)v * 2147483648.0;
+		((int *)dst)[c] = d >= 2147483647.0 ? 2147483647 :
+				  d <= -2147483648.0 ? (int)-2147483648LL :
+				  (int)lrint(d);
+		break;
+	}
+	default:
+		((float *)dst)[c] = v;
+		break;
+	}
+}
+
+/* drop the history before the frame idx */
+static void resample_shift(struct resample *rs, unsigned int idx)
+{
+	unsigned int c;
+	float *x;
+
+	if (idx > rs->fill)
+		idx = rs->fill;
+	if (idx == 0)
+		return;
+	for (c = 0; c < rs->channels; c++) {
+		x = rs->hist + (size_t)c * rs->hist_size;
+		memmove(x, x + idx, (rs->fill - idx) * sizeof(float));
+	}
+	rs->fill -= idx;
+	rs->pos -= idx;
+}
+
+/*
+ * Convert up to *in_frames frames from in to up to out_frames frames to out.
+ * The input is taken only as far as the output needs it, *in_frames is set
+ * to the consumed frames. Returns the produced frames.
+ */
+snd_pcm_uframes_t resample_process(struct resample *rs,
+				   const char *in, snd_pcm_uframes_t *in_frames,
+				   char *out, snd_pcm_uframes_t out_frames)
+{
+	unsigned int frame_size = snd_pcm_format_physical_width(rs->format) / 8 *
+				  rs->channels;
+	snd_pcm_uframes_t used = 0, done = 0, n;
+	unsigned int idx, phase, c;
+	const float *h0, *h1, *x;
+	double pos;
+	float frac, y0, y1;
+
+	while (done < out_frames) {
+		idx = (unsigned int)rs->pos;
+		if (idx + rs->taps > rs->fill) {
+			if (used >= *in_frames)
+				break;
+			resample_shift(rs, idx);
+			n = *in_frames - used;
+			if (n > rs->hist_size - rs->fill)
+				n = rs->hist_size - rs->fill;
+			resample_decode(rs, in + used * frame_size, n);
+			used += n;
+			continue;
+		}
+		pos = (rs->pos - idx) * RESAMPLE_PHASES;
+		phase = (unsigned int)pos;
+		frac = pos - phase;
+		h0 = rs->filter + (size_t)phase * rs->taps;
+		h1 = h0 + rs->taps;
+		for (c = 0; c < rs->channels; c++) {
+			x = rs->hist + (size_t)c * rs->hist_size + idx;
+			y0 = rs->dot(h0, x, rs->taps);
+			y1 = rs->dot(h1, x, rs->taps);
+			resample_encode(rs, out + done * frame_size, c,
+					y0 + (y1 - y0) * frac);
+		}
+		done++;
+		rs->pos += rs->step;
+	}
+	*in_frames = used;
+	return done;
+}
@@ -40,10 +40,17 @@
 #include <time.h>
 #include <endian.h>
 #include <locale.h>
+#include <math.h>
 #include <alsa/asoundlib.h>
 #include <assert.h>
 #include <termios.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
 #include <sys/poll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
 #include <sys/uio.h>
 #include <sys/time.h>
 #include <sys/signal.h>
@@ -54,6 +61,11 @@
 #include "formats.h"
 #include "version.h"
 
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <immintrin.h>
+#define PEAK_SIMD_X86
+#endif
+
 #ifndef LLONG_MAX
 #define LLONG_MAX    9223372036854775807LL
 #endif
@@ -66,6 +78,8 @@
 #define FORMAT_VOC		1
 #define FORMAT_WAVE		2
 #define FORMAT_AU		3
+#define FORMAT_RF64		4
+#define FORMAT_W64		5
 
 /* global data */
 
@@ -93,6 +107,7 @@ static int file_type = FORMAT_DEFAULT;
 static int open_mode = 0;
 static snd_pcm_stream_t stream = SND_PCM_STREAM_PLAYBACK;
 static int mmap_flag = 0;
+static int mmap_direct = 0;
 static int interleaved = 1;
 static int nonblock = 0;
 static u_char *audiobuf = NULL;
@@ -101,6 +116,8 @@ static unsigned period_time = 0;
 static unsigned buffer_time = 0;
 static snd_pcm_uframes_t period_frames = 0;
 static snd_pcm_uframes_t buffer_frames = 0;
+static snd_pcm_uframes_t start_threshold_frames = 0;
+static snd_pcm_uframes_t wakeup_frames = 0;
 static int avail_min = -1;
 static int start_delay = 0;
 static int stop_delay = 0;
@@ -108,16 +125,58 @@ static int monotonic = 0;
 static int can_pause = 0;
 static int verbose = 0;
 static int vumeter = VUMETER_NONE;
+static char *meter_name = NULL;
+static FILE *meter_file = NULL;
+static int meter_interval = 100;
 static int buffer_pos = 0;
 static size_t bits_per_sample, bits_per_frame;
 static size_t chunk_bytes;
 static int test_position = 0;
 static int test_coef = 8;
 static int test_nowait = 0;
-static snd_output_t *log;
+static int no_period_wakeup = 0;
+static snd_output_t *log_output;
 static long long max_file_size = 0;
 static int max_file_time = 0;
 static int use_strftime = 0;
+static int async_write_time = 0;
+static int read_ahead = 0;
+static int io_threads = 0;
+static double trigger_level = 0;	/* linear, 0 = not triggered */
+static int trigger_rms = 0;
+static int pre_roll_time = 1000;	/* ms */
+static int hang_time = 2000;		/* ms */
+
+#define TEE_MAX		8
+static char *tee_specs[TEE_MAX];
+static unsigned int tee_count;
+static int seek_index_frames = 0;
+static char *start_time = NULL;
+static int gapless = 0;
+static snd_pcm_format_t device_format = SND_PCM_FORMAT_UNKNOWN;
+static int resample_quality = -1;
+static unsigned int device_rate = 0;
+static int rt_priority = 0;
+static char *rt_cpus = NULL;
+static int rt_mlock = 0;
+static char *device_channels = NULL;
+
+#define LINK_MAX	16
+
+/* devices started together with snd_pcm_link(), one channel slice each */
+static struct linked_pcms {
+	unsigned int count;
+	int linked;
+	struct linked_pcm {
+		char *name;
+		snd_pcm_t *handle;
+		unsigned int first;		/* first channel in the file */
+		unsigned int channels;
+		snd_pcm_uframes_t written;	/* frames since the start */
+	} pcm[LINK_MAX];
+} linked;
+static char *latency_name = NULL;
+
 volatile static int recycle_capture_file = 0;
 static long term_c_lflag = -1;
 
@@ -132,22 +191,47 @@ static int pidfile_written = 0;
 /* needed prototypes */
 
 static void done_stdin(void);
+static void capture_writer_flush(void);
+static void capture_rotation_flush(void);
+static void tee_flush(void);
+static void peak_meter_init(void);
+static long long time_us(void);
+static void converter_report(void);
+static int resampler_quality(const char *name);
+static void resampler_report(void);
+static void rt_setup(void);
+static void rt_report(void);
+static void latency_start(void);
+static void latency_flush(void);
+static void latency_stop(void);
+static void latency_xrun(void);
+static void seek_index_xrun(snd_pcm_status_t *status);
+static void seek_start(const char *name, size_t *loaded);
+static void trigger_fold(size_t frames);
 
 static void playback(char *filename);
 static void capture(char *filename);
 static void playbackv(char **filenames, unsigned int count);
+static void playback_gapless(char **names, unsigned int count);
+static void playback_linked(int fd, size_t loaded, off64_t count, int rtype, char *name);
+static void linked_open(void);
+static void linked_close(void);
 static void capturev(char **filenames, unsigned int count);
 
 static void begin_voc(int fd, size_t count);
-static void end_voc(int fd);
+static void end_voc(int fd, off64_t count);
 static void begin_wave(int fd, size_t count);
-static void end_wave(int fd);
+static void end_wave(int fd, off64_t count);
 static void begin_au(int fd, size_t count);
-static void end_au(int fd);
+static void end_au(int fd, off64_t count);
+static void begin_rf64(int fd, size_t count);
+static void end_rf64(int fd, off64_t count);
+static void begin_w64(int fd, size_t count);
+static void end_w64(int fd, off64_t count);
 
 static const struct fmt_capture {
 	void (*start) (int fd, size_t count);
-	void (*end) (int fd);
+	void (*end) (int fd, off64_t count);
 	char *what;
 	long long max_filesize;
 } fmt_rec_table[] = {
@@ -155,7 +239,10 @@ static const struct fmt_capture {
 	{	begin_voc,	end_voc,	N_("VOC"),		16000000LL },
 	/* FIXME: can WAV handle exactly 2GB or less than it? */
 	{	begin_wave,	end_wave,	N_("WAVE"),		2147483648LL },
-	{	begin_au,	end_au,		N_("Sparc Audio"),	LLONG_MAX }
+	{	begin_au,	end_au,		N_("Sparc Audio"),	LLONG_MAX },
+	/* plain WAVE until 2GB, converted to RF64 when it grows bigger */
+	{	begin_rf64,	end_rf64,	N_("RF64"),		LLONG_MAX },
+	{	begin_w64,	end_w64,	N_("Wave64"),		LLONG_MAX }
 };
 
 #if __GNUC__ > 2 || (__GNUC__ == 2 && __GNUC_MINOR__ >= 95)
@@ -182,14 +269,16 @@ _("Usage: %s [OPTION]... [FILE]...\n"
 "    --version           print current version\n"
 "-l, --list-devices      list all soundcards and digital audio devices\n"
 "-L, --list-pcms         list device names\n"
-"-D, --device=NAME       select PCM by name\n"
+"-D, --device=NAME       select PCM by name (repeat to play on linked devices)\n"
 "-q, --quiet             quiet mode\n"
-"-t, --file-type TYPE    file type (voc, wav, raw or au)\n"
+"-t, --file-type TYPE    file type (voc, wav, rf64, w64, raw or au)\n"
 "-c, --channels=#        channels\n"
 "-f, --format=FORMAT     sample format (case insensitive)\n"
 "-r, --rate=#            sample rate\n"
 "-d, --duration=#        interrupt after # seconds\n"
 "-M, --mmap              mmap stream\n"
+"    --mmap-direct       mmap stream, transfer the file data directly from/to\n"
+"                        the ring buffer (vmsplice to an output pipe)\n"
 "-N, --nonblock          nonblocking mode\n"
 "-F, --period-time=#     distance between interrupts is # microseconds\n"
 "-B, --buffer-time=#     buffer duration is # microseconds\n"
@@ -201,6 +290,8 @@ _("Usage: %s [OPTION]... [FILE]...\n"
 "-T, --stop-delay=#      delay for automatic PCM stop is # microseconds from xrun\n"
 "-v, --verbose           show PCM structure and setup (accumulative)\n"
 "-V, --vumeter=TYPE      enable VU meter (TYPE: mono or stereo)\n"
+"    --meter-file=FILE   write per-channel peak/RMS levels to FILE (JSON lines)\n"
+"    --meter-interval=#  interval between meter records in milliseconds\n"
 "-I, --separate-channels one file for each channel\n"
 "    --disable-resample  disable automatic rate resample\n"
 "    --disable-channels  disable automatic channel conversions\n"
@@ -210,10 +301,43 @@ _("Usage: %s [OPTION]... [FILE]...\n"
 "    --test-coef=#	 test coeficient for ring buffer position (default 8)\n"
 "                        expression for validation is: coef * (buffer_size / 2)\n"
 "    --test-nowait       do not wait for ring buffer - eats whole CPU\n"
+"    --no-period-wakeup  wake up from a timer instead of period interrupts\n"
+"                        (nonblocking mode only)\n"
 "    --max-file-time=#   start another output file when the old file has recorded\n"
 "                        for this many seconds\n"
 "    --process-id-file   write the process ID here\n"
-"    --use-strftime      apply the strftime facility to the output file name\n")
+"    --use-strftime      apply the strftime facility to the output file name\n"
+"    --async-write=#     write the captured data from a separate thread using\n"
+"                        a ring buffer of # seconds\n"
+"    --read-ahead=#      read the played file from a separate thread keeping\n"
+"                        # chunks queued ahead of the PCM writes\n"
+"    --gapless           play files with equal parameters without gaps\n"
+"    --device-format=FORMAT  convert the samples to FORMAT for the device\n"
+"                        in aplay instead of the alsa-lib plugins\n"
+"    --device-channels=#[,#...]  channels of each linked device\n"
+"    --latency-stats=FILE  write transfer latency and jitter histograms\n"
+"                        as JSON to FILE on exit and on SIGUSR2\n"
+"    --io-threads=#      read/write the separate channel files (-I) from\n"
+"                        # threads, overlapped with the PCM transfers\n"
+"    --trigger-level=dB  record only while the peak is above dB (dBFS),\n"
+"                        one numbered file per event\n"
+"    --trigger-rms       compare the RMS level instead of the peak\n"
+"    --pre-roll=#        recorded time before the trigger in ms (default 1000)\n"
+"    --hang-time=#       time below the level before the file is closed in ms\n"
+"                        (default 2000)\n"
+"    --tee=FILE[,type=TYPE][,drop]  also write the captured data to FILE\n"
+"                        (TYPE peak writes the levels), drop chunks when\n"
+"                        the output is too slow instead of waiting\n"
+"    --seek-index=#      write a FILE.idx time index entry every # frames\n"
+"    --start-time=TIME   start playing at TIME found in FILE.idx:\n"
+"                        +[[H:]M:]S from the start, H:M[:S] time of day\n"
+"                        or YYYY-MM-DD HH:MM:SS\n"
+"    --resample=QUALITY  convert the rate in aplay (fast, medium, high, best)\n"
+"                        instead of the alsa-lib rate plugin\n"
+"    --device-rate=#     run the device at # Hz, resampled in aplay\n"
+"    --rt-priority=#     run with the SCHED_FIFO realtime priority #\n"
+"    --cpu-affinity=LIST run on the CPUs in LIST (e.g. 2,4-7)\n"
+"    --mlock             lock the memory and prefault the buffers\n")
 		, command);
 	printf(_("Recognized sample formats are:"));
 	for (k = 0; k < SND_PCM_FORMAT_LAST; ++k) {
@@ -356,6 +480,23 @@ static void prg_exit(int code)
 	exit(code);
 }
 
+static int parse_file_type(const char *name)
+{
+	if (strcasecmp(name, "raw") == 0)
+		return FORMAT_RAW;
+	if (strcasecmp(name, "voc") == 0)
+		return FORMAT_VOC;
+	if (strcasecmp(name, "wav") == 0)
+		return FORMAT_WAVE;
+	if (strcasecmp(name, "rf64") == 0)
+		return FORMAT_RF64;
+	if (strcasecmp(name, "w64") == 0)
+		return FORMAT_W64;
+	if (strcasecmp(name, "au") == 0 || strcasecmp(name, "sparc") == 0)
+		return FORMAT_AU;
+	return FORMAT_DEFAULT;
+}
+
 static void signal_handler(int sig)
 {
 	if (verbose==2)
@@ -363,12 +504,14 @@ static void signal_handler(int sig)
 	if (!quiet_mode)
 		fprintf(stderr, _("Aborted by signal %s...\n"), strsignal(sig));
 	if (stream == SND_PCM_STREAM_CAPTURE) {
-		if (fmt_rec_table[file_type].end) {
-			fmt_rec_table[file_type].end(fd);
-			fd = -1;
-		}
+		capture_writer_flush();
+		capture_rotation_flush();
+		tee_flush();
+		if (fmt_rec_table[file_type].end && fd >= 0)
+			fmt_rec_table[file_type].end(fd, fdcount);
 		stream = -1;
 	}
+	latency_flush();
 	if (fd > 1) {
 		close(fd);
 		fd = -1;
@@ -380,6 +523,9 @@ static void signal_handler(int sig)
 	prg_exit(EXIT_FAILURE);
 }
 
+/* call on SIGUSR2 signal. */
+static void signal_handler_latency(int sig);
+
 /* call on SIGUSR1 signal. */
 static void signal_handler_recycle (int sig)
 {
@@ -398,9 +544,32 @@ enum {
 	OPT_TEST_POSITION,
 	OPT_TEST_COEF,
 	OPT_TEST_NOWAIT,
+	OPT_NO_PERIOD_WAKEUP,
 	OPT_MAX_FILE_TIME,
 	OPT_PROCESS_ID_FILE,
-	OPT_USE_STRFTIME
+	OPT_USE_STRFTIME,
+	OPT_MMAP_DIRECT,
+	OPT_ASYNC_WRITE,
+	OPT_METER_FILE,
+	OPT_METER_INTERVAL,
+	OPT_READ_AHEAD,
+	OPT_GAPLESS,
+	OPT_DEVICE_FORMAT,
+	OPT_DEVICE_CHANNELS,
+	OPT_LATENCY_STATS,
+	OPT_IO_THREADS,
+	OPT_TRIGGER_LEVEL,
+	OPT_TRIGGER_RMS,
+	OPT_PRE_ROLL,
+	OPT_HANG_TIME,
+	OPT_TEE,
+	OPT_SEEK_INDEX,
+	OPT_START_TIME,
+	OPT_RESAMPLE,
+	OPT_DEVICE_RATE,
+	OPT_RT_PRIORITY,
+	OPT_CPU_AFFINITY,
+	OPT_MLOCK
 };
 
 int main(int argc, char *argv[])
@@ -421,6 +590,7 @@ int main(int argc, char *argv[])
 		{"rate", 1, 0, 'r'},
 		{"duration", 1, 0 ,'d'},
 		{"mmap", 0, 0, 'M'},
+		{"mmap-direct", 0, 0, OPT_MMAP_DIRECT},
 		{"nonblock", 0, 0, 'N'},
 		{"period-time", 1, 0, 'F'},
 		{"period-size", 1, 0, OPT_PERIOD_SIZE},
@@ -431,6 +601,8 @@ int main(int argc, char *argv[])
 		{"buffer-size", 1, 0, OPT_BUFFER_SIZE},
 		{"verbose", 0, 0, 'v'},
 		{"vumeter", 1, 0, 'V'},
+		{"meter-file", 1, 0, OPT_METER_FILE},
+		{"meter-interval", 1, 0, OPT_METER_INTERVAL},
 		{"separate-channels", 0, 0, 'I'},
 		{"playback", 0, 0, 'P'},
 		{"capture", 0, 0, 'C'},
@@ -441,9 +613,29 @@ int main(int argc, char *argv[])
 		{"test-position", 0, 0, OPT_TEST_POSITION},
 		{"test-coef", 1, 0, OPT_TEST_COEF},
 		{"test-nowait", 0, 0, OPT_TEST_NOWAIT},
+		{"no-period-wakeup", 0, 0, OPT_NO_PERIOD_WAKEUP},
 		{"max-file-time", 1, 0, OPT_MAX_FILE_TIME},
 		{"process-id-file", 1, 0, OPT_PROCESS_ID_FILE},
 		{"use-strftime", 0, 0, OPT_USE_STRFTIME},
+		{"async-write", 1, 0, OPT_ASYNC_WRITE},
+		{"read-ahead", 1, 0, OPT_READ_AHEAD},
+		{"gapless", 0, 0, OPT_GAPLESS},
+		{"device-format", 1, 0, OPT_DEVICE_FORMAT},
+		{"device-channels", 1, 0, OPT_DEVICE_CHANNELS},
+		{"latency-stats", 1, 0, OPT_LATENCY_STATS},
+		{"io-threads", 1, 0, OPT_IO_THREADS},
+		{"trigger-level", 1, 0, OPT_TRIGGER_LEVEL},
+		{"trigger-rms", 0, 0, OPT_TRIGGER_RMS},
+		{"pre-roll", 1, 0, OPT_PRE_ROLL},
+		{"hang-time", 1, 0, OPT_HANG_TIME},
+		{"tee", 1, 0, OPT_TEE},
+		{"seek-index", 1, 0, OPT_SEEK_INDEX},
+		{"start-time", 1, 0, OPT_START_TIME},
+		{"resample", 1, 0, OPT_RESAMPLE},
+		{"device-rate", 1, 0, OPT_DEVICE_RATE},
+		{"rt-priority", 1, 0, OPT_RT_PRIORITY},
+		{"cpu-affinity", 1, 0, OPT_CPU_AFFINITY},
+		{"mlock", 0, 0, OPT_MLOCK},
 		{0, 0, 0, 0}
 	};
 	char *pcm_name = "default";
@@ -458,7 +650,7 @@ int main(int argc, char *argv[])
 
 	snd_pcm_info_alloca(&info);
 
-	err = snd_output_stdio_attach(&log, stderr, 0);
+	err = snd_output_stdio_attach(&log_output, stderr, 0);
 	assert(err >= 0);
 
 	command = argv[0];
@@ -497,20 +689,18 @@ int main(int argc, char *argv[])
 			break;
 		case 'D':
 			pcm_name = optarg;
+			if (linked.count >= LINK_MAX) {
+				error(_("too many devices (max %i)"), LINK_MAX);
+				return 1;
+			}
+			linked.pcm[linked.count++].name = optarg;
 			break;
 		case 'q':
 			quiet_mode = 1;
 			break;
 		case 't':
-			if (strcasecmp(optarg, "raw") == 0)
-				file_type = FORMAT_RAW;
-			else if (strcasecmp(optarg, "voc") == 0)
-				file_type = FORMAT_VOC;
-			else if (strcasecmp(optarg, "wav") == 0)
-				file_type = FORMAT_WAVE;
-			else if (strcasecmp(optarg, "au") == 0 || strcasecmp(optarg, "sparc") == 0)
-				file_type = FORMAT_AU;
-			else {
+			file_type = parse_file_type(optarg);
+			if (file_type == FORMAT_DEFAULT) {
 				error(_("unrecognized file format %s"), optarg);
 				return 1;
 			}
@@ -593,9 +783,21 @@ int main(int argc, char *argv[])
 			else
 				vumeter = VUMETER_NONE;
 			break;
+		case OPT_METER_FILE:
+			meter_name = optarg;
+			break;
+		case OPT_METER_INTERVAL:
+			meter_interval = strtol(optarg, NULL, 0);
+			if (meter_interval < 1)
+				meter_interval = 1;
+			break;
 		case 'M':
 			mmap_flag = 1;
 			break;
+		case OPT_MMAP_DIRECT:
+			mmap_flag = 1;
+			mmap_direct = 1;
+			break;
 		case 'I':
 			interleaved = 0;
 			break;
@@ -633,6 +835,9 @@ int main(int argc, char *argv[])
 		case OPT_TEST_NOWAIT:
 			test_nowait = 1;
 			break;
+		case OPT_NO_PERIOD_WAKEUP:
+			no_period_wakeup = 1;
+			break;
 		case OPT_MAX_FILE_TIME:
 			max_file_time = strtol(optarg, NULL, 0);
 			break;
@@ -642,6 +847,103 @@ int main(int argc, char *argv[])
 		case OPT_USE_STRFTIME:
 			use_strftime = 1;
 			break;
+		case OPT_GAPLESS:
+			gapless = 1;
+			break;
+		case OPT_DEVICE_CHANNELS:
+			device_channels = optarg;
+			break;
+		case OPT_LATENCY_STATS:
+			latency_name = optarg;
+			break;
+		case OPT_IO_THREADS:
+			io_threads = strtol(optarg, NULL, 0);
+			if (io_threads < 0)
+				io_threads = 0;
+			break;
+		case OPT_TRIGGER_LEVEL:
+			trigger_level = strtod(optarg, NULL);
+			if (trigger_level >= 0) {
+				error(_("trigger level must be below 0 dBFS"));
+				return 1;
+			}
+			trigger_level = pow(10.0, trigger_level / 20.0);
+			break;
+		case OPT_TRIGGER_RMS:
+			trigger_rms = 1;
+			break;
+		case OPT_PRE_ROLL:
+			pre_roll_time = strtol(optarg, NULL, 0);
+			if (pre_roll_time < 0)
+				pre_roll_time = 0;
+			break;
+		case OPT_HANG_TIME:
+			hang_time = strtol(optarg, NULL, 0);
+			if (hang_time < 0)
+				hang_time = 0;
+			break;
+		case OPT_TEE:
+			if (tee_count >= TEE_MAX) {
+				error(_("too many --tee outputs (max %i)"), TEE_MAX);
+				return 1;
+			}
+			tee_specs[tee_count++] = optarg;
+			break;
+		case OPT_SEEK_INDEX:
+			seek_index_frames = strtol(optarg, NULL, 0);
+			if (seek_index_frames < 1) {
+				error(_("invalid seek index interval %s"), optarg);
+				return 1;
+			}
+			break;
+		case OPT_START_TIME:
+			start_time = optarg;
+			break;
+		case OPT_RESAMPLE:
+			resample_quality = resampler_quality(optarg);
+			if (resample_quality < 0) {
+				error(_("unknown resampler quality '%s'"), optarg);
+				prg_exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_DEVICE_RATE:
+			device_rate = strtol(optarg, NULL, 0);
+			if (device_rate < 2000 || device_rate > 768000) {
+				error(_("bad device rate %s"), optarg);
+				prg_exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_RT_PRIORITY:
+			rt_priority = strtol(optarg, NULL, 0);
+			if (rt_priority < sched_get_priority_min(SCHED_FIFO) ||
+			    rt_priority > sched_get_priority_max(SCHED_FIFO)) {
+				error(_("bad realtime priority %s"), optarg);
+				prg_exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_CPU_AFFINITY:
+			rt_cpus = optarg;
+			break;
+		case OPT_MLOCK:
+			rt_mlock = 1;
+			break;
+		case OPT_DEVICE_FORMAT:
+			device_format = snd_pcm_format_value(optarg);
+			if (device_format == SND_PCM_FORMAT_UNKNOWN) {
+				error(_("wrong extended format '%s'"), optarg);
+				prg_exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_READ_AHEAD:
+			read_ahead = strtol(optarg, NULL, 0);
+			if (read_ahead < 0)
+				read_ahead = 0;
+			break;
+		case OPT_ASYNC_WRITE:
+			async_write_time = strtol(optarg, NULL, 0);
+			if (async_write_time < 0)
+				async_write_time = 0;
+			break;
 		default:
 			fprintf(stderr, _("Try `%s --help' for more information.\n"), command);
 			return 1;
@@ -657,17 +959,50 @@ int main(int argc, char *argv[])
 		goto __end;
 	}
 
+	if (device_rate && resample_quality < 0)
+		resample_quality = resampler_quality("high");
+	if (resample_quality >= 0) {
+		if (stream != SND_PCM_STREAM_PLAYBACK || !interleaved || linked.count > 1) {
+			error(_("resampling is supported only for interleaved playback on one device"));
+			return 1;
+		}
+		/* the resampler replaces the rate plugin */
+		open_mode |= SND_PCM_NO_AUTO_RESAMPLE;
+	}
+
+	if (gapless && stream == SND_PCM_STREAM_PLAYBACK && (read_ahead || mmap_direct)) {
+		error(_("--gapless cannot be used with --read-ahead or --mmap-direct"));
+		return 1;
+	}
+
+	if (linked.count > 1) {
+		if (stream != SND_PCM_STREAM_PLAYBACK || !interleaved || gapless) {
+			error(_("multiple devices are supported only for interleaved playback"));
+			return 1;
+		}
+		pcm_name = linked.pcm[0].name;
+	}
+
+	rt_setup();
+
 	err = snd_pcm_open(&handle, pcm_name, stream, open_mode);
 	if (err < 0) {
 		error(_("audio open error: %s"), snd_strerror(err));
 		return 1;
 	}
+	if (linked.count > 1)
+		linked_open();
 
 	if ((err = snd_pcm_info(handle, info)) < 0) {
 		error(_("info error: %s"), snd_strerror(err));
 		return 1;
 	}
 
+	if (no_period_wakeup && !nonblock) {
+		error(_("--no-period-wakeup requires the nonblocking mode (-N)"));
+		return 1;
+	}
+
 	if (nonblock) {
 		err = snd_pcm_nonblock(handle, 1);
 		if (err < 0) {
@@ -697,6 +1032,15 @@ int main(int argc, char *argv[])
 		readn_func = snd_pcm_readn;
 	}
 
+	if (meter_name) {
+		meter_file = fopen(meter_name, "w");
+		if (meter_file == NULL) {
+			error(_("Cannot create meter file %s: %s"),
+			      meter_name, strerror(errno));
+			return 1;
+		}
+	}
+
 	if (pidfile_name) {
 		errno = 0;
 		pidf = fopen (pidfile_name, "w");
@@ -715,12 +1059,18 @@ int main(int argc, char *argv[])
 	signal(SIGTERM, signal_handler);
 	signal(SIGABRT, signal_handler);
 	signal(SIGUSR1, signal_handler_recycle);
+	if (latency_name) {
+		latency_start();
+		signal(SIGUSR2, signal_handler_latency);
+	}
 	if (interleaved) {
 		if (optind > argc - 1) {
 			if (stream == SND_PCM_STREAM_PLAYBACK)
 				playback(NULL);
 			else
 				capture(NULL);
+		} else if (gapless && stream == SND_PCM_STREAM_PLAYBACK) {
+			playback_gapless(&argv[optind], argc - optind);
 		} else {
 			while (optind <= argc - 1) {
 				if (stream == SND_PCM_STREAM_PLAYBACK)
@@ -737,11 +1087,16 @@ int main(int argc, char *argv[])
 	}
 	if (verbose==2)
 		putchar('\n');
+	converter_report();
+	resampler_report();
+	rt_report();
+	latency_stop();
+	linked_close();
 	snd_pcm_close(handle);
 	handle = NULL;
 	free(audiobuf);
       __end:
-	snd_output_close(log);
+	snd_output_close(log_output);
 	snd_config_update_free_global();
 	prg_exit(EXIT_SUCCESS);
 	/* avoid warning */
@@ -810,51 +1165,140 @@ static size_t test_wavefile_read(int fd, u_char *buffer, size_t *size, size_t re
 		} \
 	}
 
+/*
+ * skip the rest of a chunk, seek over large chunks instead of reading them
+ */
+static void test_wavefile_skip(int fd, u_char *buffer, size_t *size, off64_t len, int line)
+{
+	u_char tmp[4096];
+	size_t c;
+
+	if ((off64_t)*size >= len) {
+		memmove(buffer, buffer + len, *size - len);
+		*size -= len;
+		return;
+	}
+	len -= *size;
+	*size = 0;
+	if (lseek64(fd, len, SEEK_CUR) != (off64_t)-1)
+		return;
+	while (len > 0) {
+		c = len > (off64_t)sizeof(tmp) ? sizeof(tmp) : (size_t)len;
+		if ((size_t)safe_read(fd, tmp, c) != c) {
+			error(_("read error (called from line %i)"), line);
+			prg_exit(EXIT_FAILURE);
+		}
+		len -= c;
+	}
+}
+
+/*
+ * read the next chunk header, returns the chunk id (the first four bytes
+ * of the GUID for Wave64) and the length of the chunk body
+ */
+static u_int test_wavefile_chunk(int fd, u_char **buffer, size_t *size,
+				 size_t *blimit, int w64, off64_t *len)
+{
+	size_t hsize = w64 ? sizeof(W64ChunkHeader) : sizeof(WaveChunkHeader);
+	u_int type;
+
+	check_wavefile_space(*buffer, hsize, *blimit);
+	test_wavefile_read(fd, *buffer, size, hsize, __LINE__);
+	if (w64) {
+		W64ChunkHeader *c = (W64ChunkHeader *)*buffer;
+		memcpy(&type, c->guid, 4);
+		if (memcmp(c->guid + 4, W64_GUID_TAG, 12) != 0)
+			type = 0;
+		*len = LE_LONG(c->length) - sizeof(W64ChunkHeader);
+		if (*len < 0) {
+			error(_("invalid Wave64 chunk length"));
+			prg_exit(EXIT_FAILURE);
+		}
+	} else {
+		WaveChunkHeader *c = (WaveChunkHeader *)*buffer;
+		type = c->type;
+		*len = LE_INT(c->length);
+	}
+	if (*size > hsize)
+		memmove(*buffer, *buffer + hsize, *size - hsize);
+	*size -= hsize;
+	return type;
+}
+
+/* type of the last file accepted by test_wavefile() */
+static int wavefile_type = FORMAT_WAVE;
+
 /*
  * test, if it's a .WAV file, > 0 if ok (and set the speed, stereo etc.)
  *                            == 0 if not
  * Value returned is bytes to be discarded.
+ * RF64 and Sony Wave64 files are accepted as well, wavefile_type is set
+ * accordingly.
  */
 static ssize_t test_wavefile(int fd, u_char *_buffer, size_t size)
 {
 	WaveHeader *h = (WaveHeader *)_buffer;
 	u_char *buffer = NULL;
 	size_t blimit = 0;
+	size_t hsize = sizeof(WaveHeader);
 	WaveFmtBody *f;
-	WaveChunkHeader *c;
-	u_int type, len;
+	u_int type;
+	off64_t len, pad;
+	off64_t ds64_data = -1;
+	int w64 = 0;
 
 	if (size < sizeof(WaveHeader))
 		return -1;
-	if (h->magic != WAV_RIFF || h->type != WAV_WAVE)
+	if (h->magic == WAV_RIFF && h->type == WAV_WAVE) {
+		wavefile_type = FORMAT_WAVE;
+	} else if (h->magic == WAV_RF64 && h->type == WAV_WAVE) {
+		wavefile_type = FORMAT_RF64;
+	} else if (!memcmp(_buffer, W64_GUID_RIFF, size < 16 ? size : 16)) {
+		/* the rest of the Wave64 header is checked below */
+		wavefile_type = FORMAT_W64;
+		hsize = sizeof(W64Header);
+		w64 = 1;
+	} else
+		return -1;
+	check_wavefile_space(buffer, size > hsize ? size : hsize, blimit);
+	memcpy(buffer, _buffer, size);
+	test_wavefile_read(fd, buffer, &size, hsize, __LINE__);
+	if (w64 && (memcmp(buffer, W64_GUID_RIFF, 16) ||
+		    memcmp(((W64Header *)buffer)->type, W64_GUID_WAVE, 16))) {
+		free(buffer);
 		return -1;
-	if (size > sizeof(WaveHeader)) {
-		check_wavefile_space(buffer, size - sizeof(WaveHeader), blimit);
-		memcpy(buffer, _buffer + sizeof(WaveHeader), size - sizeof(WaveHeader));
 	}
-	size -= sizeof(WaveHeader);
+	if (size > hsize)
+		memmove(buffer, buffer + hsize, size - hsize);
+	size -= hsize;
+	pad = w64 ? 8 : 2;
+
+	if (wavefile_type == FORMAT_RF64) {
+		WaveDs64Body *ds;
+
+		type = test_wavefile_chunk(fd, &buffer, &size, &blimit, 0, &len);
+		if (type != WAV_DS64 || len < (off64_t)sizeof(WaveDs64Body)) {
+			error(_("RF64 file without 'ds64' chunk"));
+			prg_exit(EXIT_FAILURE);
+		}
+		check_wavefile_space(buffer, sizeof(WaveDs64Body), blimit);
+		test_wavefile_read(fd, buffer, &size, sizeof(WaveDs64Body), __LINE__);
+		ds = (WaveDs64Body *)buffer;
+		ds64_data = ((off64_t)LE_INT(ds->data_size_high) << 32) |
+			LE_INT(ds->data_size_low);
+		test_wavefile_skip(fd, buffer, &size, len + len % 2, __LINE__);
+	}
+
 	while (1) {
-		check_wavefile_space(buffer, sizeof(WaveChunkHeader), blimit);
-		test_wavefile_read(fd, buffer, &size, sizeof(WaveChunkHeader), __LINE__);
-		c = (WaveChunkHeader*)buffer;
-		type = c->type;
-		len = LE_INT(c->length);
-		len += len % 2;
-		if (size > sizeof(WaveChunkHeader))
-			memmove(buffer, buffer + sizeof(WaveChunkHeader), size - sizeof(WaveChunkHeader));
-		size -= sizeof(WaveChunkHeader);
+		type = test_wavefile_chunk(fd, &buffer, &size, &blimit, w64, &len);
 		if (type == WAV_FMT)
 			break;
-		check_wavefile_space(buffer, len, blimit);
-		test_wavefile_read(fd, buffer, &size, len, __LINE__);
-		if (size > len)
-			memmove(buffer, buffer + len, size - len);
-		size -= len;
+		test_wavefile_skip(fd, buffer, &size, (len + pad - 1) / pad * pad, __LINE__);
 	}
 
-	if (len < sizeof(WaveFmtBody)) {
+	if (len < (off64_t)sizeof(WaveFmtBody) || len > 0xffff) {
 		error(_("unknown length of 'fmt ' chunk (read %u, should be %u at least)"),
-		      len, (u_int)sizeof(WaveFmtBody));
+		      (u_int)len, (u_int)sizeof(WaveFmtBody));
 		prg_exit(EXIT_FAILURE);
 	}
 	check_wavefile_space(buffer, len, blimit);
@@ -862,9 +1306,9 @@ static ssize_t test_wavefile(int fd, u_char *_buffer, size_t size)
 	f = (WaveFmtBody*) buffer;
 	if (LE_SHORT(f->format) == WAV_FMT_EXTENSIBLE) {
 		WaveFmtExtensibleBody *fe = (WaveFmtExtensibleBody*)buffer;
-		if (len < sizeof(WaveFmtExtensibleBody)) {
+		if (len < (off64_t)sizeof(WaveFmtExtensibleBody)) {
 			error(_("unknown length of extensible 'fmt ' chunk (read %u, should be %u at least)"),
-					len, (u_int)sizeof(WaveFmtExtensibleBody));
+					(u_int)len, (u_int)sizeof(WaveFmtExtensibleBody));
 			prg_exit(EXIT_FAILURE);
 		}
 		if (memcmp(fe->guid_tag, WAV_GUID_TAG, 14) != 0) {
@@ -929,35 +1373,26 @@ static ssize_t test_wavefile(int fd, u_char *_buffer, size_t size)
 	}
 	hwparams.rate = LE_INT(f->sample_fq);
 	
-	if (size > len)
-		memmove(buffer, buffer + len, size - len);
-	size -= len;
+	test_wavefile_skip(fd, buffer, &size, (len + pad - 1) / pad * pad, __LINE__);
 	
 	while (1) {
-		u_int type, len;
-
-		check_wavefile_space(buffer, sizeof(WaveChunkHeader), blimit);
-		test_wavefile_read(fd, buffer, &size, sizeof(WaveChunkHeader), __LINE__);
-		c = (WaveChunkHeader*)buffer;
-		type = c->type;
-		len = LE_INT(c->length);
-		if (size > sizeof(WaveChunkHeader))
-			memmove(buffer, buffer + sizeof(WaveChunkHeader), size - sizeof(WaveChunkHeader));
-		size -= sizeof(WaveChunkHeader);
+		type = test_wavefile_chunk(fd, &buffer, &size, &blimit, w64, &len);
 		if (type == WAV_DATA) {
-			if (len < pbrec_count && len < 0x7ffffffe)
-				pbrec_count = len;
+			if (wavefile_type == FORMAT_WAVE) {
+				if (len < pbrec_count && len < 0x7ffffffe)
+					pbrec_count = len;
+			} else {
+				if (wavefile_type == FORMAT_RF64 && len == 0xffffffff)
+					len = ds64_data;
+				if (len > 0 && len < pbrec_count)
+					pbrec_count = len;
+			}
 			if (size > 0)
 				memcpy(_buffer, buffer, size);
 			free(buffer);
 			return size;
 		}
-		len += len % 2;
-		check_wavefile_space(buffer, len, blimit);
-		test_wavefile_read(fd, buffer, &size, len, __LINE__);
-		if (size > len)
-			memmove(buffer, buffer + len, size - len);
-		size -= len;
+		test_wavefile_skip(fd, buffer, &size, (len + pad - 1) / pad * pad, __LINE__);
 	}
 
 	/* shouldn't be reached */
@@ -1012,84 +1447,789 @@ static int test_au(int fd, void *buffer)
 	return 0;
 }
 
-static void show_available_sample_formats(snd_pcm_hw_params_t* params)
+/*
+ * realtime setup
+ *
+ * --rt-priority, --cpu-affinity and --mlock are applied to the main
+ * thread before the PCM is opened; the helper threads started later
+ * inherit them.  With --mlock the stack is touched up front and the
+ * buffers allocated in set_params() are touched before the stream
+ * starts, so the transfers do not take page faults on first use.  The
+ * faults counted while streaming are reported at the end.
+ */
+
+#define RT_STACK_PREFAULT	(256 * 1024)
+
+static struct rt_faults {
+	long minflt, majflt;		/* while streaming */
+	long start_minflt, start_majflt;
+	int running;
+} rt_faults;
+
+static int rt_parse_cpus(const char *list, cpu_set_t *set)
 {
-	snd_pcm_format_t format;
+	char *end;
+	long a, b;
 
-	fprintf(stderr, "Available formats:\n");
-	for (format = 0; format < SND_PCM_FORMAT_LAST; format++) {
-		if (snd_pcm_hw_params_test_format(handle, params, format) == 0)
-			fprintf(stderr, "- %s\n", snd_pcm_format_name(format));
-	}
+	CPU_ZERO(set);
+	do {
+		a = b = strtol(list, &end, 10);
+		if (end == list)
+			return -1;
+		if (*end == '-') {
+			list = end + 1;
+			b = strtol(list, &end, 10);
+			if (end == list)
+				return -1;
+		}
+		if (a < 0 || b < a || b >= CPU_SETSIZE)
+			return -1;
+		for (; a <= b; a++)
+			CPU_SET(a, set);
+		list = end + 1;
+	} while (*end == ',');
+	return *end ? -1 : 0;
 }
 
-static void set_params(void)
+static void __attribute__((noinline)) rt_prefault_stack(void)
 {
-	snd_pcm_hw_params_t *params;
-	snd_pcm_sw_params_t *swparams;
-	snd_pcm_uframes_t buffer_size;
-	int err;
-	size_t n;
-	unsigned int rate;
-	snd_pcm_uframes_t start_threshold, stop_threshold;
-	snd_pcm_hw_params_alloca(&params);
-	snd_pcm_sw_params_alloca(&swparams);
-	err = snd_pcm_hw_params_any(handle, params);
-	if (err < 0) {
-		error(_("Broken configuration for this PCM: no configurations available"));
-		prg_exit(EXIT_FAILURE);
+	volatile u_char stack[RT_STACK_PREFAULT];
+	size_t i;
+
+	for (i = 0; i < sizeof(stack); i += 64)
+		stack[i] = 0;
+}
+
+/* touch every page of buf, keeping the contents */
+static void rt_prefault(void *buf, size_t size)
+{
+	volatile u_char *p = buf;
+	size_t page = sysconf(_SC_PAGESIZE), i;
+
+	if (!rt_mlock || !buf)
+		return;
+	for (i = 0; i < size; i += page)
+		p[i] = p[i];
+	if (size)
+		p[size - 1] = p[size - 1];
+}
+
+static void rt_setup(void)
+{
+	struct sched_param sched_param;
+
+	if (rt_cpus) {
+		cpu_set_t set;
+
+		if (rt_parse_cpus(rt_cpus, &set) < 0) {
+			error(_("bad CPU list '%s'"), rt_cpus);
+			prg_exit(EXIT_FAILURE);
+		}
+		if (sched_setaffinity(0, sizeof(set), &set) < 0)
+			fprintf(stderr, _("Warning: unable to set the CPU affinity: %s\n"), strerror(errno));
 	}
-	if (mmap_flag) {
-		snd_pcm_access_mask_t *mask = alloca(snd_pcm_access_mask_sizeof());
-		snd_pcm_access_mask_none(mask);
-		snd_pcm_access_mask_set(mask, SND_PCM_ACCESS_MMAP_INTERLEAVED);
-		snd_pcm_access_mask_set(mask, SND_PCM_ACCESS_MMAP_NONINTERLEAVED);
-		snd_pcm_access_mask_set(mask, SND_PCM_ACCESS_MMAP_COMPLEX);
-		err = snd_pcm_hw_params_set_access_mask(handle, params, mask);
-	} else if (interleaved)
-		err = snd_pcm_hw_params_set_access(handle, params,
-						   SND_PCM_ACCESS_RW_INTERLEAVED);
-	else
-		err = snd_pcm_hw_params_set_access(handle, params,
-						   SND_PCM_ACCESS_RW_NONINTERLEAVED);
-	if (err < 0) {
-		error(_("Access type not available"));
-		prg_exit(EXIT_FAILURE);
+	if (rt_mlock) {
+		/* keep the freed memory, the next allocations stay locked */
+#if defined(M_TRIM_THRESHOLD) && defined(M_MMAP_MAX)
+		mallopt(M_TRIM_THRESHOLD, -1);
+		mallopt(M_MMAP_MAX, 0);
+#endif
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+			fprintf(stderr, _("Warning: unable to lock the memory: %s\n"), strerror(errno));
+		rt_prefault_stack();
 	}
-	err = snd_pcm_hw_params_set_format(handle, params, hwparams.format);
-	if (err < 0) {
-		error(_("Sample format non available"));
-		show_available_sample_formats(params);
-		prg_exit(EXIT_FAILURE);
+	if (rt_priority) {
+		memset(&sched_param, 0, sizeof(sched_param));
+		sched_param.sched_priority = rt_priority;
+		if (sched_setscheduler(0, SCHED_FIFO, &sched_param) < 0)
+			fprintf(stderr, _("Warning: unable to set SCHED_FIFO priority %i: %s\n"), rt_priority, strerror(errno));
+		else if (verbose)
+			fprintf(stderr, _("Scheduler set to FIFO with priority %i\n"), rt_priority);
 	}
-	err = snd_pcm_hw_params_set_channels(handle, params, hwparams.channels);
-	if (err < 0) {
-		error(_("Channels count non available"));
-		prg_exit(EXIT_FAILURE);
+}
+
+/* count the faults between set_params() and the next one or the end */
+static void rt_faults_mark(int start)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		return;
+	if (rt_faults.running) {
+		rt_faults.minflt += ru.ru_minflt - rt_faults.start_minflt;
+		rt_faults.majflt += ru.ru_majflt - rt_faults.start_majflt;
 	}
+	rt_faults.start_minflt = ru.ru_minflt;
+	rt_faults.start_majflt = ru.ru_majflt;
+	rt_faults.running = start;
+}
 
-#if 0
-	err = snd_pcm_hw_params_set_periods_min(handle, params, 2);
-	assert(err >= 0);
+static void rt_report(void)
+{
+	if (!verbose && !rt_priority && !rt_cpus && !rt_mlock)
+		return;
+	rt_faults_mark(0);
+	fprintf(stderr, _("Page faults while streaming: %ld major, %ld minor\n"),
+		rt_faults.majflt, rt_faults.minflt);
+}
+
+/*
+ * sample format converter
+ *
+ * When the device does not accept the sample format of the file (or
+ * --device-format is given), the samples are converted in pcm_write() /
+ * pcm_read() instead of relying on the plug layer.  All conversions go
+ * through S32 in blocks of CONV_BLOCK samples: one decoder and one encoder
+ * per format, generated from the CONV_FORMATS list together with the
+ * format table.  The plain loops are left to the compiler vectorizer,
+ * on x86 an AVX2 build of the same kernels is selected at run time.
+ * hwparams.format, bits_per_frame and audiobuf keep the file format.
+ */
+
+#define CONV_BLOCK	1024
+
+#if defined(__GNUC__) && !defined(__clang__)
+#define CONV_ATTR_generic __attribute__((optimize("tree-vectorize")))
+#define CONV_ATTR_avx2	__attribute__((target("avx2"), optimize("tree-vectorize")))
+#else
+#define CONV_ATTR_generic
+#define CONV_ATTR_avx2	__attribute__((target("avx2")))
 #endif
-	rate = hwparams.rate;
-	err = snd_pcm_hw_params_set_rate_near(handle, params, &hwparams.rate, 0);
-	assert(err >= 0);
-	if ((float)rate * 1.05 < hwparams.rate || (float)rate * 0.95 > hwparams.rate) {
-		if (!quiet_mode) {
-			char plugex[64];
-			const char *pcmname = snd_pcm_name(handle);
-			fprintf(stderr, _("Warning: rate is not accurate (requested = %iHz, got = %iHz)\n"), rate, hwparams.rate);
-			if (! pcmname || strchr(snd_pcm_name(handle), ':'))
-				*plugex = 0;
-			else
-				snprintf(plugex, sizeof(plugex), "(-Dplug:%s)",
-					 snd_pcm_name(handle));
-			fprintf(stderr, _("         please, try the plug plugin %s\n"),
-				plugex);
+
+/* name, kind, kind specific parameters */
+#define CONV_FORMATS(X) \
+	X(S32_LE, INT, u_int32_t, int32_t, LE_INT, 0) \
+	X(S32_BE, INT, u_int32_t, int32_t, BE_INT, 0) \
+	X(S24_LE, INT, u_int32_t, int32_t, LE_INT, 8) \
+	X(S24_BE, INT, u_int32_t, int32_t, BE_INT, 8) \
+	X(S24_3LE, PACKED, 0, 1, 2, 0) \
+	X(S24_3BE, PACKED, 2, 1, 0, 0) \
+	X(FLOAT_LE, FLOAT, u_int32_t, float, LE_INT, 2147483520.0f) \
+	X(FLOAT_BE, FLOAT, u_int32_t, float, BE_INT, 2147483520.0f) \
+	X(FLOAT64_LE, FLOAT, u_int64_t, double, LE_LONG, 2147483647.0) \
+	X(FLOAT64_BE, FLOAT, u_int64_t, double, BE_LONG, 2147483647.0) \
+	X(S16_LE, INT, u_int16_t, int16_t, LE_SHORT, 16) \
+	X(S16_BE, INT, u_int16_t, int16_t, BE_SHORT, 16)
+
+/* integer stored in 'type', value in the upper bits after 'shift' */
+#define CONV_INT(isa, name, type, stype, swap, shift) \
+static CONV_ATTR_##isa void conv_dec_##name##_##isa(const u_char *src, int32_t *dst, size_t n) \
+{ \
+	type v; \
+	size_t i; \
+	for (i = 0; i < n; i++) { \
+		memcpy(&v, src + i * sizeof(type), sizeof(type)); \
+		dst[i] = (int32_t)((u_int32_t)(stype)swap(v) << shift); \
+	} \
+} \
+static CONV_ATTR_##isa void conv_enc_##name##_##isa(const int32_t *src, u_char *dst, size_t n) \
+{ \
+	type v; \
+	size_t i; \
+	for (i = 0; i < n; i++) { \
+		v = swap((type)(src[i] >> shift)); \
+		memcpy(dst + i * sizeof(type), &v, sizeof(type)); \
+	} \
+}
+
+/* three bytes, the positions of the low, middle and high byte */
+#define CONV_PACKED(isa, name, lo, mid, hi, unused) \
+static CONV_ATTR_##isa void conv_dec_##name##_##isa(const u_char *src, int32_t *dst, size_t n) \
+{ \
+	size_t i; \
+	for (i = 0; i < n; i++, src += 3) \
+		dst[i] = (int32_t)((u_int32_t)src[lo] << 8 | \
+				   (u_int32_t)src[mid] << 16 | \
+				   (u_int32_t)src[hi] << 24); \
+} \
+static CONV_ATTR_##isa void conv_enc_##name##_##isa(const int32_t *src, u_char *dst, size_t n) \
+{ \
+	size_t i; \
+	for (i = 0; i < n; i++, dst += 3) { \
+		dst[lo] = src[i] >> 8; \
+		dst[mid] = src[i] >> 16; \
+		dst[hi] = src[i] >> 24; \
+	} \
+}
+
+/* IEEE float in the range -1.0 ... 1.0, clipped */
+#define CONV_FLOAT(isa, name, type, ftype, swap, max) \
+static CONV_ATTR_##isa void conv_dec_##name##_##isa(const u_char *src, int32_t *dst, size_t n) \
+{ \
+	union { type i; ftype f; } u; \
+	size_t i; \
+	for (i = 0; i < n; i++) { \
+		memcpy(&u.i, src + i * sizeof(type), sizeof(type)); \
+		u.i = swap(u.i); \
+		u.f *= (ftype)2147483648.0; \
+		u.f = u.f < (ftype)-2147483648.0 ? (ftype)-2147483648.0 : u.f; \
+		u.f = u.f > max ? max : u.f; \
+		dst[i] = (int32_t)u.f; \
+	} \
+} \
+static CONV_ATTR_##isa void conv_enc_##name##_##isa(const int32_t *src, u_char *dst, size_t n) \
+{ \
+	union { type i; ftype f; } u; \
+	size_t i; \
+	for (i = 0; i < n; i++) { \
+		u.f = (ftype)src[i] * (ftype)(1.0 / 2147483648.0); \
+		u.i = swap(u.i); \
+		memcpy(dst + i * sizeof(type), &u.i, sizeof(type)); \
+	} \
+}
+
+#define CONV_WIDTH_INT(type)	sizeof(type)
+#define CONV_WIDTH_PACKED(lo)	3
+#define CONV_WIDTH_FLOAT(type)	sizeof(type)
+
+#define CONV_KERNELS(name, kind, p1, p2, p3, p4) \
+	CONV_##kind(generic, name, p1, p2, p3, p4)
+CONV_FORMATS(CONV_KERNELS)
+#ifdef PEAK_SIMD_X86
+#define CONV_KERNELS_AVX2(name, kind, p1, p2, p3, p4) \
+	CONV_##kind(avx2, name, p1, p2, p3, p4)
+CONV_FORMATS(CONV_KERNELS_AVX2)
+#define CONV_ENTRY_SIMD(name)	, conv_dec_##name##_avx2, conv_enc_##name##_avx2
+#else
+#define CONV_ENTRY_SIMD(name)
+#endif
+
+typedef void (*conv_decode_t)(const u_char *src, int32_t *dst, size_t n);
+typedef void (*conv_encode_t)(const int32_t *src, u_char *dst, size_t n);
+
+static const struct conv_format {
+	snd_pcm_format_t format;
+	unsigned int width;		/* bytes per sample */
+	conv_decode_t decode;
+	conv_encode_t encode;
+#ifdef PEAK_SIMD_X86
+	conv_decode_t decode_avx2;
+	conv_encode_t encode_avx2;
+#endif
+} conv_formats[] = {
+#define CONV_ENTRY(name, kind, p1, p2, p3, p4) \
+	{ SND_PCM_FORMAT_##name, CONV_WIDTH_##kind(p1), \
+	  conv_dec_##name##_generic, conv_enc_##name##_generic CONV_ENTRY_SIMD(name) },
+	CONV_FORMATS(CONV_ENTRY)
+#undef CONV_ENTRY
+};
+
+static struct converter {
+	const struct conv_format *from;	/* file format */
+	const struct conv_format *to;	/* device format */
+	conv_decode_t decode;
+	conv_encode_t encode;
+	u_char *buf;			/* one chunk in the device format */
+	/* statistics */
+	unsigned long long samples;
+	long long time;			/* us */
+} conv;
+
+static const struct conv_format *converter_find(snd_pcm_format_t format)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(conv_formats) / sizeof(conv_formats[0]); i++)
+		if (conv_formats[i].format == format)
+			return &conv_formats[i];
+	return NULL;
+}
+
+static void converter_report(void)
+{
+	if (!verbose || !conv.from || !conv.samples)
+		return;
+	fprintf(stderr, _("Converter %s -> %s: %llu samples in %.3f ms (%.1f Msamples/s)\n"),
+		snd_pcm_format_name(conv.from->format),
+		snd_pcm_format_name(conv.to->format),
+		conv.samples, conv.time / 1000.0,
+		conv.time ? (double)conv.samples / conv.time : 0.0);
+}
+
+static void converter_use(const struct conv_format *from,
+			  const struct conv_format *to)
+{
+	if (conv.from == from && conv.to == to)
+		return;
+	converter_report();
+	conv.from = from;
+	conv.to = to;
+	conv.samples = 0;
+	conv.time = 0;
+	if (!to)
+		return;
+	conv.decode = from->decode;
+	conv.encode = to->encode;
+#ifdef PEAK_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		conv.decode = from->decode_avx2;
+		conv.encode = to->encode_avx2;
+	}
+#endif
+	if (verbose)
+		fprintf(stderr, _("Converting %s to %s for the device\n"),
+			snd_pcm_format_name(from->format),
+			snd_pcm_format_name(to->format));
+}
+
+/* set the device format, picks a converted one if the file format fails */
+static int converter_setup(snd_pcm_hw_params_t *params)
+{
+	const struct conv_format *from, *to = NULL;
+	unsigned int i;
+	int err;
+
+	if (device_format == SND_PCM_FORMAT_UNKNOWN ||
+	    device_format == hwparams.format) {
+		err = snd_pcm_hw_params_set_format(handle, params, hwparams.format);
+		if (err >= 0 || device_format != SND_PCM_FORMAT_UNKNOWN) {
+			converter_use(NULL, NULL);
+			return err;
+		}
+		from = converter_find(hwparams.format);
+		if (!from)
+			return err;
+		/* the table is in the order of preference */
+		for (i = 0; i < sizeof(conv_formats) / sizeof(conv_formats[0]); i++) {
+			if (&conv_formats[i] != from &&
+			    snd_pcm_hw_params_test_format(handle, params, conv_formats[i].format) == 0) {
+				to = &conv_formats[i];
+				break;
+			}
+		}
+		if (!to)
+			return err;
+	} else {
+		from = converter_find(hwparams.format);
+		to = converter_find(device_format);
+		if (!from || !to) {
+			error(_("conversion from %s to %s is not supported"),
+			      snd_pcm_format_name(hwparams.format),
+			      snd_pcm_format_name(device_format));
+			prg_exit(EXIT_FAILURE);
 		}
 	}
-	rate = hwparams.rate;
+	err = snd_pcm_hw_params_set_format(handle, params, to->format);
+	if (err < 0)
+		return err;
+	converter_use(from, to);
+	return 0;
+}
+
+/* convert samples, dir > 0 from the file to the device format */
+static void converter_run(const u_char *src, u_char *dst, size_t samples, int dir)
+{
+	conv_decode_t decode = dir > 0 ? conv.decode : conv.to->decode;
+	conv_encode_t encode = dir > 0 ? conv.encode : conv.from->encode;
+	unsigned int sw = dir > 0 ? conv.from->width : conv.to->width;
+	unsigned int dw = dir > 0 ? conv.to->width : conv.from->width;
+	int32_t tmp[CONV_BLOCK];
+	long long t = time_us();
+	size_t n;
+
+#ifdef PEAK_SIMD_X86
+	if (dir < 0 && conv.decode != conv.from->decode) {
+		decode = conv.to->decode_avx2;
+		encode = conv.from->encode_avx2;
+	}
+#endif
+	conv.samples += samples;
+	while (samples > 0) {
+		n = samples > CONV_BLOCK ? CONV_BLOCK : samples;
+		decode(src, tmp, n);
+		encode(tmp, dst, n);
+		src += n * sw;
+		dst += n * dw;
+		samples -= n;
+	}
+	conv.time += time_us() - t;
+}
+
+/*
+ * polyphase resampler
+ *
+ * With --resample the rate conversion of the plug layer is disabled and
+ * the device runs at the nearest rate it supports (or --device-rate).
+ * The ratio of the rates is reduced to out/in = L/M and a Kaiser windowed
+ * sinc is split into L phases; every output frame is the dot product of
+ * one phase with the input history of each channel.  Beyond RS_MAX_PHASES
+ * the position is still tracked exactly and the output is interpolated
+ * between the two nearest phases.  The samples go through
+ * the converter decoders and encoders, so the device format may differ
+ * from the file format as well.  hwparams.rate keeps the file rate.
+ */
+
+#define RS_MAX_PHASES	1024
+#define RS_MAX_TAPS	512
+#define RS_PI		3.14159265358979323846
+
+static const struct rs_quality {
+	const char *name;
+	unsigned int taps;	/* per phase at unity ratio, a multiple of 8 */
+	double cutoff;		/* of the lower Nyquist frequency */
+	double beta;		/* Kaiser window */
+} rs_qualities[] = {
+	{ "fast", 8, 0.80, 4.0 },
+	{ "medium", 16, 0.88, 6.0 },
+	{ "high", 32, 0.93, 8.5 },
+	{ "best", 64, 0.96, 11.0 },
+};
+
+/* n is a multiple of 8, eight partial sums keep the loop vectorizable */
+#define RS_DOT(isa) \
+static CONV_ATTR_##isa float rs_dot_##isa(const float *h, const float *x, unsigned int n) \
+{ \
+	float acc[8] = { 0 }; \
+	unsigned int i, j; \
+	for (i = 0; i < n; i += 8) \
+		for (j = 0; j < 8; j++) \
+			acc[j] += h[i + j] * x[i + j]; \
+	return ((acc[0] + acc[4]) + (acc[1] + acc[5])) + \
+		((acc[2] + acc[6]) + (acc[3] + acc[7])); \
+}
+RS_DOT(generic)
+#ifdef PEAK_SIMD_X86
+RS_DOT(avx2)
+#endif
+
+static struct resampler {
+	const struct rs_quality *quality;
+	const struct conv_format *from;	/* file format */
+	const struct conv_format *to;	/* device format */
+	conv_decode_t decode;
+	conv_encode_t encode;
+	float (*dot)(const float *h, const float *x, unsigned int n);
+	unsigned int in_rate, out_rate;
+	unsigned long L, M;		/* 0 when not active */
+	unsigned int phases, taps, channels;
+	float *filter;			/* (phases + 1) * taps */
+	float **hist;			/* per channel, taps + one chunk */
+	size_t fill;			/* frames in hist */
+	size_t pos;			/* first history frame of the next output */
+	unsigned long phase;		/* 0 .. L - 1 */
+	int32_t *tmp;			/* S32 samples in and out */
+	u_char *buf;			/* output frames in the device format */
+	size_t tmp_bytes, buf_bytes;
+	/* statistics */
+	unsigned long long frames;	/* input frames */
+	long long time;			/* us */
+} rsmp;
+
+static int resampler_quality(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(rs_qualities) / sizeof(rs_qualities[0]); i++)
+		if (!strcmp(name, rs_qualities[i].name) ||
+		    (name[0] == '0' + (int)i && !name[1]))
+			return i;
+	return -1;
+}
+
+static void resampler_report(void)
+{
+	if (!verbose || !rsmp.L || !rsmp.frames)
+		return;
+	fprintf(stderr, _("Resampler %u Hz -> %u Hz (%s, %u taps): %.3f ms per second of audio\n"),
+		rsmp.in_rate, rsmp.out_rate, rsmp.quality->name, rsmp.taps,
+		rsmp.time / 1000.0 / ((double)rsmp.frames / rsmp.in_rate));
+}
+
+/* zeroth order modified Bessel function for the Kaiser window */
+static double rs_bessel_i0(double x)
+{
+	double sum = 1.0, term = 1.0;
+	unsigned int k;
+
+	for (k = 1; k < 64 && term > sum * 1e-12; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+static void resampler_filter(void)
+{
+	struct resampler *r = &rsmp;
+	double fc, u, x, w, v, sum, i0 = rs_bessel_i0(r->quality->beta);
+	unsigned int p, k;
+	float *h;
+
+	fc = r->quality->cutoff;
+	if (r->L < r->M)
+		fc = fc * r->L / r->M;
+	for (p = 0; p <= r->phases; p++) {
+		h = r->filter + (size_t)p * r->taps;
+		sum = 0;
+		for (k = 0; k < r->taps; k++) {
+			/* distance of the history frame k from the output */
+			u = r->taps / 2 - 1.0 - k + (double)p / r->phases;
+			x = u / (r->taps / 2);
+			w = x * x < 1.0 ? rs_bessel_i0(r->quality->beta * sqrt(1.0 - x * x)) / i0 : 0;
+			v = u == 0 ? fc : sin(RS_PI * fc * u) / (RS_PI * u);
+			h[k] = v * w;
+			sum += h[k];
+		}
+		/* unity gain for every phase */
+		for (k = 0; k < r->taps; k++)
+			h[k] /= sum;
+	}
+}
+
+static void resampler_free(void)
+{
+	unsigned int c;
+
+	if (rsmp.hist)
+		for (c = 0; c < rsmp.channels; c++)
+			free(rsmp.hist[c]);
+	free(rsmp.hist);
+	free(rsmp.filter);
+	free(rsmp.tmp);
+	free(rsmp.buf);
+	rsmp.hist = NULL;
+	rsmp.filter = NULL;
+	rsmp.tmp = NULL;
+	rsmp.buf = NULL;
+}
+
+/* select the device rate and set up the conversion from the file rate */
+static unsigned int resampler_setup(snd_pcm_hw_params_t *params)
+{
+	struct resampler *r = &rsmp;
+	unsigned int rate = device_rate ? device_rate : hwparams.rate;
+	unsigned long a, b, t;
+	int err;
+
+	err = snd_pcm_hw_params_set_rate_near(handle, params, &rate, 0);
+	if (err < 0) {
+		error(_("Rate %iHz not available for playback: %s"), device_rate ? device_rate : hwparams.rate, snd_strerror(err));
+		prg_exit(EXIT_FAILURE);
+	}
+	if (r->L && r->in_rate == hwparams.rate && r->out_rate == rate &&
+	    r->channels == hwparams.channels && r->from == converter_find(hwparams.format) &&
+	    r->to == (conv.to ? conv.to : r->from))
+		return rate;
+	resampler_report();
+	resampler_free();
+	r->L = 0;
+	r->frames = 0;
+	r->time = 0;
+	if (rate == hwparams.rate)
+		return rate;
+	r->from = converter_find(hwparams.format);
+	if (!r->from) {
+		error(_("resampling of %s is not supported"), snd_pcm_format_name(hwparams.format));
+		prg_exit(EXIT_FAILURE);
+	}
+	r->to = conv.to ? conv.to : r->from;
+	r->decode = r->from->decode;
+	r->encode = r->to->encode;
+	r->dot = rs_dot_generic;
+#ifdef PEAK_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		r->decode = r->from->decode_avx2;
+		r->encode = r->to->encode_avx2;
+		r->dot = rs_dot_avx2;
+	}
+#endif
+	r->quality = &rs_qualities[resample_quality];
+	r->in_rate = hwparams.rate;
+	r->out_rate = rate;
+	r->channels = hwparams.channels;
+	for (a = r->out_rate, b = r->in_rate; b; t = a % b, a = b, b = t)
+		;
+	r->L = r->out_rate / a;
+	r->M = r->in_rate / a;
+	r->phases = r->L > RS_MAX_PHASES ? RS_MAX_PHASES : r->L;
+	/* the filter gets longer with the lower cutoff of decimation */
+	r->taps = r->quality->taps;
+	if (r->M > r->L)
+		r->taps = ((unsigned long)r->taps * r->M / r->L + 7) & ~7;
+	if (r->taps > RS_MAX_TAPS)
+		r->taps = RS_MAX_TAPS;
+	r->filter = malloc((size_t)(r->phases + 1) * r->taps * sizeof(float));
+	r->hist = calloc(r->channels, sizeof(float *));
+	if (!r->filter || !r->hist) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	resampler_filter();
+	if (verbose)
+		fprintf(stderr, _("Resampling %u Hz to %u Hz for the device (%s, %u phases, %u taps)\n"),
+			r->in_rate, r->out_rate, r->quality->name, r->phases, r->taps);
+	return rate;
+}
+
+/* the buffers depend on chunk_size, called with every set_params() */
+static void resampler_alloc(void)
+{
+	struct resampler *r = &rsmp;
+	size_t out = ((size_t)chunk_size + r->taps) * r->L / r->M + 1;
+	size_t in = (size_t)chunk_size > out ? chunk_size : out;
+	unsigned int c;
+
+	for (c = 0; c < r->channels; c++) {
+		free(r->hist[c]);
+		r->hist[c] = calloc(r->taps + chunk_size, sizeof(float));
+		if (!r->hist[c]) {
+			error(_("not enough memory"));
+			prg_exit(EXIT_FAILURE);
+		}
+	}
+	/* the output of frame 0 is centered on the first file frame */
+	r->fill = r->taps / 2 - 1;
+	r->pos = 0;
+	r->phase = 0;
+	r->tmp_bytes = in * r->channels * sizeof(int32_t);
+	r->buf_bytes = out * r->channels * r->to->width;
+	r->tmp = realloc(r->tmp, r->tmp_bytes);
+	r->buf = realloc(r->buf, r->buf_bytes);
+	if (!r->tmp || !r->buf) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+}
+
+/* resample frames of the file, returns the frames left in rsmp.buf */
+static size_t resampler_run(const u_char *src, size_t frames)
+{
+	struct resampler *r = &rsmp;
+	unsigned int channels = r->channels, c;
+	long long t = time_us();
+	size_t i, out = 0, shift;
+	unsigned long p;
+	const float *h;
+	float v, a;
+
+	r->decode(src, r->tmp, frames * channels);
+	for (c = 0; c < channels; c++) {
+		float *x = r->hist[c] + r->fill;
+		const int32_t *s = r->tmp + c;
+		for (i = 0; i < frames; i++, s += channels)
+			x[i] = *s * (1.0f / 2147483648.0f);
+	}
+	r->fill += frames;
+	while (r->pos + r->taps <= r->fill) {
+		p = r->phase * r->phases;
+		h = r->filter + (size_t)(p / r->L) * r->taps;
+		a = (float)(p % r->L) / r->L;
+		for (c = 0; c < channels; c++) {
+			v = r->dot(h, r->hist[c] + r->pos, r->taps);
+			if (a)
+				v += a * (r->dot(h + r->taps, r->hist[c] + r->pos, r->taps) - v);
+			v *= 2147483648.0f;
+			if (v >= 2147483647.0f)
+				r->tmp[out * channels + c] = 0x7fffffff;
+			else if (v <= -2147483648.0f)
+				r->tmp[out * channels + c] = -0x7fffffff - 1;
+			else
+				r->tmp[out * channels + c] = (int32_t)v;
+		}
+		out++;
+		r->phase += r->M;
+		r->pos += r->phase / r->L;
+		r->phase %= r->L;
+	}
+	/* keep the history of the next output */
+	shift = r->pos < r->fill ? r->pos : r->fill;
+	for (c = 0; c < channels; c++)
+		memmove(r->hist[c], r->hist[c] + shift, (r->fill - shift) * sizeof(float));
+	r->fill -= shift;
+	r->pos -= shift;
+	r->encode(r->tmp, r->buf, out * channels);
+	r->frames += frames;
+	r->time += time_us() - t;
+	return out;
+}
+
+static void show_available_sample_formats(snd_pcm_hw_params_t* params)
+{
+	snd_pcm_format_t format;
+
+	fprintf(stderr, "Available formats:\n");
+	for (format = 0; format < SND_PCM_FORMAT_LAST; format++) {
+		if (snd_pcm_hw_params_test_format(handle, params, format) == 0)
+			fprintf(stderr, "- %s\n", snd_pcm_format_name(format));
+	}
+}
+
+static void set_params(void)
+{
+	snd_pcm_hw_params_t *params;
+	snd_pcm_sw_params_t *swparams;
+	snd_pcm_uframes_t buffer_size;
+	int err;
+	size_t n;
+	unsigned int rate;
+	snd_pcm_uframes_t start_threshold, stop_threshold;
+	snd_pcm_hw_params_alloca(&params);
+	snd_pcm_sw_params_alloca(&swparams);
+	rt_faults_mark(0);
+	err = snd_pcm_hw_params_any(handle, params);
+	if (err < 0) {
+		error(_("Broken configuration for this PCM: no configurations available"));
+		prg_exit(EXIT_FAILURE);
+	}
+	if (mmap_flag && mmap_direct && interleaved)
+		err = snd_pcm_hw_params_set_access(handle, params,
+						   SND_PCM_ACCESS_MMAP_INTERLEAVED);
+	else if (mmap_flag) {
+		snd_pcm_access_mask_t *mask = alloca(snd_pcm_access_mask_sizeof());
+		snd_pcm_access_mask_none(mask);
+		snd_pcm_access_mask_set(mask, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+		snd_pcm_access_mask_set(mask, SND_PCM_ACCESS_MMAP_NONINTERLEAVED);
+		snd_pcm_access_mask_set(mask, SND_PCM_ACCESS_MMAP_COMPLEX);
+		err = snd_pcm_hw_params_set_access_mask(handle, params, mask);
+	} else if (interleaved)
+		err = snd_pcm_hw_params_set_access(handle, params,
+						   SND_PCM_ACCESS_RW_INTERLEAVED);
+	else
+		err = snd_pcm_hw_params_set_access(handle, params,
+						   SND_PCM_ACCESS_RW_NONINTERLEAVED);
+	if (err < 0) {
+		error(_("Access type not available"));
+		prg_exit(EXIT_FAILURE);
+	}
+	err = converter_setup(params);
+	if (err < 0) {
+		error(_("Sample format non available"));
+		show_available_sample_formats(params);
+		prg_exit(EXIT_FAILURE);
+	}
+	err = snd_pcm_hw_params_set_channels(handle, params, hwparams.channels);
+	if (err < 0) {
+		error(_("Channels count non available"));
+		prg_exit(EXIT_FAILURE);
+	}
+
+#if 0
+	err = snd_pcm_hw_params_set_periods_min(handle, params, 2);
+	assert(err >= 0);
+#endif
+	rate = hwparams.rate;
+	if (resample_quality < 0) {
+		err = snd_pcm_hw_params_set_rate_near(handle, params, &hwparams.rate, 0);
+		assert(err >= 0);
+	}
+	if ((float)rate * 1.05 < hwparams.rate || (float)rate * 0.95 > hwparams.rate) {
+		if (!quiet_mode) {
+			char plugex[64];
+			const char *pcmname = snd_pcm_name(handle);
+			fprintf(stderr, _("Warning: rate is not accurate (requested = %iHz, got = %iHz)\n"), rate, hwparams.rate);
+			if (! pcmname || strchr(snd_pcm_name(handle), ':'))
+				*plugex = 0;
+			else
+				snprintf(plugex, sizeof(plugex), "(-Dplug:%s)",
+					 snd_pcm_name(handle));
+			fprintf(stderr, _("         please, try the plug plugin %s\n"),
+				plugex);
+		}
+	}
+	/* the device rate, hwparams.rate stays the file rate */
+	rate = resample_quality >= 0 ? resampler_setup(params) : hwparams.rate;
 	if (buffer_time == 0 && buffer_frames == 0) {
 		err = snd_pcm_hw_params_get_buffer_time_max(params,
 							    &buffer_time, 0);
@@ -1118,12 +2258,19 @@ static void set_params(void)
 							     &buffer_frames);
 	}
 	assert(err >= 0);
+	if (no_period_wakeup) {
+		err = snd_pcm_hw_params_set_period_wakeup(handle, params, 0);
+		if (err < 0) {
+			error(_("Unable to disable period wakeups: %s"), snd_strerror(err));
+			prg_exit(EXIT_FAILURE);
+		}
+	}
 	monotonic = snd_pcm_hw_params_is_monotonic(params);
 	can_pause = snd_pcm_hw_params_can_pause(params);
 	err = snd_pcm_hw_params(handle, params);
 	if (err < 0) {
 		error(_("Unable to install hw params:"));
-		snd_pcm_hw_params_dump(params, log);
+		snd_pcm_hw_params_dump(params, log_output);
 		prg_exit(EXIT_FAILURE);
 	}
 	snd_pcm_hw_params_get_period_size(params, &chunk_size, 0);
@@ -1139,6 +2286,7 @@ static void set_params(void)
 	else
 		n = (double) rate * avail_min / 1000000;
 	err = snd_pcm_sw_params_set_avail_min(handle, swparams, n);
+	wakeup_frames = n;
 
 	/* round up to closest transfer boundary */
 	n = buffer_size;
@@ -1152,32 +2300,45 @@ static void set_params(void)
 		start_threshold = n;
 	err = snd_pcm_sw_params_set_start_threshold(handle, swparams, start_threshold);
 	assert(err >= 0);
+	start_threshold_frames = start_threshold;
 	if (stop_delay <= 0) 
 		stop_threshold = buffer_size + (double) rate * stop_delay / 1000000;
 	else
 		stop_threshold = (double) rate * stop_delay / 1000000;
 	err = snd_pcm_sw_params_set_stop_threshold(handle, swparams, stop_threshold);
 	assert(err >= 0);
+	/* the seek index entries use the status timestamps */
+	if (seek_index_frames) {
+		err = snd_pcm_sw_params_set_tstamp_mode(handle, swparams,
+							SND_PCM_TSTAMP_ENABLE);
+		assert(err >= 0);
+	}
 
 	if (snd_pcm_sw_params(handle, swparams) < 0) {
 		error(_("unable to install sw params:"));
-		snd_pcm_sw_params_dump(swparams, log);
+		snd_pcm_sw_params_dump(swparams, log_output);
 		prg_exit(EXIT_FAILURE);
 	}
 
 	if (verbose)
-		snd_pcm_dump(handle, log);
+		snd_pcm_dump(handle, log_output);
 
 	bits_per_sample = snd_pcm_format_physical_width(hwparams.format);
 	bits_per_frame = bits_per_sample * hwparams.channels;
 	chunk_bytes = chunk_size * bits_per_frame / 8;
 	audiobuf = realloc(audiobuf, chunk_bytes);
-	if (audiobuf == NULL) {
+	if (conv.to)
+		conv.buf = realloc(conv.buf, chunk_size * hwparams.channels * conv.to->width);
+	if (audiobuf == NULL || (conv.to && conv.buf == NULL)) {
 		error(_("not enough memory"));
 		prg_exit(EXIT_FAILURE);
 	}
+	if (rsmp.L)
+		resampler_alloc();
 	// fprintf(stderr, "real chunk_size = %i, frags = %i, total = %i\n", chunk_size, setup.buf.block.frags, setup.buf.block.frags * chunk_size);
 
+	peak_meter_init();
+
 	/* stereo VU-meter isn't always available... */
 	if (vumeter == VUMETER_STEREO) {
 		if (hwparams.channels != 2 || !interleaved || verbose > 2)
@@ -1201,6 +2362,15 @@ static void set_params(void)
 	}
 
 	buffer_frames = buffer_size;	/* for position test */
+
+	rt_prefault(audiobuf, chunk_bytes);
+	if (conv.to)
+		rt_prefault(conv.buf, chunk_size * hwparams.channels * conv.to->width);
+	if (rsmp.L) {
+		rt_prefault(rsmp.tmp, rsmp.tmp_bytes);
+		rt_prefault(rsmp.buf, rsmp.buf_bytes);
+	}
+	rt_faults_mark(1);
 }
 
 static void init_stdin(void)
@@ -1298,6 +2468,75 @@ do { \
 } while (0)
 #endif
 
+/* monotonic time in microseconds (for statistics only) */
+static long long time_us(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#else
+	struct timeval now;
+	gettimeofday(&now, 0);
+	return (long long)now.tv_sec * 1000000 + now.tv_usec;
+#endif
+}
+
+/*
+ * wait until the PCM is ready for the next transfer
+ *
+ * In the nonblocking mode the PCM descriptors are polled together with
+ * the terminal, so the interactive pause is served on readiness instead
+ * of probing stdin before every transfer.  Without period wakeups the
+ * descriptors are not signalled by the device and the poll timeout is
+ * computed from the frames still missing to avail_min.
+ */
+static int stdin_polled(void)
+{
+	return nonblock && !test_nowait && fd != fileno(stdin) &&
+		term_c_lflag != -1 && isatty(fileno(stdin));
+}
+
+static void pcm_wait(void)
+{
+	unsigned short revents;
+	snd_pcm_sframes_t avail;
+	int count, n, timeout;
+
+	if (test_nowait)
+		return;
+	count = nonblock ? snd_pcm_poll_descriptors_count(handle) : 0;
+	if (count <= 0) {
+		snd_pcm_wait(handle, 100);
+		return;
+	}
+	struct pollfd pfds[count + 1];
+	n = snd_pcm_poll_descriptors(handle, pfds, count);
+	if (stdin_polled()) {
+		pfds[n].fd = fileno(stdin);
+		pfds[n].events = POLLIN;
+		pfds[n].revents = 0;
+		n++;
+	}
+	/* one buffer time at most, the device may be stopped */
+	timeout = buffer_frames * 1000 / hwparams.rate + 10;
+	if (no_period_wakeup) {
+		avail = snd_pcm_avail_update(handle);
+		if (avail < 0)
+			return;
+		if ((snd_pcm_uframes_t)avail >= wakeup_frames)
+			return;
+		timeout = ((wakeup_frames - avail) * 1000 +
+			   hwparams.rate - 1) / hwparams.rate;
+	}
+	if (poll(pfds, n, timeout) <= 0)
+		return;
+	if (n > count && (pfds[count].revents & POLLIN))
+		check_stdin();
+	/* errors are reported by the following transfer */
+	snd_pcm_poll_descriptors_revents(handle, pfds, count, &revents);
+}
+
 /* I/O error handler */
 static void xrun(void)
 {
@@ -1310,6 +2549,8 @@ static void xrun(void)
 		prg_exit(EXIT_FAILURE);
 	}
 	if (snd_pcm_status_get_state(status) == SND_PCM_STATE_XRUN) {
+		latency_xrun();
+		seek_index_xrun(status);
 		if (monotonic) {
 #ifdef HAVE_CLOCK_GETTIME
 			struct timespec now, diff, tstamp;
@@ -1333,7 +2574,7 @@ static void xrun(void)
 		}
 		if (verbose) {
 			fprintf(stderr, _("Status:\n"));
-			snd_pcm_status_dump(status, log);
+			snd_pcm_status_dump(status, log_output);
 		}
 		if ((res = snd_pcm_prepare(handle))<0) {
 			error(_("xrun: prepare error: %s"), snd_strerror(res));
@@ -1343,7 +2584,7 @@ static void xrun(void)
 	} if (snd_pcm_status_get_state(status) == SND_PCM_STATE_DRAINING) {
 		if (verbose) {
 			fprintf(stderr, _("Status(DRAINING):\n"));
-			snd_pcm_status_dump(status, log);
+			snd_pcm_status_dump(status, log_output);
 		}
 		if (stream == SND_PCM_STREAM_CAPTURE) {
 			fprintf(stderr, _("capture stream format change? attempting recover...\n"));
@@ -1356,7 +2597,7 @@ static void xrun(void)
 	}
 	if (verbose) {
 		fprintf(stderr, _("Status(R/W):\n"));
-		snd_pcm_status_dump(status, log);
+		snd_pcm_status_dump(status, log_output);
 	}
 	error(_("read/write error, state = %s"), snd_pcm_state_name(snd_pcm_status_get_state(status)));
 	prg_exit(EXIT_FAILURE);
@@ -1443,132 +2684,390 @@ static void print_vu_meter_stereo(int *perc, int *maxperc)
 	fputs(line, stdout);
 }
 
-static void print_vu_meter(signed int *perc, signed int *maxperc)
-{
-	if (vumeter == VUMETER_STEREO)
-		print_vu_meter_stereo(perc, maxperc);
-	else
-		print_vu_meter_mono(*perc, *maxperc);
-}
+/*
+ * peak/RMS meter
+ *
+ * All samples are decoded to a common scale (left-justified 32-bit
+ * integers or floats), so a single kernel handles every linear format.
+ * On x86 the native endian 16/24/32-bit and float formats are processed
+ * with SSE2/AVX2; the interleaved channels are tracked by keeping one
+ * accumulator lane per sample position in a block of lcm(channels, lanes)
+ * samples and folding the lanes to channels afterwards.
+ */
 
-/* peak handler */
-static void compute_max_peak(u_char *data, size_t count)
+enum {
+	PEAK_NONE = 0,
+	PEAK_8,
+	PEAK_16,
+	PEAK_16_SWAP,
+	PEAK_24_3LE,
+	PEAK_24_3BE,
+	PEAK_32,
+	PEAK_32_SWAP,
+	PEAK_FLOAT,
+	PEAK_FLOAT_SWAP,
+	PEAK_FLOAT64,
+	PEAK_FLOAT64_SWAP
+};
+
+static struct peak_meter {
+	int kind;
+	unsigned int width;		/* bytes per sample */
+	unsigned int shift;		/* left-justify 32-bit containers */
+	unsigned int mask;		/* sign flip for unsigned formats */
+	float scale;
+	unsigned int channels;
+	float *peak;			/* levels of the last update */
+	double *sumsq;
+	float *accp, *accs;		/* SIMD lane accumulators */
+	/* meter stream */
+	float *speak;
+	double *ssumsq;
+	snd_pcm_uframes_t sframes;
+	unsigned long long spos;
+} peak_meter;
+
+static void peak_meter_alloc(struct peak_meter *m, unsigned int c);
+
+static void peak_meter_init(void)
 {
-	signed int val, max, perc[2], max_peak[2];
-	static	int	run = 0;
-	size_t ocount = count;
-	int	format_little_endian = snd_pcm_format_little_endian(hwparams.format);	
-	int ichans, c;
+	struct peak_meter *m = &peak_meter;
+	snd_pcm_format_t format = hwparams.format;
+	int width = snd_pcm_format_width(format);
+	int pwidth = snd_pcm_format_physical_width(format);
+	int swap = !snd_pcm_format_cpu_endian(format);
+
+	m->kind = PEAK_NONE;
+	m->shift = 0;
+	m->mask = snd_pcm_format_unsigned(format) == 1 ? 0x80000000 : 0;
+	m->scale = 1.0f / 2147483648.0f;
+	m->width = pwidth / 8;
+	if (snd_pcm_format_float(format) == 1) {
+		m->scale = 1.0f;
+		if (pwidth == 32)
+			m->kind = swap ? PEAK_FLOAT_SWAP : PEAK_FLOAT;
+		else if (pwidth == 64)
+			m->kind = swap ? PEAK_FLOAT64_SWAP : PEAK_FLOAT64;
+	} else if (snd_pcm_format_linear(format) == 1) {
+		switch (pwidth) {
+		case 8:
+			m->kind = PEAK_8;
+			break;
+		case 16:
+			m->kind = swap ? PEAK_16_SWAP : PEAK_16;
+			break;
+		case 24:
+			m->kind = snd_pcm_format_little_endian(format) == 1 ?
+				PEAK_24_3LE : PEAK_24_3BE;
+			break;
+		case 32:
+			m->kind = swap ? PEAK_32_SWAP : PEAK_32;
+			m->shift = 32 - width;
+			break;
+		}
+		/* S20_3LE & co. are not supported */
+		if (pwidth == 24 && width < 24)
+			m->kind = PEAK_NONE;
+	}
 
-	if (vumeter == VUMETER_STEREO)
-		ichans = 2;
-	else
-		ichans = 1;
+	peak_meter_alloc(m, hwparams.channels);
+}
 
-	memset(max_peak, 0, sizeof(max_peak));
-	switch (bits_per_sample) {
-	case 8: {
-		signed char *valp = (signed char *)data;
-		signed char mask = snd_pcm_format_silence(hwparams.format);
-		c = 0;
-		while (count-- > 0) {
-			val = *valp++ ^ mask;
-			val = abs(val);
-			if (max_peak[c] < val)
-				max_peak[c] = val;
-			if (vumeter == VUMETER_STEREO)
-				c = !c;
+/* (re)allocate the level arrays and restart the meter stream */
+static void peak_meter_alloc(struct peak_meter *m, unsigned int c)
+{
+	if (c != m->channels) {
+		m->channels = c;
+		m->peak = realloc(m->peak, c * sizeof(*m->peak));
+		m->sumsq = realloc(m->sumsq, c * sizeof(*m->sumsq));
+		m->speak = realloc(m->speak, c * sizeof(*m->speak));
+		m->ssumsq = realloc(m->ssumsq, c * sizeof(*m->ssumsq));
+		/* the widest SIMD block is lcm(channels, 8) <= 8 * channels */
+		m->accp = realloc(m->accp, 8 * c * sizeof(*m->accp));
+		m->accs = realloc(m->accs, 8 * c * sizeof(*m->accs));
+		if (!m->peak || !m->sumsq || !m->speak || !m->ssumsq ||
+		    !m->accp || !m->accs) {
+			error(_("not enough memory"));
+			prg_exit(EXIT_FAILURE);
 		}
-		break;
 	}
-	case 16: {
-		signed short *valp = (signed short *)data;
-		signed short mask = snd_pcm_format_silence_16(hwparams.format);
-		signed short sval;
+	for (c = 0; c < m->channels; c++) {
+		m->speak[c] = 0;
+		m->ssumsq[c] = 0;
+	}
+	m->sframes = 0;
+	m->spos = 0;
+}
+
+static inline float peak_float_swap(const u_char *p)
+{
+	union { u_int i; float f; } u;
+	u.i = bswap_32(*(const u_int *)p);
+	return u.f;
+}
+
+static inline float peak_float64_swap(const u_char *p)
+{
+	union { unsigned long long i; double f; } u;
+	u.i = bswap_64(*(const unsigned long long *)p);
+	return u.f;
+}
+
+#ifdef PEAK_SIMD_X86
 
-		count /= 2;
-		c = 0;
-		while (count-- > 0) {
-			if (format_little_endian)
-				sval = le16toh(*valp);
+__attribute__((target("avx2")))
+static size_t peak_avx2(const u_char *data, size_t samples, size_t block,
+			const struct peak_meter *m, float *accp, float *accs)
+{
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	const __m128i shift = _mm_cvtsi32_si128(m->kind == PEAK_16 ? 16 : m->shift);
+	size_t i, k, nvec = block / 8;
+
+	for (i = 0; i + block <= samples; i += block) {
+		for (k = 0; k < nvec; k++) {
+			const u_char *src = data + (i + k * 8) * m->width;
+			__m256 v, p, s;
+			if (m->kind == PEAK_FLOAT)
+				v = _mm256_loadu_ps((const float *)src);
+			else if (m->kind == PEAK_16)
+				v = _mm256_cvtepi32_ps(_mm256_sll_epi32(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)src)), shift));
 			else
-				sval = be16toh(*valp);
-			sval = abs(sval) ^ mask;
-			if (max_peak[c] < sval)
-				max_peak[c] = sval;
-			valp++;
-			if (vumeter == VUMETER_STEREO)
-				c = !c;
+				v = _mm256_cvtepi32_ps(_mm256_sll_epi32(_mm256_loadu_si256((const __m256i *)src), shift));
+			v = _mm256_andnot_ps(sign, v);
+			p = _mm256_loadu_ps(accp + k * 8);
+			s = _mm256_loadu_ps(accs + k * 8);
+			_mm256_storeu_ps(accp + k * 8, _mm256_max_ps(p, v));
+			_mm256_storeu_ps(accs + k * 8, _mm256_add_ps(s, _mm256_mul_ps(v, v)));
 		}
-		break;
 	}
-	case 24: {
-		unsigned char *valp = data;
-		signed int mask = snd_pcm_format_silence_32(hwparams.format);
+	return i;
+}
 
-		count /= 3;
-		c = 0;
-		while (count-- > 0) {
-			if (format_little_endian) {
-				val = valp[0] | (valp[1]<<8) | (valp[2]<<16);
-			} else {
-				val = (valp[0]<<16) | (valp[1]<<8) | valp[2];
-			}
-			/* Correct signed bit in 32-bit value */
-			if (val & (1<<(bits_per_sample-1))) {
-				val |= 0xff<<24;	/* Negate upper bits too */
-			}
-			val = abs(val) ^ mask;
-			if (max_peak[c] < val)
-				max_peak[c] = val;
-			valp += 3;
-			if (vumeter == VUMETER_STEREO)
-				c = !c;
+__attribute__((target("sse2")))
+static size_t peak_sse2(const u_char *data, size_t samples, size_t block,
+			const struct peak_meter *m, float *accp, float *accs)
+{
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	const __m128i shift = _mm_cvtsi32_si128(m->shift);
+	size_t i, k, nvec = block / 4;
+
+	for (i = 0; i + block <= samples; i += block) {
+		for (k = 0; k < nvec; k++) {
+			const u_char *src = data + (i + k * 4) * m->width;
+			__m128 v, p, s;
+			if (m->kind == PEAK_FLOAT)
+				v = _mm_loadu_ps((const float *)src);
+			else if (m->kind == PEAK_16)
+				v = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_setzero_si128(), _mm_loadl_epi64((const __m128i *)src)));
+			else
+				v = _mm_cvtepi32_ps(_mm_sll_epi32(_mm_loadu_si128((const __m128i *)src), shift));
+			v = _mm_andnot_ps(sign, v);
+			p = _mm_loadu_ps(accp + k * 4);
+			s = _mm_loadu_ps(accs + k * 4);
+			_mm_storeu_ps(accp + k * 4, _mm_max_ps(p, v));
+			_mm_storeu_ps(accs + k * 4, _mm_add_ps(s, _mm_mul_ps(v, v)));
 		}
-		break;
 	}
-	case 32: {
-		signed int *valp = (signed int *)data;
-		signed int mask = snd_pcm_format_silence_32(hwparams.format);
+	return i;
+}
 
-		count /= 4;
-		c = 0;
-		while (count-- > 0) {
-			if (format_little_endian)
-				val = le32toh(*valp);
-			else
-				val = be32toh(*valp);
-			val = abs(val) ^ mask;
-			if (max_peak[c] < val)
-				max_peak[c] = val;
-			valp++;
-			if (vumeter == VUMETER_STEREO)
-				c = !c;
-		}
-		break;
+/* returns the count of processed samples (a multiple of channels) */
+static size_t peak_simd(struct peak_meter *m, const u_char *data, size_t samples,
+			unsigned int channels)
+{
+	static int isa = -1;
+	size_t block, done, j;
+	unsigned int lanes, a, b, c;
+
+	if (isa < 0) {
+		__builtin_cpu_init();
+		isa = __builtin_cpu_supports("avx2") ? 2 :
+		      __builtin_cpu_supports("sse2") ? 1 : 0;
 	}
-	default:
-		if (run == 0) {
-			fprintf(stderr, _("Unsupported bit size %d.\n"), (int)bits_per_sample);
-			run = 1;
-		}
-		return;
+	if (!isa || m->mask ||
+	    (m->kind != PEAK_16 && m->kind != PEAK_32 && m->kind != PEAK_FLOAT))
+		return 0;
+	lanes = isa == 2 ? 8 : 4;
+	for (a = channels, b = lanes; b; ) {	/* gcd */
+		c = a % b;
+		a = b;
+		b = c;
 	}
-	max = 1 << (bits_per_sample-1);
-	if (max <= 0)
-		max = 0x7fffffff;
-
-	for (c = 0; c < ichans; c++) {
-		if (bits_per_sample > 16)
-			perc[c] = max_peak[c] / (max / 100);
-		else
-			perc[c] = max_peak[c] * 100 / max;
+	block = channels / a * lanes;
+	if (samples < block)
+		return 0;
+	memset(m->accp, 0, block * sizeof(*m->accp));
+	memset(m->accs, 0, block * sizeof(*m->accs));
+	if (isa == 2)
+		done = peak_avx2(data, samples, block, m, m->accp, m->accs);
+	else
+		done = peak_sse2(data, samples, block, m, m->accp, m->accs);
+	for (j = 0; j < block; j++) {
+		c = j % channels;
+		if (m->accp[j] > m->peak[c])
+			m->peak[c] = m->accp[j];
+		m->sumsq[c] += m->accs[j];
 	}
+	return done;
+}
 
-	if (interleaved && verbose <= 2) {
-		static int maxperc[2];
-		static time_t t=0;
-		const time_t tt=time(NULL);
+#endif /* PEAK_SIMD_X86 */
+
+#define PEAK_SCALAR(decode) do { \
+	for (; i < samples; i++, p += m->width) { \
+		float v = (decode); \
+		if (v < 0) \
+			v = -v; \
+		if (v > m->peak[c]) \
+			m->peak[c] = v; \
+		m->sumsq[c] += v * v; \
+		if (++c == channels) \
+			c = 0; \
+	} \
+} while (0)
+
+/*
+ * compute peak and sum of squares of each channel of interleaved data,
+ * the results are stored to m->peak[] and m->sumsq[]
+ */
+static int peak_compute_meter(struct peak_meter *m, const u_char *data,
+			      size_t samples, unsigned int channels)
+{
+	const u_char *p;
+	unsigned int c = 0;
+	size_t i = 0;
+
+	if (m->kind == PEAK_NONE)
+		return -EINVAL;
+	for (c = 0; c < channels; c++) {
+		m->peak[c] = 0;
+		m->sumsq[c] = 0;
+	}
+	c = 0;
+#ifdef PEAK_SIMD_X86
+	i = peak_simd(m, data, samples, channels);
+#endif
+	p = data + i * m->width;
+	switch (m->kind) {
+	case PEAK_8:
+		PEAK_SCALAR((float)(int)(((u_int)p[0] << 24) ^ m->mask));
+		break;
+	case PEAK_16:
+		PEAK_SCALAR((float)(int)(((u_int)*(const u_short *)p << 16) ^ m->mask));
+		break;
+	case PEAK_16_SWAP:
+		PEAK_SCALAR((float)(int)(((u_int)bswap_16(*(const u_short *)p) << 16) ^ m->mask));
+		break;
+	case PEAK_24_3LE:
+		PEAK_SCALAR((float)(int)(((u_int)p[0] << 8 | (u_int)p[1] << 16 | (u_int)p[2] << 24) ^ m->mask));
+		break;
+	case PEAK_24_3BE:
+		PEAK_SCALAR((float)(int)(((u_int)p[2] << 8 | (u_int)p[1] << 16 | (u_int)p[0] << 24) ^ m->mask));
+		break;
+	case PEAK_32:
+		PEAK_SCALAR((float)(int)((*(const u_int *)p << m->shift) ^ m->mask));
+		break;
+	case PEAK_32_SWAP:
+		PEAK_SCALAR((float)(int)((bswap_32(*(const u_int *)p) << m->shift) ^ m->mask));
+		break;
+	case PEAK_FLOAT:
+		PEAK_SCALAR(*(const float *)p);
+		break;
+	case PEAK_FLOAT_SWAP:
+		PEAK_SCALAR(peak_float_swap(p));
+		break;
+	case PEAK_FLOAT64:
+		PEAK_SCALAR((float)*(const double *)p);
+		break;
+	case PEAK_FLOAT64_SWAP:
+		PEAK_SCALAR(peak_float64_swap(p));
+		break;
+	}
+	for (c = 0; c < channels; c++) {
+		m->peak[c] *= m->scale;
+		m->sumsq[c] *= (double)m->scale * m->scale;
+	}
+	return 0;
+}
+
+#undef PEAK_SCALAR
+
+static int peak_compute(const u_char *data, size_t samples, unsigned int channels)
+{
+	return peak_compute_meter(&peak_meter, data, samples, channels);
+}
+
+/* one JSON object per line: stream position and linear levels (0..1) */
+static void peak_meter_write(struct peak_meter *m, FILE *f)
+{
+	unsigned int c;
+
+	fprintf(f, "{\"time\":%.3f,\"frames\":%lu,\"peak\":[",
+		(double)m->spos / hwparams.rate, (unsigned long)m->sframes);
+	for (c = 0; c < m->channels; c++)
+		fprintf(f, "%s%.6f", c ? "," : "", m->speak[c]);
+	fprintf(f, "],\"rms\":[");
+	for (c = 0; c < m->channels; c++)
+		fprintf(f, "%s%.6f", c ? "," : "",
+			sqrt(m->ssumsq[c] / m->sframes));
+	fprintf(f, "]}\n");
+	fflush(f);
+	m->spos += m->sframes;
+	m->sframes = 0;
+	for (c = 0; c < m->channels; c++) {
+		m->speak[c] = 0;
+		m->ssumsq[c] = 0;
+	}
+}
+
+static void peak_meter_stream(struct peak_meter *m, FILE *f, unsigned int first,
+			      unsigned int channels, size_t frames)
+{
+	unsigned int c;
+
+	for (c = 0; c < channels; c++) {
+		if (m->peak[c] > m->speak[first + c])
+			m->speak[first + c] = m->peak[c];
+		m->ssumsq[first + c] += m->sumsq[c];
+	}
+	/* count frames once all channels were seen */
+	if (first + channels < m->channels)
+		return;
+	m->sframes += frames;
+	if (m->sframes * 1000 >= (unsigned long long)hwparams.rate * meter_interval)
+		peak_meter_write(m, f);
+}
+
+static void print_vu_meter(signed int *perc, signed int *maxperc)
+{
+	if (vumeter == VUMETER_STEREO)
+		print_vu_meter_stereo(perc, maxperc);
+	else
+		print_vu_meter_mono(*perc, *maxperc);
+}
+
+static void peak_display(float *peak, unsigned int channels, size_t samples)
+{
+	signed int val, max, perc[2];
+	unsigned int c, ichans;
+	float mono = 0;
+
+	if (vumeter == VUMETER_STEREO) {
+		ichans = 2;
+		for (c = 0; c < 2; c++)
+			perc[c] = peak[c] * 100;
+	} else {
+		ichans = 1;
+		for (c = 0; c < channels; c++)
+			if (peak[c] > mono)
+				mono = peak[c];
+		perc[0] = mono * 100;
+	}
+
+	if (interleaved && verbose <= 2) {
+		static int maxperc[2];
+		static time_t t=0;
+		const time_t tt=time(NULL);
 		if(tt>t) {
 			t=tt;
 			maxperc[0] = 0;
@@ -1583,7 +3082,10 @@ static void compute_max_peak(u_char *data, size_t count)
 		fflush(stdout);
 	}
 	else if(verbose==3) {
-		printf(_("Max peak (%li samples): 0x%08x "), (long)ocount, max_peak[0]);
+		max = 1 << (bits_per_sample-1);
+		if (max <= 0)
+			max = 0x7fffffff;
+		printf(_("Max peak (%li samples): 0x%08x "), (long)samples, (int)(mono * max));
 		for (val = 0; val < 20; val++)
 			if (val <= perc[0] / 5)
 				putchar('#');
@@ -1594,6 +3096,50 @@ static void compute_max_peak(u_char *data, size_t count)
 	}
 }
 
+/* peak handler, count is the number of samples in interleaved data */
+static void compute_max_peak(u_char *data, size_t count)
+{
+	static	int	run = 0;
+	unsigned int channels = hwparams.channels;
+
+	if (peak_compute(data, count, channels) < 0) {
+		if (run == 0) {
+			fprintf(stderr, _("Unsupported bit size %d.\n"), (int)bits_per_sample);
+			run = 1;
+		}
+		return;
+	}
+	if (meter_file)
+		peak_meter_stream(&peak_meter, meter_file, 0, channels,
+				  count / channels);
+	trigger_fold(count / channels);
+	if (vumeter)
+		peak_display(peak_meter.peak, channels, count);
+}
+
+/* peak handler for non-interleaved data, count is the number of frames */
+static void compute_max_peakv(u_char **data, unsigned int channels, size_t count)
+{
+	static	int	run = 0;
+	float peak[channels];
+	unsigned int channel;
+
+	for (channel = 0; channel < channels; channel++) {
+		if (peak_compute(data[channel], count, 1) < 0) {
+			if (run == 0) {
+				fprintf(stderr, _("Unsupported bit size %d.\n"), (int)bits_per_sample);
+				run = 1;
+			}
+			return;
+		}
+		peak[channel] = peak_meter.peak[0];
+		if (meter_file)
+			peak_meter_stream(&peak_meter, meter_file, channel, 1, count);
+	}
+	if (vumeter)
+		peak_display(peak, channels, count * channels);
+}
+
 static void do_test_position(void)
 {
 	static long counter = 0;
@@ -1653,29 +3199,375 @@ static void do_test_position(void)
 	}
 }
 
+/*
+ * latency instrumentation (--latency-stats)
+ *
+ * The transfer loop only stores events to a lock-free single producer
+ * ring, a collector thread folds them into log-linear (HDR style)
+ * histograms with 4 significant bits, i.e. about 6% precision over the
+ * whole 64-bit range.  The collector writes the histograms as JSON on
+ * SIGUSR2 and when aplay exits.  The events are dropped (and counted) when the
+ * collector cannot keep up, the transfer loop never waits for it.
+ */
+
+#define LATENCY_RING		4096		/* events, power of two */
+#define LATENCY_XRUNS		64		/* last xrun times kept */
+#define HIST_SUB_BITS		4
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS		((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum {
+	LATENCY_TRANSFER,	/* read/write call duration, us */
+	LATENCY_JITTER,		/* wakeup interval deviation from the period, us */
+	LATENCY_AVAIL,		/* frames */
+	LATENCY_DELAY,		/* frames */
+	LATENCY_HISTS,
+	LATENCY_XRUN = LATENCY_HISTS
+};
+
+static const char *const latency_hist_names[LATENCY_HISTS] = {
+	"transfer_us", "wakeup_jitter_us", "avail_frames", "delay_frames"
+};
+
+struct histogram {
+	unsigned long long count;
+	unsigned long long min, max, sum;
+	unsigned long long bucket[HIST_BUCKETS];
+};
+
+struct latency_event {
+	int type;
+	unsigned long long value;
+	long long time;
+};
+
+static struct latency_stats {
+	int active;
+	pthread_t thread;
+	sem_t wake;
+	volatile sig_atomic_t dump;
+	int stop;
+	int done;			/* the final dump is written */
+	long long start;
+	long long last_wakeup;
+	/* producer: the transfer loop, consumer: the collector thread */
+	struct latency_event ring[LATENCY_RING];
+	unsigned int head;		/* written events */
+	unsigned int tail;		/* collected events */
+	unsigned long long dropped;
+	/* owned by the collector */
+	struct histogram hist[LATENCY_HISTS];
+	unsigned long long xruns;
+	long long xrun_time[LATENCY_XRUNS];
+} latency;
+
+static inline unsigned int hist_index(unsigned long long v)
+{
+	int e;
+
+	if (v < 2 * HIST_SUB)
+		return v;
+	e = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return e * HIST_SUB + (v >> e);
+}
+
+/* the highest value counted in the bucket */
+static unsigned long long hist_value(unsigned int idx)
+{
+	int e;
+
+	if (idx < 2 * HIST_SUB)
+		return idx;
+	e = idx / HIST_SUB - 1;
+	return (((unsigned long long)(idx % HIST_SUB + HIST_SUB) + 1) << e) - 1;
+}
+
+static void hist_add(struct histogram *h, unsigned long long v)
+{
+	if (h->count == 0 || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->count++;
+	h->sum += v;
+	h->bucket[hist_index(v)]++;
+}
+
+static unsigned long long hist_percentile(const struct histogram *h, double p)
+{
+	unsigned long long need, seen = 0, v;
+	unsigned int i;
+
+	need = (unsigned long long)(h->count * p / 100.0 + 0.5);
+	if (need < 1)
+		need = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= need) {
+			v = hist_value(i);
+			return v > h->max ? h->max : v;
+		}
+	}
+	return h->max;
+}
+
+static void latency_event(int type, unsigned long long value, long long time)
+{
+	unsigned int head = latency.head;
+	struct latency_event *ev;
+
+	if (head - __atomic_load_n(&latency.tail, __ATOMIC_ACQUIRE) >= LATENCY_RING) {
+		latency.dropped++;
+		return;
+	}
+	ev = &latency.ring[head & (LATENCY_RING - 1)];
+	ev->type = type;
+	ev->value = value;
+	ev->time = time;
+	__atomic_store_n(&latency.head, head + 1, __ATOMIC_RELEASE);
+}
+
+static inline long long latency_now(void)
+{
+	return latency.active ? time_us() : 0;
+}
+
+/* record one read/write call started at t */
+static void latency_transfer(long long t, snd_pcm_sframes_t r)
+{
+	snd_pcm_sframes_t avail, delay;
+	long long now, period;
+
+	if (!latency.active || r == -EAGAIN)
+		return;
+	now = time_us();
+	latency_event(LATENCY_TRANSFER, now - t, now);
+	if (r <= 0)
+		return;
+	if (latency.last_wakeup) {
+		period = (long long)chunk_size * 1000000 / hwparams.rate;
+		period = now - latency.last_wakeup - period;
+		latency_event(LATENCY_JITTER, period < 0 ? -period : period, now);
+	}
+	latency.last_wakeup = now;
+	if (snd_pcm_avail_delay(handle, &avail, &delay) < 0)
+		return;
+	latency_event(LATENCY_AVAIL, avail < 0 ? 0 : avail, now);
+	latency_event(LATENCY_DELAY, delay < 0 ? 0 : delay, now);
+}
+
+static void latency_xrun(void)
+{
+	if (!latency.active)
+		return;
+	latency_event(LATENCY_XRUN, 0, time_us());
+	/* the interval across the restart is not a wakeup jitter */
+	latency.last_wakeup = 0;
+}
+
+static void latency_collect(void)
+{
+	unsigned int tail = latency.tail;
+	unsigned int head = __atomic_load_n(&latency.head, __ATOMIC_ACQUIRE);
+	struct latency_event *ev;
+
+	for (; tail != head; tail++) {
+		ev = &latency.ring[tail & (LATENCY_RING - 1)];
+		if (ev->type == LATENCY_XRUN)
+			latency.xrun_time[latency.xruns++ % LATENCY_XRUNS] =
+				ev->time - latency.start;
+		else
+			hist_add(&latency.hist[ev->type], ev->value);
+	}
+	__atomic_store_n(&latency.tail, tail, __ATOMIC_RELEASE);
+}
+
+static void latency_write_hist(FILE *f, const struct histogram *h)
+{
+	static const double pct[] = { 50, 90, 99, 99.9, 99.99 };
+	unsigned int i, n = 0;
+
+	fprintf(f, "{\"count\": %llu", h->count);
+	if (h->count) {
+		fprintf(f, ", \"min\": %llu, \"max\": %llu, \"mean\": %.1f",
+			h->min, h->max, (double)h->sum / h->count);
+		fprintf(f, ", \"percentiles\": {");
+		for (i = 0; i < sizeof(pct) / sizeof(pct[0]); i++)
+			fprintf(f, "%s\"%g\": %llu", i ? ", " : "", pct[i],
+				hist_percentile(h, pct[i]));
+		fprintf(f, "}");
+	}
+	/* the non-empty buckets as [highest value, count] pairs */
+	fprintf(f, ", \"buckets\": [");
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (!h->bucket[i])
+			continue;
+		fprintf(f, "%s[%llu, %llu]", n++ ? ", " : "",
+			hist_value(i), h->bucket[i]);
+	}
+	fprintf(f, "]}");
+}
+
+static void latency_dump(void)
+{
+	char tmpname[PATH_MAX];
+	unsigned long long i, first;
+	FILE *f;
+	int h;
+
+	if (strcmp(latency_name, "-") == 0) {
+		f = stderr;
+	} else {
+		snprintf(tmpname, sizeof(tmpname), "%s.tmp", latency_name);
+		f = fopen(tmpname, "w");
+		if (f == NULL) {
+			fprintf(stderr, _("Cannot create %s: %s\n"), tmpname,
+				strerror(errno));
+			return;
+		}
+	}
+	fprintf(f, "{\"pcm\": \"%s\", \"stream\": \"%s\", \"rate\": %u, "
+		"\"period_frames\": %lu, \"buffer_frames\": %lu, "
+		"\"elapsed_us\": %lld, \"dropped_events\": %llu,\n",
+		snd_pcm_name(handle), snd_pcm_stream_name(stream), hwparams.rate,
+		(unsigned long)chunk_size, (unsigned long)buffer_frames,
+		time_us() - latency.start,
+		__atomic_load_n(&latency.dropped, __ATOMIC_RELAXED));
+	fprintf(f, " \"histograms\": {\n");
+	for (h = 0; h < LATENCY_HISTS; h++) {
+		fprintf(f, "  \"%s\": ", latency_hist_names[h]);
+		latency_write_hist(f, &latency.hist[h]);
+		fprintf(f, "%s\n", h < LATENCY_HISTS - 1 ? "," : "");
+	}
+	fprintf(f, " },\n \"xruns\": {\"count\": %llu, \"times_us\": [",
+		latency.xruns);
+	first = latency.xruns > LATENCY_XRUNS ? latency.xruns - LATENCY_XRUNS : 0;
+	for (i = first; i < latency.xruns; i++)
+		fprintf(f, "%s%lld", i > first ? ", " : "",
+			latency.xrun_time[i % LATENCY_XRUNS]);
+	fprintf(f, "]}\n}\n");
+	if (f == stderr)
+		return;
+	/* replace the old dump at once for the readers */
+	if (fclose(f) != 0 || rename(tmpname, latency_name) < 0)
+		fprintf(stderr, _("Cannot write %s: %s\n"), latency_name,
+			strerror(errno));
+}
+
+static void *latency_thread(void *arg)
+{
+	struct timespec ts;
+
+	for (;;) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		sem_timedwait(&latency.wake, &ts);
+		latency_collect();
+		if (__atomic_load_n(&latency.stop, __ATOMIC_ACQUIRE))
+			break;
+		if (latency.dump) {
+			latency.dump = 0;
+			latency_dump();
+		}
+	}
+	latency_dump();
+	__atomic_store_n(&latency.done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void signal_handler_latency(int sig)
+{
+	latency.dump = 1;
+	sem_post(&latency.wake);
+}
+
+static void latency_start(void)
+{
+	sigset_t all, old;
+	int err;
+
+	sem_init(&latency.wake, 0, 0);
+	latency.start = time_us();
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	err = pthread_create(&latency.thread, NULL, latency_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		error(_("unable to create latency thread: %s"), strerror(err));
+		prg_exit(EXIT_FAILURE);
+	}
+	latency.active = 1;
+}
+
+/* let the collector write the final dump (also called from signal handler) */
+static void latency_flush(void)
+{
+	unsigned int wait;
+
+	if (!latency.active)
+		return;
+	latency.active = 0;
+	__atomic_store_n(&latency.stop, 1, __ATOMIC_RELEASE);
+	sem_post(&latency.wake);
+	for (wait = 0; !__atomic_load_n(&latency.done, __ATOMIC_ACQUIRE) &&
+		       wait < 1000; wait++)
+		usleep(1000);
+}
+
+static void latency_stop(void)
+{
+	int active = latency.active;
+
+	latency_flush();
+	if (active)
+		pthread_join(latency.thread, NULL);
+}
+
 /*
  *  write function
  */
 
 static ssize_t pcm_write(u_char *data, size_t count)
 {
+	long long t;
 	ssize_t r;
 	ssize_t result = 0;
+	u_char *dev = data;
+	size_t dev_frame = bits_per_frame / 8;
 
 	if (count < chunk_size) {
 		snd_pcm_format_set_silence(hwparams.format, data + count * bits_per_frame / 8, (chunk_size - count) * hwparams.channels);
 		count = chunk_size;
 	}
+	if (rsmp.L) {
+		/* the written count is in device frames */
+		if (vumeter || meter_file)
+			compute_max_peak(data, count * hwparams.channels);
+		result = count;
+		count = resampler_run(data, count);
+		dev = rsmp.buf;
+		dev_frame = hwparams.channels * rsmp.to->width;
+	} else if (conv.to) {
+		converter_run(data, conv.buf, count * hwparams.channels, 1);
+		dev = conv.buf;
+		dev_frame = hwparams.channels * conv.to->width;
+	}
 	while (count > 0) {
 		if (test_position)
 			do_test_position();
-		check_stdin();
-		r = writei_func(handle, data, count);
+		if (!stdin_polled())
+			check_stdin();
+		t = latency_now();
+		r = writei_func(handle, dev, count);
+		latency_transfer(t, r);
 		if (test_position)
 			do_test_position();
 		if (r == -EAGAIN || (r >= 0 && (size_t)r < count)) {
-			if (!test_nowait)
-				snd_pcm_wait(handle, 100);
+			pcm_wait();
 		} else if (r == -EPIPE) {
 			xrun();
 		} else if (r == -ESTRPIPE) {
@@ -1685,18 +3577,36 @@ static ssize_t pcm_write(u_char *data, size_t count)
 			prg_exit(EXIT_FAILURE);
 		}
 		if (r > 0) {
-			if (vumeter)
-				compute_max_peak(data, r * hwparams.channels);
-			result += r;
+			if (!rsmp.L) {
+				if (vumeter || meter_file)
+					compute_max_peak(data, r * hwparams.channels);
+				result += r;
+				data += r * bits_per_frame / 8;
+			}
 			count -= r;
-			data += r * bits_per_frame / 8;
+			dev += r * dev_frame;
 		}
 	}
 	return result;
 }
 
+/* push the file frames still in the resampler history out with silence */
+static void resampler_drain(void)
+{
+	size_t n;
+
+	if (!rsmp.L)
+		return;
+	for (n = 0; n < rsmp.taps; n += chunk_size) {
+		snd_pcm_format_set_silence(hwparams.format, audiobuf, chunk_size * hwparams.channels);
+		if (pcm_write(audiobuf, chunk_size) != (ssize_t)chunk_size)
+			break;
+	}
+}
+
 static ssize_t pcm_writev(u_char **data, unsigned int channels, size_t count)
 {
+	long long t;
 	ssize_t r;
 	size_t result = 0;
 
@@ -1708,21 +3618,30 @@ static ssize_t pcm_writev(u_char **data, unsigned int channels, size_t count)
 			snd_pcm_format_set_silence(hwparams.format, data[channel] + offset * bits_per_sample / 8, remaining);
 		count = chunk_size;
 	}
+	if (conv.to) {
+		unsigned int channel;
+		for (channel = 0; channel < channels; channel++)
+			converter_run(data[channel], conv.buf + channel * chunk_size * conv.to->width, count, 1);
+	}
 	while (count > 0) {
 		unsigned int channel;
-		void *bufs[channels];
+		void *bufs[channels], *devbufs[channels];
 		size_t offset = result;
-		for (channel = 0; channel < channels; channel++)
+		for (channel = 0; channel < channels; channel++) {
 			bufs[channel] = data[channel] + offset * bits_per_sample / 8;
+			devbufs[channel] = conv.to ? conv.buf + (channel * chunk_size + offset) * conv.to->width : bufs[channel];
+		}
 		if (test_position)
 			do_test_position();
-		check_stdin();
-		r = writen_func(handle, bufs, count);
+		if (!stdin_polled())
+			check_stdin();
+		t = latency_now();
+		r = writen_func(handle, devbufs, count);
+		latency_transfer(t, r);
 		if (test_position)
 			do_test_position();
 		if (r == -EAGAIN || (r >= 0 && (size_t)r < count)) {
-			if (!test_nowait)
-				snd_pcm_wait(handle, 100);
+			pcm_wait();
 		} else if (r == -EPIPE) {
 			xrun();
 		} else if (r == -ESTRPIPE) {
@@ -1732,10 +3651,8 @@ static ssize_t pcm_writev(u_char **data, unsigned int channels, size_t count)
 			prg_exit(EXIT_FAILURE);
 		}
 		if (r > 0) {
-			if (vumeter) {
-				for (channel = 0; channel < channels; channel++)
-					compute_max_peak(data[channel], r);
-			}
+			if (vumeter || meter_file)
+				compute_max_peakv((u_char **)bufs, channels, r);
 			result += r;
 			count -= r;
 		}
@@ -1749,24 +3666,29 @@ static ssize_t pcm_writev(u_char **data, unsigned int channels, size_t count)
 
 static ssize_t pcm_read(u_char *data, size_t rcount)
 {
+	long long t;
 	ssize_t r;
 	size_t result = 0;
 	size_t count = rcount;
+	size_t dev_frame = conv.to ? hwparams.channels * conv.to->width : 0;
 
 	if (count != chunk_size) {
 		count = chunk_size;
 	}
 
 	while (count > 0) {
+		u_char *dev = conv.to ? conv.buf + result * dev_frame : data;
 		if (test_position)
 			do_test_position();
-		check_stdin();
-		r = readi_func(handle, data, count);
+		if (!stdin_polled())
+			check_stdin();
+		t = latency_now();
+		r = readi_func(handle, dev, count);
+		latency_transfer(t, r);
 		if (test_position)
 			do_test_position();
 		if (r == -EAGAIN || (r >= 0 && (size_t)r < count)) {
-			if (!test_nowait)
-				snd_pcm_wait(handle, 100);
+			pcm_wait();
 		} else if (r == -EPIPE) {
 			xrun();
 		} else if (r == -ESTRPIPE) {
@@ -1776,7 +3698,9 @@ static ssize_t pcm_read(u_char *data, size_t rcount)
 			prg_exit(EXIT_FAILURE);
 		}
 		if (r > 0) {
-			if (vumeter)
+			if (conv.to)
+				converter_run(dev, data, r * hwparams.channels, -1);
+			if (vumeter || meter_file)
 				compute_max_peak(data, r * hwparams.channels);
 			result += r;
 			count -= r;
@@ -1788,6 +3712,7 @@ static ssize_t pcm_read(u_char *data, size_t rcount)
 
 static ssize_t pcm_readv(u_char **data, unsigned int channels, size_t rcount)
 {
+	long long t;
 	ssize_t r;
 	size_t result = 0;
 	size_t count = rcount;
@@ -1798,19 +3723,23 @@ static ssize_t pcm_readv(u_char **data, unsigned int channels, size_t rcount)
 
 	while (count > 0) {
 		unsigned int channel;
-		void *bufs[channels];
+		void *bufs[channels], *devbufs[channels];
 		size_t offset = result;
-		for (channel = 0; channel < channels; channel++)
+		for (channel = 0; channel < channels; channel++) {
 			bufs[channel] = data[channel] + offset * bits_per_sample / 8;
+			devbufs[channel] = conv.to ? conv.buf + (channel * chunk_size + offset) * conv.to->width : bufs[channel];
+		}
 		if (test_position)
 			do_test_position();
-		check_stdin();
-		r = readn_func(handle, bufs, count);
+		if (!stdin_polled())
+			check_stdin();
+		t = latency_now();
+		r = readn_func(handle, devbufs, count);
+		latency_transfer(t, r);
 		if (test_position)
 			do_test_position();
 		if (r == -EAGAIN || (r >= 0 && (size_t)r < count)) {
-			if (!test_nowait)
-				snd_pcm_wait(handle, 100);
+			pcm_wait();
 		} else if (r == -EPIPE) {
 			xrun();
 		} else if (r == -ESTRPIPE) {
@@ -1820,10 +3749,11 @@ static ssize_t pcm_readv(u_char **data, unsigned int channels, size_t rcount)
 			prg_exit(EXIT_FAILURE);
 		}
 		if (r > 0) {
-			if (vumeter) {
+			if (conv.to)
 				for (channel = 0; channel < channels; channel++)
-					compute_max_peak(data[channel], r);
-			}
+					converter_run(devbufs[channel], bufs[channel], r, -1);
+			if (vumeter || meter_file)
+				compute_max_peakv((u_char **)bufs, channels, r);
 			result += r;
 			count -= r;
 		}
@@ -1833,289 +3763,417 @@ static ssize_t pcm_readv(u_char **data, unsigned int channels, size_t rcount)
 
 /*
  *  ok, let's play a .voc file
+ *
+ *  The blocks are parsed from a mapping of the whole file when the file
+ *  can be mapped: whole chunks of sample data go to the PCM straight
+ *  from the mapping, loops only move the parse position back and the
+ *  kernel is asked to read ahead of the parser.  Pipes are read directly
+ *  into the chunk buffer.  Silence blocks are written from one prepared
+ *  chunk of silence.
  */
 
-static ssize_t voc_pcm_write(u_char *data, size_t count)
+#define VOC_AHEAD	(1024 * 1024)	/* read ahead of the parse position */
+
+struct voc_stream {
+	int fd;
+	char *name;
+	u_char *map;		/* the whole file, NULL when it is read */
+	size_t size;		/* size of the mapping */
+	size_t pos;		/* parse position in the mapping */
+	size_t ahead;		/* end of the requested read ahead */
+	size_t page;
+	off64_t offset;		/* parse position when the file is read */
+	int seekable;
+	u_char *silence;	/* one chunk of silence */
+	unsigned int rate;	/* requested PCM setup */
+	unsigned int channels;
+};
+
+static void voc_open(struct voc_stream *vs, int fd, int ofs, char *name)
 {
-	ssize_t result = count, r;
-	size_t size;
+	struct stat st;
+	void *map;
+
+	memset(vs, 0, sizeof(*vs));
+	vs->fd = fd;
+	vs->name = name;
+	vs->page = sysconf(_SC_PAGESIZE);
+	vs->offset = lseek64(fd, 0, SEEK_CUR);
+	vs->seekable = vs->offset >= 0;
+	if (vs->seekable && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+	    st.st_size > vs->offset && (off64_t)(size_t)st.st_size == st.st_size) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			vs->map = map;
+			vs->size = st.st_size;
+			vs->pos = vs->offset;
+			vs->ahead = vs->pos;
+			madvise(map, vs->size, MADV_SEQUENTIAL);
+		}
+	}
+	if (vs->offset < 0)
+		vs->offset = 0;
+	/* the rest of the header */
+	if (vs->map) {
+		vs->pos += ofs;
+		if (vs->pos > vs->size)
+			vs->pos = vs->size;
+		return;
+	}
+	while (ofs > 0) {
+		u_char buf[256];
+		ssize_t r = ofs > (int)sizeof(buf) ? (int)sizeof(buf) : ofs;
 
-	while (count > 0) {
-		size = count;
-		if (size > chunk_bytes - buffer_pos)
-			size = chunk_bytes - buffer_pos;
-		memcpy(audiobuf + buffer_pos, data, size);
-		data += size;
-		count -= size;
-		buffer_pos += size;
-		if ((size_t)buffer_pos == chunk_bytes) {
-			if ((size_t)(r = pcm_write(audiobuf, chunk_size)) != chunk_size)
-				return r;
-			buffer_pos = 0;
+		if (safe_read(fd, buf, r) != r) {
+			error(_("read error"));
+			prg_exit(EXIT_FAILURE);
 		}
+		vs->offset += r;
+		ofs -= r;
 	}
-	return result;
 }
 
-static void voc_write_silence(unsigned x)
+static void voc_close(struct voc_stream *vs)
 {
-	unsigned l;
-	u_char *buf;
+	if (vs->map)
+		munmap(vs->map, vs->size);
+	free(vs->silence);
+}
 
-	buf = (u_char *) malloc(chunk_bytes);
-	if (buf == NULL) {
-		error(_("can't allocate buffer for silence"));
-		return;		/* not fatal error */
-	}
-	snd_pcm_format_set_silence(hwparams.format, buf, chunk_size * hwparams.channels);
-	while (x > 0) {
-		l = x;
-		if (l > chunk_size)
-			l = chunk_size;
-		if (voc_pcm_write(buf, l) != (ssize_t)l) {
-			error(_("write error"));
-			prg_exit(EXIT_FAILURE);
-		}
-		x -= l;
+static size_t voc_read(struct voc_stream *vs, void *buf, size_t count)
+{
+	ssize_t r;
+
+	if (vs->map) {
+		if (count > vs->size - vs->pos)
+			count = vs->size - vs->pos;
+		memcpy(buf, vs->map + vs->pos, count);
+		vs->pos += count;
+		return count;
 	}
-	free(buf);
+	r = safe_read(vs->fd, buf, count);
+	if (r < 0) {
+		perror(vs->name);
+		prg_exit(EXIT_FAILURE);
+	}
+	vs->offset += r;
+	return r;
 }
 
-static void voc_pcm_flush(void)
+static off64_t voc_tell(struct voc_stream *vs)
 {
-	if (buffer_pos > 0) {
-		size_t b;
-		if (snd_pcm_format_set_silence(hwparams.format, audiobuf + buffer_pos, chunk_bytes - buffer_pos * 8 / bits_per_sample) < 0)
-			fprintf(stderr, _("voc_pcm_flush - silence error"));
-		b = chunk_size;
-		if (pcm_write(audiobuf, b) != (ssize_t)b)
-			error(_("voc_pcm_flush error"));
-	}
-	snd_pcm_nonblock(handle, 0);
-	snd_pcm_drain(handle);
-	snd_pcm_nonblock(handle, nonblock);
+	return vs->map ? (off64_t)vs->pos : vs->offset;
 }
 
-static void voc_play(int fd, int ofs, char *name)
+static void voc_seek(struct voc_stream *vs, off64_t pos)
 {
-	int l;
-	VocBlockType *bp;
-	VocVoiceData *vd;
-	VocExtBlock *eb;
-	size_t nextblock, in_buffer;
-	u_char *data, *buf;
-	char was_extended = 0, output = 0;
-	u_short *sp, repeat = 0;
-	size_t silence;
-	off64_t filepos = 0;
-
-#define COUNT(x)	nextblock -= x; in_buffer -= x; data += x
-#define COUNT1(x)	in_buffer -= x; data += x
-
-	data = buf = (u_char *)malloc(64 * 1024);
-	buffer_pos = 0;
-	if (data == NULL) {
-		error(_("malloc error"));
-		prg_exit(EXIT_FAILURE);
+	if (vs->map) {
+		vs->pos = vs->ahead = pos;
+		return;
 	}
-	if (!quiet_mode) {
-		fprintf(stderr, _("Playing Creative Labs Channel file '%s'...\n"), name);
+	if (lseek64(vs->fd, pos, SEEK_SET) < 0) {
+		perror(vs->name);
+		prg_exit(EXIT_FAILURE);
 	}
-	/* first we waste the rest of header, ugly but we don't need seek */
-	while (ofs > (ssize_t)chunk_bytes) {
-		if ((size_t)safe_read(fd, buf, chunk_bytes) != chunk_bytes) {
-			error(_("read error"));
+	vs->offset = pos;
+}
+
+static int voc_skip(struct voc_stream *vs, size_t count)
+{
+	u_char buf[256];
+	size_t l;
+
+	if (vs->map) {
+		if (count > vs->size - vs->pos)
+			return 0;
+		vs->pos += count;
+		return 1;
+	}
+	while (count > 0) {
+		l = count > sizeof(buf) ? sizeof(buf) : count;
+		if (voc_read(vs, buf, l) != l)
+			return 0;
+		count -= l;
+	}
+	return 1;
+}
+
+/* ask for the pages ahead of the parser before the PCM needs them */
+static void voc_ahead(struct voc_stream *vs)
+{
+	size_t start, end;
+
+	if (vs->pos + VOC_AHEAD / 2 < vs->ahead)
+		return;
+	start = vs->ahead > vs->pos ? vs->ahead : vs->pos;
+	start &= ~(vs->page - 1);
+	end = vs->pos + VOC_AHEAD;
+	if (end > vs->size)
+		end = vs->size;
+	if (end > start)
+		madvise(vs->map + start, end - start, MADV_WILLNEED);
+	vs->ahead = end;
+}
+
+/*
+ * queue count bytes of sample data, whole chunks are written from data
+ * without a copy; with advance = 0 the same bytes are repeated
+ */
+static void voc_pcm_write(u_char *data, size_t count, int advance)
+{
+	size_t size;
+
+	while (count > 0) {
+		if (buffer_pos == 0 && count >= chunk_bytes) {
+			if ((size_t)pcm_write(data, chunk_size) != chunk_size) {
+				error(_("write error"));
+				prg_exit(EXIT_FAILURE);
+			}
+			size = chunk_bytes;
+		} else {
+			size = chunk_bytes - buffer_pos;
+			if (size > count)
+				size = count;
+			memcpy(audiobuf + buffer_pos, data, size);
+			buffer_pos += size;
+			if ((size_t)buffer_pos == chunk_bytes) {
+				if ((size_t)pcm_write(audiobuf, chunk_size) != chunk_size) {
+					error(_("write error"));
+					prg_exit(EXIT_FAILURE);
+				}
+				buffer_pos = 0;
+			}
+		}
+		if (advance)
+			data += size;
+		count -= size;
+	}
+}
+
+/* play count bytes of sample data, returns 0 if the file is truncated */
+static int voc_data(struct voc_stream *vs, size_t count)
+{
+	size_t size;
+	ssize_t r;
+
+	if (vs->map) {
+		int whole = count <= vs->size - vs->pos;
+
+		if (!whole)
+			count = vs->size - vs->pos;
+		while (count > 0) {
+			voc_ahead(vs);
+			size = count > VOC_AHEAD / 2 ? VOC_AHEAD / 2 : count;
+			voc_pcm_write(vs->map + vs->pos, size, 1);
+			vs->pos += size;
+			count -= size;
+		}
+		return whole;
+	}
+	while (count > 0) {
+		size = chunk_bytes - buffer_pos;
+		if (size > count)
+			size = count;
+		r = safe_read(vs->fd, audiobuf + buffer_pos, size);
+		if (r < 0) {
+			perror(vs->name);
 			prg_exit(EXIT_FAILURE);
 		}
-		ofs -= chunk_bytes;
+		vs->offset += r;
+		buffer_pos += r;
+		if ((size_t)r < size)
+			return 0;
+		if ((size_t)buffer_pos == chunk_bytes) {
+			if ((size_t)pcm_write(audiobuf, chunk_size) != chunk_size) {
+				error(_("write error"));
+				prg_exit(EXIT_FAILURE);
+			}
+			buffer_pos = 0;
+		}
+		count -= size;
 	}
-	if (ofs) {
-		if (safe_read(fd, buf, ofs) != ofs) {
-			error(_("read error"));
+	return 1;
+}
+
+/* ASCII text, we copy it to stderr */
+static int voc_text(struct voc_stream *vs, size_t count)
+{
+	u_char buf[256];
+	size_t l;
+
+	if (quiet_mode)
+		return voc_skip(vs, count);
+	while (count > 0) {
+		l = count > sizeof(buf) ? sizeof(buf) : count;
+		if (voc_read(vs, buf, l) != l)
+			return 0;
+		if (write(2, buf, l) != (ssize_t)l) {
+			error(_("write error"));
 			prg_exit(EXIT_FAILURE);
 		}
+		count -= l;
+	}
+	fprintf(stderr, "\n");
+	return 1;
+}
+
+static void voc_pcm_flush(void)
+{
+	if (buffer_pos > 0) {
+		size_t b;
+		if (snd_pcm_format_set_silence(hwparams.format, audiobuf + buffer_pos, (chunk_bytes - buffer_pos) * 8 / bits_per_sample) < 0)
+			fprintf(stderr, _("voc_pcm_flush - silence error"));
+		b = chunk_size;
+		if (pcm_write(audiobuf, b) != (ssize_t)b)
+			error(_("voc_pcm_flush error"));
+		buffer_pos = 0;
+	}
+	resampler_drain();
+	snd_pcm_nonblock(handle, 0);
+	snd_pcm_drain(handle);
+	snd_pcm_nonblock(handle, nonblock);
+}
+
+/*
+ * set up the PCM for the rate and channels of a block; blocks with the
+ * current setup leave the running stream alone
+ */
+static void voc_set_params(struct voc_stream *vs)
+{
+	snd_pcm_state_t state;
+
+	if (hwparams.rate == vs->rate && hwparams.channels == vs->channels)
+		return;
+	vs->rate = hwparams.rate;
+	vs->channels = hwparams.channels;
+	/* play out what is queued, also below the start threshold */
+	state = snd_pcm_state(handle);
+	if (buffer_pos > 0 ||
+	    (state != SND_PCM_STATE_OPEN && state != SND_PCM_STATE_SETUP))
+		voc_pcm_flush();
+	set_params();
+	free(vs->silence);
+	vs->silence = malloc(chunk_bytes);
+	if (vs->silence == NULL) {
+		error(_("can't allocate buffer for silence"));
+		prg_exit(EXIT_FAILURE);
+	}
+	snd_pcm_format_set_silence(hwparams.format, vs->silence, chunk_size * hwparams.channels);
+}
+
+static void voc_play(int fd, int ofs, char *name)
+{
+	struct voc_stream vs;
+	VocBlockType block, *bp = &block;
+	VocVoiceData vd;
+	VocExtBlock eb;
+	u_char sb[3];
+	size_t len;
+	off64_t loop = 0;
+	u_short repeat = 0;
+	char was_extended = 0;
+
+	if (!quiet_mode) {
+		fprintf(stderr, _("Playing Creative Labs Channel file '%s'...\n"), name);
 	}
+	voc_open(&vs, fd, ofs, name);
+	buffer_pos = 0;
 	hwparams.format = DEFAULT_FORMAT;
 	hwparams.channels = 1;
 	hwparams.rate = DEFAULT_SPEED;
-	set_params();
+	voc_set_params(&vs);
 
-	in_buffer = nextblock = 0;
-	while (1) {
-	      Fill_the_buffer:	/* need this for repeat */
-		if (in_buffer < 32) {
-			/* move the rest of buffer to pos 0 and fill the buf up */
-			if (in_buffer)
-				memcpy(buf, data, in_buffer);
-			data = buf;
-			if ((l = safe_read(fd, buf + in_buffer, chunk_bytes - in_buffer)) > 0)
-				in_buffer += l;
-			else if (!in_buffer) {
-				/* the file is truncated, so simulate 'Terminator' 
-				   and reduce the datablock for safe landing */
-				nextblock = buf[0] = 0;
-				if (l == -1) {
-					perror(name);
-					prg_exit(EXIT_FAILURE);
-				}
+	/* a truncated file ends like a 'Terminator' */
+	while (voc_read(&vs, bp, sizeof(*bp)) == sizeof(*bp)) {
+		len = VOC_DATALEN(bp);
+		switch (bp->type) {
+		case 0:	/* VOC-file stop */
+			goto __end;
+		case 1:
+			if (len < sizeof(vd) || voc_read(&vs, &vd, sizeof(vd)) != sizeof(vd))
+				goto __end;
+			len -= sizeof(vd);
+			if (vd.pack) {		/* /dev/dsp can't it */
+				error(_("can't play packed .voc files"));
+				goto __end;
 			}
-		}
-		while (!nextblock) {	/* this is a new block */
-			if (in_buffer < sizeof(VocBlockType))
+			/* an extended block before sets the speed and stereo mode */
+			if (!was_extended) {
+				hwparams.rate = 1000000 / (256 - vd.tc);
+				hwparams.channels = 1;
+			}
+			was_extended = 0;
+			voc_set_params(&vs);
+			if (!voc_data(&vs, len))
+				goto __end;
+			break;
+		case 2:	/* nothing to do, pure data */
+			if (!voc_data(&vs, len))
+				goto __end;
+			break;
+		case 3:	/* a silence block, no data, only a count */
+			if (len < sizeof(sb) || voc_read(&vs, sb, sizeof(sb)) != sizeof(sb))
+				goto __end;
+			hwparams.rate = 1000000 / (256 - sb[2]);
+			voc_set_params(&vs);
+			voc_pcm_write(vs.silence, ((size_t)(sb[0] | (sb[1] << 8)) + 1) *
+				      bits_per_frame / 8, 0);
+			if (!voc_skip(&vs, len - sizeof(sb)))
+				goto __end;
+			break;
+		case 4:	/* a marker for syncronisation, no effect */
+			if (!voc_skip(&vs, len))
+				goto __end;
+			break;
+		case 5:	/* ASCII text, we copy to stderr */
+			if (!voc_text(&vs, len))
+				goto __end;
+			break;
+		case 6:	/* repeat marker, says repeatcount */
+			/* my specs don't say it: maybe this can be recursive, but
+			   I don't think somebody use it */
+			if (len < 2 || voc_read(&vs, sb, 2) != 2 ||
+			    !voc_skip(&vs, len - 2))
+				goto __end;
+			repeat = sb[0] | (sb[1] << 8);
+			if (!vs.map && !vs.seekable) {
+				error(_("can't play loops; %s isn't seekable\n"), name);
+				repeat = 0;
+			}
+			loop = voc_tell(&vs);
+			break;
+		case 7:	/* ok, lets repeat that be rewinding tape */
+			if (!voc_skip(&vs, len))
+				goto __end;
+			if (repeat) {
+				if (repeat != 0xFFFF)
+					--repeat;
+				voc_seek(&vs, loop);
+			}
+			break;
+		case 8:	/* the extension to play Stereo, I have SB 1.0 :-( */
+			if (len < sizeof(eb) || voc_read(&vs, &eb, sizeof(eb)) != sizeof(eb) ||
+			    !voc_skip(&vs, len - sizeof(eb)))
+				goto __end;
+			if (eb.pack) {		/* /dev/dsp can't it */
+				error(_("can't play packed .voc files"));
 				goto __end;
-			bp = (VocBlockType *) data;
-			COUNT1(sizeof(VocBlockType));
-			nextblock = VOC_DATALEN(bp);
-			if (output && !quiet_mode)
-				fprintf(stderr, "\n");	/* write /n after ASCII-out */
-			output = 0;
-			switch (bp->type) {
-			case 0:
-#if 0
-				d_printf("Terminator\n");
-#endif
-				return;		/* VOC-file stop */
-			case 1:
-				vd = (VocVoiceData *) data;
-				COUNT1(sizeof(VocVoiceData));
-				/* we need a SYNC, before we can set new SPEED, STEREO ... */
-
-				if (!was_extended) {
-					hwparams.rate = (int) (vd->tc);
-					hwparams.rate = 1000000 / (256 - hwparams.rate);
-#if 0
-					d_printf("Channel data %d Hz\n", dsp_speed);
-#endif
-					if (vd->pack) {		/* /dev/dsp can't it */
-						error(_("can't play packed .voc files"));
-						return;
-					}
-					if (hwparams.channels == 2)		/* if we are in Stereo-Mode, switch back */
-						hwparams.channels = 1;
-				} else {	/* there was extended block */
-					hwparams.channels = 2;
-					was_extended = 0;
-				}
-				set_params();
-				break;
-			case 2:	/* nothing to do, pure data */
-#if 0
-				d_printf("Channel continuation\n");
-#endif
-				break;
-			case 3:	/* a silence block, no data, only a count */
-				sp = (u_short *) data;
-				COUNT1(sizeof(u_short));
-				hwparams.rate = (int) (*data);
-				COUNT1(1);
-				hwparams.rate = 1000000 / (256 - hwparams.rate);
-				set_params();
-				silence = (((size_t) * sp) * 1000) / hwparams.rate;
-#if 0
-				d_printf("Silence for %d ms\n", (int) silence);
-#endif
-				voc_write_silence(*sp);
-				break;
-			case 4:	/* a marker for syncronisation, no effect */
-				sp = (u_short *) data;
-				COUNT1(sizeof(u_short));
-#if 0
-				d_printf("Marker %d\n", *sp);
-#endif
-				break;
-			case 5:	/* ASCII text, we copy to stderr */
-				output = 1;
-#if 0
-				d_printf("ASCII - text :\n");
-#endif
-				break;
-			case 6:	/* repeat marker, says repeatcount */
-				/* my specs don't say it: maybe this can be recursive, but
-				   I don't think somebody use it */
-				repeat = *(u_short *) data;
-				COUNT1(sizeof(u_short));
-#if 0
-				d_printf("Repeat loop %d times\n", repeat);
-#endif
-				if (filepos >= 0) {	/* if < 0, one seek fails, why test another */
-					if ((filepos = lseek64(fd, 0, 1)) < 0) {
-						error(_("can't play loops; %s isn't seekable\n"), name);
-						repeat = 0;
-					} else {
-						filepos -= in_buffer;	/* set filepos after repeat */
-					}
-				} else {
-					repeat = 0;
-				}
-				break;
-			case 7:	/* ok, lets repeat that be rewinding tape */
-				if (repeat) {
-					if (repeat != 0xFFFF) {
-#if 0
-						d_printf("Repeat loop %d\n", repeat);
-#endif
-						--repeat;
-					}
-#if 0
-					else
-						d_printf("Neverending loop\n");
-#endif
-					lseek64(fd, filepos, 0);
-					in_buffer = 0;	/* clear the buffer */
-					goto Fill_the_buffer;
-				}
-#if 0
-				else
-					d_printf("End repeat loop\n");
-#endif
-				break;
-			case 8:	/* the extension to play Stereo, I have SB 1.0 :-( */
-				was_extended = 1;
-				eb = (VocExtBlock *) data;
-				COUNT1(sizeof(VocExtBlock));
-				hwparams.rate = (int) (eb->tc);
-				hwparams.rate = 256000000L / (65536 - hwparams.rate);
-				hwparams.channels = eb->mode == VOC_MODE_STEREO ? 2 : 1;
-				if (hwparams.channels == 2)
-					hwparams.rate = hwparams.rate >> 1;
-				if (eb->pack) {		/* /dev/dsp can't it */
-					error(_("can't play packed .voc files"));
-					return;
-				}
-#if 0
-				d_printf("Extended block %s %d Hz\n",
-					 (eb->mode ? "Stereo" : "Mono"), dsp_speed);
-#endif
-				break;
-			default:
-				error(_("unknown blocktype %d. terminate."), bp->type);
-				return;
-			}	/* switch (bp->type) */
-		}		/* while (! nextblock)  */
-		/* put nextblock data bytes to dsp */
-		l = in_buffer;
-		if (nextblock < (size_t)l)
-			l = nextblock;
-		if (l) {
-			if (output && !quiet_mode) {
-				if (write(2, data, l) != l) {	/* to stderr */
-					error(_("write error"));
-					prg_exit(EXIT_FAILURE);
-				}
-			} else {
-				if (voc_pcm_write(data, l) != l) {
-					error(_("write error"));
-					prg_exit(EXIT_FAILURE);
-				}
 			}
-			COUNT(l);
+			was_extended = 1;
+			hwparams.rate = 256000000L / (65536 - LE_SHORT(eb.tc));
+			hwparams.channels = eb.mode == VOC_MODE_STEREO ? 2 : 1;
+			if (hwparams.channels == 2)
+				hwparams.rate = hwparams.rate >> 1;
+			break;
+		default:
+			error(_("unknown blocktype %d. terminate."), bp->type);
+			goto __end;
 		}
-	}			/* while(1) */
+	}
       __end:
-        voc_pcm_flush();
-        free(buf);
+	voc_pcm_flush();
+	voc_close(&vs);
 }
-/* that was a big one, perhaps somebody split it :-) */
 
 /* setting the globals for playing raw data */
 static void init_raw_data(void)
@@ -2189,19 +4247,13 @@ static void begin_voc(int fd, size_t cnt)
 }
 
 /* write a WAVE-header */
-static void begin_wave(int fd, size_t cnt)
+/* fill the 'fmt ' chunk body for the current parameters */
+static void wave_fmt_body(WaveFmtBody *f)
 {
-	WaveHeader h;
-	WaveFmtBody f;
-	WaveChunkHeader cf, cd;
 	int bits;
 	u_int tmp;
 	u_short tmp2;
 
-	/* WAVE cannot handle greater than 32bit (signed?) int */
-	if (cnt == (size_t)-2)
-		cnt = 0x7fffff00;
-
 	bits = 8;
 	switch ((unsigned long) hwparams.format) {
 	case SND_PCM_FORMAT_U8:
@@ -2222,36 +4274,93 @@ static void begin_wave(int fd, size_t cnt)
 		error(_("Wave doesn't support %s format..."), snd_pcm_format_name(hwparams.format));
 		prg_exit(EXIT_FAILURE);
 	}
-	h.magic = WAV_RIFF;
-	tmp = cnt + sizeof(WaveHeader) + sizeof(WaveChunkHeader) + sizeof(WaveFmtBody) + sizeof(WaveChunkHeader) - 8;
-	h.length = LE_INT(tmp);
-	h.type = WAV_WAVE;
-
-	cf.type = WAV_FMT;
-	cf.length = LE_INT(16);
-
         if (hwparams.format == SND_PCM_FORMAT_FLOAT_LE)
-                f.format = LE_SHORT(WAV_FMT_IEEE_FLOAT);
+                f->format = LE_SHORT(WAV_FMT_IEEE_FLOAT);
         else
-                f.format = LE_SHORT(WAV_FMT_PCM);
-	f.channels = LE_SHORT(hwparams.channels);
-	f.sample_fq = LE_INT(hwparams.rate);
+                f->format = LE_SHORT(WAV_FMT_PCM);
+	f->channels = LE_SHORT(hwparams.channels);
+	f->sample_fq = LE_INT(hwparams.rate);
 #if 0
 	tmp2 = (samplesize == 8) ? 1 : 2;
-	f.byte_p_spl = LE_SHORT(tmp2);
+	f->byte_p_spl = LE_SHORT(tmp2);
 	tmp = dsp_speed * hwparams.channels * (u_int) tmp2;
 #else
 	tmp2 = hwparams.channels * snd_pcm_format_physical_width(hwparams.format) / 8;
-	f.byte_p_spl = LE_SHORT(tmp2);
+	f->byte_p_spl = LE_SHORT(tmp2);
 	tmp = (u_int) tmp2 * hwparams.rate;
 #endif
-	f.byte_p_sec = LE_INT(tmp);
-	f.bit_p_spl = LE_SHORT(bits);
+	f->byte_p_sec = LE_INT(tmp);
+	f->bit_p_spl = LE_SHORT(bits);
+}
+
+static void begin_wave(int fd, size_t cnt)
+{
+	WaveHeader h;
+	WaveFmtBody f;
+	WaveChunkHeader cf, cd;
+	u_int tmp;
+
+	/* WAVE cannot handle greater than 32bit (signed?) int */
+	if (cnt == (size_t)-2)
+		cnt = 0x7fffff00;
+
+	wave_fmt_body(&f);
+	h.magic = WAV_RIFF;
+	tmp = cnt + sizeof(WaveHeader) + sizeof(WaveChunkHeader) + sizeof(WaveFmtBody) + sizeof(WaveChunkHeader) - 8;
+	h.length = LE_INT(tmp);
+	h.type = WAV_WAVE;
+
+	cf.type = WAV_FMT;
+	cf.length = LE_INT(16);
+
+	cd.type = WAV_DATA;
+	cd.length = LE_INT(cnt);
+
+	if (write(fd, &h, sizeof(WaveHeader)) != sizeof(WaveHeader) ||
+	    write(fd, &cf, sizeof(WaveChunkHeader)) != sizeof(WaveChunkHeader) ||
+	    write(fd, &f, sizeof(WaveFmtBody)) != sizeof(WaveFmtBody) ||
+	    write(fd, &cd, sizeof(WaveChunkHeader)) != sizeof(WaveChunkHeader)) {
+		error(_("write error"));
+		prg_exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * write a RF64-header
+ *
+ * The file starts as a plain WAVE with a 'JUNK' chunk reserving the space
+ * of the 'ds64' chunk, so a file that stays below 2GB remains readable by
+ * any WAVE reader.  end_rf64() turns it into RF64 only when it is bigger.
+ */
+static void begin_rf64(int fd, size_t cnt)
+{
+	WaveHeader h;
+	WaveFmtBody f;
+	WaveChunkHeader cj, cf, cd;
+	WaveDs64Body ds;
+
+	if (cnt > 0x7fffff00)
+		cnt = 0x7fffff00;
+
+	wave_fmt_body(&f);
+	h.magic = WAV_RIFF;
+	h.length = LE_INT(cnt + sizeof(WaveHeader) + 3 * sizeof(WaveChunkHeader) +
+			  sizeof(WaveDs64Body) + sizeof(WaveFmtBody) - 8);
+	h.type = WAV_WAVE;
+
+	cj.type = WAV_JUNK;
+	cj.length = LE_INT(sizeof(WaveDs64Body));
+	memset(&ds, 0, sizeof(ds));
+
+	cf.type = WAV_FMT;
+	cf.length = LE_INT(16);
 
 	cd.type = WAV_DATA;
 	cd.length = LE_INT(cnt);
 
 	if (write(fd, &h, sizeof(WaveHeader)) != sizeof(WaveHeader) ||
+	    write(fd, &cj, sizeof(WaveChunkHeader)) != sizeof(WaveChunkHeader) ||
+	    write(fd, &ds, sizeof(WaveDs64Body)) != sizeof(WaveDs64Body) ||
 	    write(fd, &cf, sizeof(WaveChunkHeader)) != sizeof(WaveChunkHeader) ||
 	    write(fd, &f, sizeof(WaveFmtBody)) != sizeof(WaveFmtBody) ||
 	    write(fd, &cd, sizeof(WaveChunkHeader)) != sizeof(WaveChunkHeader)) {
@@ -2260,6 +4369,34 @@ static void begin_wave(int fd, size_t cnt)
 	}
 }
 
+/* write a Sony Wave64-header */
+static void begin_w64(int fd, size_t cnt)
+{
+	W64Header h;
+	W64ChunkHeader cf, cd;
+	WaveFmtBody f;
+
+	wave_fmt_body(&f);
+	memcpy(h.guid, W64_GUID_RIFF, 16);
+	h.length = LE_LONG((u_int64_t)cnt + sizeof(W64Header) +
+			   2 * sizeof(W64ChunkHeader) + sizeof(WaveFmtBody));
+	memcpy(h.type, W64_GUID_WAVE, 16);
+
+	memcpy(cf.guid, W64_GUID_FMT, 16);
+	cf.length = LE_LONG((u_int64_t)sizeof(W64ChunkHeader) + sizeof(WaveFmtBody));
+
+	memcpy(cd.guid, W64_GUID_DATA, 16);
+	cd.length = LE_LONG((u_int64_t)sizeof(W64ChunkHeader) + cnt);
+
+	if (write(fd, &h, sizeof(W64Header)) != sizeof(W64Header) ||
+	    write(fd, &cf, sizeof(W64ChunkHeader)) != sizeof(W64ChunkHeader) ||
+	    write(fd, &f, sizeof(WaveFmtBody)) != sizeof(WaveFmtBody) ||
+	    write(fd, &cd, sizeof(W64ChunkHeader)) != sizeof(W64ChunkHeader)) {
+		error(_("write error"));
+		prg_exit(EXIT_FAILURE);
+	}
+}
+
 /* write a Au-header */
 static void begin_au(int fd, size_t cnt)
 {
@@ -2291,7 +4428,7 @@ static void begin_au(int fd, size_t cnt)
 }
 
 /* closing .VOC */
-static void end_voc(int fd)
+static void end_voc(int fd, off64_t count)
 {
 	off64_t length_seek;
 	VocBlockType bt;
@@ -2306,7 +4443,7 @@ static void end_voc(int fd)
 	if (hwparams.channels > 1)
 		length_seek += sizeof(VocBlockType) + sizeof(VocExtBlock);
 	bt.type = 1;
-	cnt = fdcount;
+	cnt = count;
 	cnt += sizeof(VocVoiceData);	/* Channel_data block follows */
 	if (cnt > 0x00ffffff)
 		cnt = 0x00ffffff;
@@ -2315,43 +4452,98 @@ static void end_voc(int fd)
 	bt.datalen_h = (u_char) ((cnt & 0xFF0000) >> 16);
 	if (lseek64(fd, length_seek, SEEK_SET) == length_seek)
 		write(fd, &bt, sizeof(VocBlockType));
-	if (fd != 1)
-		close(fd);
 }
 
-static void end_wave(int fd)
-{				/* only close output */
+/* update the RIFF and 'data' chunk lengths */
+static void end_wave_sizes(int fd, off64_t length_seek, off64_t filelen, off64_t count)
+{
 	WaveChunkHeader cd;
-	off64_t length_seek;
-	off64_t filelen;
 	u_int rifflen;
-	
-	length_seek = sizeof(WaveHeader) +
-		      sizeof(WaveChunkHeader) +
-		      sizeof(WaveFmtBody);
+
 	cd.type = WAV_DATA;
-	cd.length = fdcount > 0x7fffffff ? LE_INT(0x7fffffff) : LE_INT(fdcount);
-	filelen = fdcount + 2*sizeof(WaveChunkHeader) + sizeof(WaveFmtBody) + 4;
+	cd.length = count > 0x7fffffff ? LE_INT(0x7fffffff) : LE_INT(count);
 	rifflen = filelen > 0x7fffffff ? LE_INT(0x7fffffff) : LE_INT(filelen);
 	if (lseek64(fd, 4, SEEK_SET) == 4)
 		write(fd, &rifflen, 4);
 	if (lseek64(fd, length_seek, SEEK_SET) == length_seek)
 		write(fd, &cd, sizeof(WaveChunkHeader));
-	if (fd != 1)
-		close(fd);
 }
 
-static void end_au(int fd)
-{				/* only close output */
+static void end_wave(int fd, off64_t count)
+{				/* only update the header */
+	off64_t length_seek;
+	off64_t filelen;
+	
+	length_seek = sizeof(WaveHeader) +
+		      sizeof(WaveChunkHeader) +
+		      sizeof(WaveFmtBody);
+	filelen = count + 2*sizeof(WaveChunkHeader) + sizeof(WaveFmtBody) + 4;
+	end_wave_sizes(fd, length_seek, filelen, count);
+}
+
+static void end_rf64(int fd, off64_t count)
+{				/* only update the header */
+	WaveHeader h;
+	WaveChunkHeader cd;
+	WaveDs64Body ds;
+	off64_t data_seek, riff_size, samples;
+
+	data_seek = sizeof(WaveHeader) + 2 * sizeof(WaveChunkHeader) +
+		    sizeof(WaveDs64Body) + sizeof(WaveFmtBody);
+	riff_size = data_seek + sizeof(WaveChunkHeader) + count - 8;
+	if (riff_size <= 0x7fffffff) {
+		/* a plain WAVE file */
+		end_wave_sizes(fd, data_seek, riff_size, count);
+		return;
+	}
+	samples = count / (snd_pcm_format_physical_width(hwparams.format) / 8 *
+			   hwparams.channels);
+	h.magic = WAV_RF64;
+	h.length = LE_INT(0xffffffff);
+	h.type = WAV_WAVE;
+	cd.type = WAV_DS64;
+	cd.length = LE_INT(sizeof(WaveDs64Body));
+	ds.riff_size_low = LE_INT((u_int)riff_size);
+	ds.riff_size_high = LE_INT((u_int)(riff_size >> 32));
+	ds.data_size_low = LE_INT((u_int)count);
+	ds.data_size_high = LE_INT((u_int)(count >> 32));
+	ds.sample_count_low = LE_INT((u_int)samples);
+	ds.sample_count_high = LE_INT((u_int)(samples >> 32));
+	ds.table_length = 0;
+	if (lseek64(fd, 0, SEEK_SET) == 0) {
+		write(fd, &h, sizeof(WaveHeader));
+		write(fd, &cd, sizeof(WaveChunkHeader));
+		write(fd, &ds, sizeof(WaveDs64Body));
+	}
+	cd.type = WAV_DATA;
+	cd.length = LE_INT(0xffffffff);
+	if (lseek64(fd, data_seek, SEEK_SET) == data_seek)
+		write(fd, &cd, sizeof(WaveChunkHeader));
+}
+
+static void end_w64(int fd, off64_t count)
+{				/* only update the header */
+	u_int64_t length;
+	off64_t data_seek;
+
+	data_seek = sizeof(W64Header) + sizeof(W64ChunkHeader) + sizeof(WaveFmtBody);
+	length = LE_LONG((u_int64_t)data_seek + sizeof(W64ChunkHeader) + count);
+	if (lseek64(fd, 16, SEEK_SET) == 16)
+		write(fd, &length, sizeof(length));
+	length = LE_LONG((u_int64_t)sizeof(W64ChunkHeader) + count);
+	if (lseek64(fd, data_seek + 16, SEEK_SET) == data_seek + 16)
+		write(fd, &length, sizeof(length));
+}
+
+static void end_au(int fd, off64_t count)
+{				/* only update the header */
 	AuHeader ah;
 	off64_t length_seek;
 	
 	length_seek = (char *)&ah.data_size - (char *)&ah;
-	ah.data_size = fdcount > 0xffffffff ? 0xffffffff : BE_INT(fdcount);
+	ah.data_size = count > 0xffffffff ? 0xffffffff : BE_INT(count);
 	if (lseek64(fd, length_seek, SEEK_SET) == length_seek)
 		write(fd, &ah.data_size, sizeof(ah.data_size));
-	if (fd != 1)
-		close(fd);
 }
 
 static void header(int rtype, char *name)
@@ -2375,6 +4567,582 @@ static void header(int rtype, char *name)
 	}
 }
 
+/*
+ * asynchronous playback reader
+ *
+ * A reader thread keeps up to read_ahead chunks queued in a ring, so a
+ * slow read (page cache miss, network file system) does not eat into
+ * the period deadline.  For separate channels (-I) each slot holds one
+ * segment per channel file.  The reader marks the end of the stream with
+ * an empty slot (or a negative length on error).
+ */
+
+static struct playback_reader {
+	pthread_t thread;
+	sem_t filled;			/* slots ready for the PCM */
+	sem_t empty;			/* slots free for the reader */
+	u_char *buf;
+	ssize_t *len;			/* bytes (per channel for -I) in each slot */
+	unsigned int slots;
+	unsigned int head;		/* reader thread only */
+	unsigned int tail;		/* playback thread only */
+	int *fds;
+	unsigned int nfds;
+	off64_t count;			/* bytes left to read (all files) */
+	size_t first;			/* bytes already in the first slot */
+	int err;
+	unsigned int err_fd;
+	int quit;
+	unsigned int starved;		/* PCM waited for the reader */
+} playback_reader;
+
+static ssize_t playback_reader_fill(struct playback_reader *r, u_char *slot)
+{
+	size_t vsize, expected;
+	ssize_t l;
+	unsigned int i;
+
+	if (r->nfds == 1) {
+		expected = chunk_bytes - r->first;
+		if ((off64_t)expected > r->count)
+			expected = r->count;
+		l = expected ? safe_read(r->fds[0], slot + r->first, expected) : 0;
+		if (l < 0) {
+			r->err = errno;
+			r->err_fd = 0;
+			return -1;
+		}
+		r->count -= l;
+		l += r->first;
+		r->first = 0;
+		return l;
+	}
+	vsize = chunk_bytes / r->nfds;
+	expected = r->count / r->nfds;
+	if (expected > vsize)
+		expected = vsize;
+	l = safe_read(r->fds[0], slot, expected);
+	if (l < 0) {
+		r->err = errno;
+		r->err_fd = 0;
+		return -1;
+	}
+	for (i = 1; i < r->nfds; i++) {
+		if (safe_read(r->fds[i], slot + vsize * i, l) != l) {
+			r->err = errno;
+			r->err_fd = i;
+			return -1;
+		}
+	}
+	r->count -= l * r->nfds;
+	return l;
+}
+
+static void *playback_reader_thread(void *arg)
+{
+	struct playback_reader *r = arg;
+	unsigned int slot;
+	ssize_t l;
+
+	do {
+		while (sem_wait(&r->empty) < 0 && errno == EINTR)
+			;
+		if (__atomic_load_n(&r->quit, __ATOMIC_ACQUIRE))
+			break;
+		slot = r->head % r->slots;
+		l = playback_reader_fill(r, r->buf + slot * chunk_bytes);
+		r->len[slot] = l;
+		r->head++;
+		sem_post(&r->filled);
+	} while (l > 0);
+	return NULL;
+}
+
+static void playback_reader_start(int *fds, unsigned int nfds, off64_t count,
+				  size_t loaded)
+{
+	struct playback_reader *r = &playback_reader;
+	sigset_t all, old;
+	int err;
+
+	memset(r, 0, sizeof(*r));
+	r->slots = read_ahead < 2 ? 2 : read_ahead;
+	r->buf = malloc((size_t)r->slots * chunk_bytes);
+	r->len = malloc(r->slots * sizeof(*r->len));
+	if (r->buf == NULL || r->len == NULL) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	r->fds = fds;
+	r->nfds = nfds;
+	/* the rest of the header read completes the first chunk */
+	if ((off64_t)loaded > count)
+		loaded = count;
+	memcpy(r->buf, audiobuf, loaded);
+	r->first = loaded;
+	r->count = count - loaded;
+	sem_init(&r->filled, 0, 0);
+	sem_init(&r->empty, 0, r->slots);
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	err = pthread_create(&r->thread, NULL, playback_reader_thread, r);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		error(_("unable to create reader thread: %s"), strerror(err));
+		prg_exit(EXIT_FAILURE);
+	}
+}
+
+/* returns the length of the next queued chunk, 0 at the end of file */
+static ssize_t playback_reader_get(u_char **data, char **names)
+{
+	struct playback_reader *r = &playback_reader;
+	unsigned int slot;
+
+	if (sem_trywait(&r->filled) < 0) {
+		r->starved++;
+		while (sem_wait(&r->filled) < 0 && errno == EINTR)
+			;
+	}
+	slot = r->tail % r->slots;
+	if (r->len[slot] < 0) {
+		errno = r->err;
+		perror(names[r->err_fd]);
+		prg_exit(EXIT_FAILURE);
+	}
+	*data = r->buf + slot * chunk_bytes;
+	return r->len[slot];
+}
+
+static void playback_reader_put(void)
+{
+	struct playback_reader *r = &playback_reader;
+
+	r->tail++;
+	sem_post(&r->empty);
+}
+
+static void playback_reader_stop(void)
+{
+	struct playback_reader *r = &playback_reader;
+
+	__atomic_store_n(&r->quit, 1, __ATOMIC_RELEASE);
+	sem_post(&r->empty);
+	pthread_join(r->thread, NULL);
+	sem_destroy(&r->filled);
+	sem_destroy(&r->empty);
+	if (verbose)
+		fprintf(stderr, _("Reader: %u slots, PCM waited for data %u times\n"),
+			r->slots, r->starved);
+	free(r->buf);
+	free(r->len);
+	r->buf = NULL;
+	r->len = NULL;
+}
+
+static void playback_go_async(int fd, size_t loaded, off64_t count, char *name)
+{
+	u_char *data;
+	ssize_t r;
+	int l;
+
+	playback_reader_start(&fd, 1, count, loaded);
+	while ((r = playback_reader_get(&data, &name)) > 0) {
+		fdcount += r;
+		l = r * 8 / bits_per_frame;
+		if (pcm_write(data, l) != l)
+			break;
+		playback_reader_put();
+	}
+	playback_reader_stop();
+	resampler_drain();
+	snd_pcm_nonblock(handle, 0);
+	snd_pcm_drain(handle);
+	snd_pcm_nonblock(handle, nonblock);
+}
+
+/*
+ * direct mmap playback: the file is read straight into the ring buffer
+ * areas, so the data is not bounced through audiobuf
+ */
+
+static int mmap_direct_check(void)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, size = chunk_size;
+	unsigned int channel;
+	int err, ok = 1;
+
+	err = snd_pcm_mmap_begin(handle, &areas, &offset, &size);
+	if (err < 0) {
+		error(_("snd_pcm_mmap_begin problem: %s"), snd_strerror(err));
+		prg_exit(EXIT_FAILURE);
+	}
+	/* only plain interleaved areas can be filled by one read() */
+	if (areas[0].first % 8)
+		ok = 0;
+	for (channel = 0; channel < hwparams.channels; channel++) {
+		if (areas[channel].addr != areas[0].addr ||
+		    areas[channel].step != bits_per_frame ||
+		    areas[channel].first != areas[0].first + channel * bits_per_sample)
+			ok = 0;
+	}
+	snd_pcm_mmap_commit(handle, offset, 0);
+	if (!ok && !quiet_mode)
+		fprintf(stderr, _("Warning: ring buffer layout does not allow direct mmap transfers\n"));
+	return ok;
+}
+
+static void mmap_direct_error(int err)
+{
+	if (err == -EPIPE) {
+		xrun();
+	} else if (err == -ESTRPIPE) {
+		suspend();
+	} else {
+		error(_("mmap write error: %s"), snd_strerror(err));
+		prg_exit(EXIT_FAILURE);
+	}
+}
+
+/* snd_pcm_mmap_commit() does not trigger the stream, do it like writei */
+static void mmap_direct_start(void)
+{
+	snd_pcm_sframes_t avail;
+	int err;
+
+	if (snd_pcm_state(handle) != SND_PCM_STATE_PREPARED)
+		return;
+	avail = snd_pcm_avail_update(handle);
+	if (avail < 0 ||
+	    buffer_frames - (snd_pcm_uframes_t)avail < start_threshold_frames)
+		return;
+	err = snd_pcm_start(handle);
+	if (err < 0)
+		mmap_direct_error(err);
+}
+
+/*
+ * give back the last k of the len bytes placed at ptr, they are played
+ * from audiobuf at the next step
+ */
+static void mmap_direct_carry(u_char *ptr, size_t len, size_t k,
+			      size_t *pos, size_t *loaded)
+{
+	if (k == 0)
+		return;
+	if (*loaded > 0) {
+		/* nothing was read, the bytes are still in audiobuf */
+		*pos -= k;
+	} else {
+		memcpy(audiobuf, ptr + len - k, k);
+		*pos = 0;
+	}
+	*loaded += k;
+}
+
+static void playback_go_mmap(int fd, size_t loaded, off64_t count, char *name)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames;
+	snd_pcm_sframes_t avail, r;
+	size_t c, n, pos = 0;
+	ssize_t l;
+	off64_t written = 0;
+	u_char *ptr;
+	int err;
+
+	while (written < count) {
+		if (test_position)
+			do_test_position();
+		if (!stdin_polled())
+			check_stdin();
+		avail = snd_pcm_avail_update(handle);
+		if (avail < 0) {
+			mmap_direct_error(avail);
+			continue;
+		}
+		if ((snd_pcm_uframes_t)avail < chunk_size) {
+			mmap_direct_start();
+			pcm_wait();
+			continue;
+		}
+		frames = chunk_size;
+		err = snd_pcm_mmap_begin(handle, &areas, &offset, &frames);
+		if (err < 0) {
+			mmap_direct_error(err);
+			continue;
+		}
+		ptr = (u_char *)areas[0].addr + areas[0].first / 8 +
+		      offset * bits_per_frame / 8;
+		c = frames * bits_per_frame / 8;
+		if ((off64_t)c > count - written)
+			c = count - written;
+		/* the rest of the header read is still in audiobuf */
+		n = 0;
+		if (loaded > 0) {
+			n = c < loaded ? c : loaded;
+			memcpy(ptr, audiobuf + pos, n);
+			pos += n;
+			loaded -= n;
+		}
+		l = 0;
+		if (n < c) {
+			l = safe_read(fd, ptr + n, c - n);
+			if (l < 0) {
+				perror(name);
+				prg_exit(EXIT_FAILURE);
+			}
+			fdcount += l;
+		}
+		frames = (n + l) * 8 / bits_per_frame;
+		if ((vumeter || meter_file) && frames > 0)
+			compute_max_peak(ptr, frames * hwparams.channels);
+		r = snd_pcm_mmap_commit(handle, offset, frames);
+		if (test_position)
+			do_test_position();
+		if (r < 0 || (snd_pcm_uframes_t)r != frames) {
+			/* keep the data read for the retry after the recovery */
+			mmap_direct_carry(ptr, n + l, n + l, &pos, &loaded);
+			mmap_direct_error(r < 0 ? r : -EPIPE);
+			continue;
+		}
+		written += frames * bits_per_frame / 8;
+		if (n + l < c)
+			break;		/* end of file */
+		/* a partial frame goes to the next chunk */
+		mmap_direct_carry(ptr, n + l, n + l - frames * bits_per_frame / 8,
+				  &pos, &loaded);
+		mmap_direct_start();
+	}
+	snd_pcm_nonblock(handle, 0);
+	snd_pcm_drain(handle);
+	snd_pcm_nonblock(handle, nonblock);
+}
+
+/*
+ * direct mmap capture: the data are written from the ring buffer areas
+ *
+ * When the output is a pipe, the ring buffer pages are handed to the
+ * pipe with vmsplice() instead of being copied.  The pipe references the
+ * pages, so the captured frames are committed back to the device only
+ * after the reader has consumed them (FIONREAD).  At most a half of the
+ * ring buffer is held this way.  The plain write() from the ring buffer
+ * is used when vmsplice() cannot map the areas (e.g. device memory).
+ */
+
+static struct {
+	int active;
+	unsigned long long queued;	/* bytes queued to the pipe */
+	unsigned long long base;	/* queued position of the first held frame */
+	snd_pcm_uframes_t held;		/* frames spliced, not committed yet */
+} capture_splice;
+
+static void capture_splice_init(int fd)
+{
+	struct stat st;
+	int pending = 0;
+
+	capture_splice.active = 0;
+	capture_splice.held = 0;
+	if (fstat(fd, &st) < 0 || !S_ISFIFO(st.st_mode) ||
+	    ioctl(fd, FIONREAD, &pending) < 0)
+		return;
+	/* do not let the pipe hold more than the spliced part of the ring */
+	fcntl(fd, F_SETPIPE_SZ, (int)(buffer_frames / 2 * bits_per_frame / 8));
+	capture_splice.queued = pending;
+	capture_splice.base = pending;
+	capture_splice.active = 1;
+}
+
+/* commit the held frames the reader has consumed, returns -errno */
+static int capture_splice_release(int fd)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames, consumed;
+	snd_pcm_sframes_t r;
+	size_t frame_bytes = bits_per_frame / 8;
+	int pending, err;
+
+	if (!capture_splice.held)
+		return 0;
+	if (ioctl(fd, FIONREAD, &pending) < 0)
+		return -errno;
+	consumed = (capture_splice.queued - pending - capture_splice.base) /
+		   frame_bytes;
+	if (consumed > capture_splice.held)
+		consumed = capture_splice.held;
+	while (consumed > 0) {
+		frames = consumed;
+		err = snd_pcm_mmap_begin(handle, &areas, &offset, &frames);
+		if (err < 0)
+			return err;
+		r = snd_pcm_mmap_commit(handle, offset, frames);
+		if (r < 0 || (snd_pcm_uframes_t)r != frames)
+			return r < 0 ? r : -EPIPE;
+		capture_splice.held -= frames;
+		capture_splice.base += frames * frame_bytes;
+		consumed -= frames;
+	}
+	return 0;
+}
+
+/* wait until the pipe does not reference the ring buffer anymore */
+static void capture_splice_sync(int fd)
+{
+	int pending;
+
+	if (!capture_splice.active)
+		return;
+	while (ioctl(fd, FIONREAD, &pending) == 0 && pending > 0)
+		usleep(1000);
+	/* the reader has consumed all held frames, fails after an xrun */
+	capture_splice_release(fd);
+	capture_splice.held = 0;
+	capture_splice.base = capture_splice.queued;
+}
+
+static int capture_direct_error(int fd, int err)
+{
+	/* the queued data must be read before the ring is reused */
+	capture_splice_sync(fd);
+	if (err == -EPIPE) {
+		xrun();
+	} else if (err == -ESTRPIPE) {
+		suspend();
+	} else {
+		error(_("mmap read error: %s"), snd_strerror(err));
+		prg_exit(EXIT_FAILURE);
+	}
+	return 0;
+}
+
+/* hand frames from the ring to the pipe, returns the spliced frames */
+static ssize_t capture_splice_frames(int fd, u_char *ptr, snd_pcm_uframes_t frames)
+{
+	struct iovec iov;
+	size_t bytes = frames * bits_per_frame / 8;
+	ssize_t r;
+
+	iov.iov_base = ptr;
+	iov.iov_len = bytes;
+	while (iov.iov_len > 0) {
+		r = vmsplice(fd, &iov, 1, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && iov.iov_len == bytes &&
+		    (errno == EFAULT || errno == EINVAL || errno == ENOSYS)) {
+			/* the areas cannot be spliced, use write() */
+			if (verbose)
+				fprintf(stderr, _("vmsplice not possible (%s), writing from the ring buffer\n"),
+					strerror(errno));
+			capture_splice_sync(fd);
+			capture_splice.active = 0;
+			return 0;
+		}
+		if (r < 0)
+			return -1;
+		iov.iov_base = (u_char *)iov.iov_base + r;
+		iov.iov_len -= r;
+		capture_splice.queued += r;
+	}
+	capture_splice.held += frames;
+	return frames;
+}
+
+/* capture c bytes straight from the ring buffer to fd */
+static ssize_t capture_direct(int fd, char *name, size_t c)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames, pos, need;
+	snd_pcm_sframes_t avail, r;
+	size_t frame_bytes = bits_per_frame / 8;
+	size_t done = 0;
+	u_char *base, *ptr;
+	int err;
+
+	while (done < c) {
+		if (test_position)
+			do_test_position();
+		if (!stdin_polled())
+			check_stdin();
+		if (snd_pcm_state(handle) == SND_PCM_STATE_PREPARED) {
+			err = snd_pcm_start(handle);
+			if (err < 0)
+				capture_direct_error(fd, err);
+			continue;
+		}
+		err = capture_splice_release(fd);
+		if (err < 0) {
+			capture_direct_error(fd, err);
+			continue;
+		}
+		avail = snd_pcm_avail_update(handle);
+		if (avail < 0) {
+			capture_direct_error(fd, avail);
+			continue;
+		}
+		need = (c - done) / frame_bytes;
+		if (need > chunk_size)
+			need = chunk_size;
+		if (need == 0)
+			break;
+		avail -= capture_splice.held;
+		if (capture_splice.held &&
+		    capture_splice.held + need > buffer_frames / 2) {
+			/* the reader is behind, give it a part of the period */
+			usleep((long long)chunk_size * 250000 / hwparams.rate);
+			continue;
+		}
+		if ((snd_pcm_uframes_t)avail < need) {
+			if (!capture_splice.held)
+				pcm_wait();
+			else
+				usleep((long long)(need - avail) * 1000000 / hwparams.rate + 1);
+			continue;
+		}
+		frames = buffer_frames;
+		err = snd_pcm_mmap_begin(handle, &areas, &offset, &frames);
+		if (err < 0) {
+			capture_direct_error(fd, err);
+			continue;
+		}
+		base = (u_char *)areas[0].addr + areas[0].first / 8;
+		pos = (offset + capture_splice.held) % buffer_frames;
+		frames = buffer_frames - pos;
+		if (frames > need)
+			frames = need;
+		ptr = base + pos * frame_bytes;
+		if (vumeter || meter_file)
+			compute_max_peak(ptr, frames * hwparams.channels);
+		if (capture_splice.active) {
+			snd_pcm_mmap_commit(handle, offset, 0);
+			r = capture_splice_frames(fd, ptr, frames);
+			if (r < 0) {
+				perror(name);
+				prg_exit(EXIT_FAILURE);
+			}
+			if (r == 0)
+				continue;	/* retry with write() */
+		} else {
+			if (write(fd, ptr, frames * frame_bytes) !=
+			    (ssize_t)(frames * frame_bytes)) {
+				perror(name);
+				prg_exit(EXIT_FAILURE);
+			}
+			r = snd_pcm_mmap_commit(handle, offset, frames);
+			if (r < 0 || (snd_pcm_uframes_t)r != frames) {
+				capture_direct_error(fd, r < 0 ? r : -EPIPE);
+				continue;
+			}
+		}
+		if (test_position)
+			do_test_position();
+		done += frames * frame_bytes;
+	}
+	return done;
+}
+
 /* playing raw data */
 
 static void playback_go(int fd, size_t loaded, off64_t count, int rtype, char *name)
@@ -2386,6 +5154,12 @@ static void playback_go(int fd, size_t loaded, off64_t count, int rtype, char *n
 	header(rtype, name);
 	set_params();
 
+	if (mmap_direct && !read_ahead && interleaved && !conv.to && !rsmp.L &&
+	    mmap_direct_check()) {
+		playback_go_mmap(fd, loaded, count, name);
+		return;
+	}
+
 	while (loaded > chunk_bytes && written < count) {
 		if (pcm_write(audiobuf + written, chunk_size) <= 0)
 			return;
@@ -2395,6 +5169,11 @@ static void playback_go(int fd, size_t loaded, off64_t count, int rtype, char *n
 	if (written > 0 && loaded > 0)
 		memmove(audiobuf, audiobuf + written, loaded);
 
+	if (read_ahead) {
+		playback_go_async(fd, loaded, count - written, name);
+		return;
+	}
+
 	l = loaded;
 	while (written < count) {
 		do {
@@ -2423,6 +5202,7 @@ static void playback_go(int fd, size_t loaded, off64_t count, int rtype, char *n
 		written += r;
 		l = 0;
 	}
+	resampler_drain();
 	snd_pcm_nonblock(handle, 0);
 	snd_pcm_drain(handle);
 	snd_pcm_nonblock(handle, nonblock);
@@ -2433,7 +5213,8 @@ static void playback_go(int fd, size_t loaded, off64_t count, int rtype, char *n
  *  let's play or capture it (capture_type says VOC/WAVE/raw)
  */
 
-static void playback(char *name)
+/* open the file and parse the header, returns the file type */
+static int playback_open(char **name, size_t *loaded, int *vocofs)
 {
 	int ofs;
 	size_t dta;
@@ -2441,13 +5222,13 @@ static void playback(char *name)
 
 	pbrec_count = LLONG_MAX;
 	fdcount = 0;
-	if (!name || !strcmp(name, "-")) {
+	if (!*name || !strcmp(*name, "-")) {
 		fd = fileno(stdin);
-		name = "stdin";
+		*name = "stdin";
 	} else {
 		init_stdin();
-		if ((fd = open64(name, O_RDONLY, 0)) == -1) {
-			perror(name);
+		if ((fd = open64(*name, O_RDONLY, 0)) == -1) {
+			perror(*name);
 			prg_exit(EXIT_FAILURE);
 		}
 	}
@@ -2460,8 +5241,8 @@ static void playback(char *name)
 	if (test_au(fd, audiobuf) >= 0) {
 		rhwparams.format = hwparams.format;
 		pbrec_count = calc_count();
-		playback_go(fd, 0, pbrec_count, FORMAT_AU, name);
-		goto __end;
+		*loaded = 0;
+		return FORMAT_AU;
 	}
 	dta = sizeof(VocHeader);
 	if ((size_t)safe_read(fd, audiobuf + sizeof(AuHeader),
@@ -2471,33 +5252,481 @@ static void playback(char *name)
 	}
 	if ((ofs = test_vocfile(audiobuf)) >= 0) {
 		pbrec_count = calc_count();
-		voc_play(fd, ofs, name);
-		goto __end;
+		*vocofs = ofs;
+		return FORMAT_VOC;
 	}
 	/* read bytes for WAVE-header */
 	if ((dtawave = test_wavefile(fd, audiobuf, dta)) >= 0) {
 		pbrec_count = calc_count();
-		playback_go(fd, dtawave, pbrec_count, FORMAT_WAVE, name);
-	} else {
-		/* should be raw data */
-		init_raw_data();
-		pbrec_count = calc_count();
-		playback_go(fd, dta, pbrec_count, FORMAT_RAW, name);
+		*loaded = dtawave;
+		return wavefile_type;
 	}
-      __end:
+	/* should be raw data */
+	init_raw_data();
+	pbrec_count = calc_count();
+	*loaded = dta;
+	return FORMAT_RAW;
+}
+
+static void playback(char *name)
+{
+	int ofs, rtype;
+	size_t loaded;
+
+	rtype = playback_open(&name, &loaded, &ofs);
+	if (start_time) {
+		if (rtype == FORMAT_VOC) {
+			error(_("--start-time is not supported for VOC files"));
+			prg_exit(EXIT_FAILURE);
+		}
+		seek_start(name, &loaded);
+	}
+	if (rtype == FORMAT_VOC && linked.count > 1) {
+		error(_("VOC files cannot be played on multiple devices"));
+		prg_exit(EXIT_FAILURE);
+	} else if (rtype == FORMAT_VOC)
+		voc_play(fd, ofs, name);
+	else if (linked.count > 1)
+		playback_linked(fd, loaded, pbrec_count, rtype, name);
+	else
+		playback_go(fd, loaded, pbrec_count, rtype, name);
 	if (fd != 0)
 		close(fd);
 }
 
-/**
- * mystrftime
- *
- *   Variant of strftime(3) that supports additional format
- *   specifiers in the format string.
- *
- * Parameters:
+/*
+ * gapless playback of several files
  *
- *   s	  - destination string
+ * The PCM is configured once and keeps running across the file
+ * boundaries as long as the files share the same parameters.  The
+ * partial chunk at the end of a file is completed with the data of the
+ * next file instead of being padded with silence.  The next header is
+ * parsed while the device still plays the queued tail of the previous
+ * file; a file with other parameters drains the stream and triggers
+ * one reconfiguration.
+ */
+
+static size_t gapless_feed(u_char *buf, size_t fill, size_t loaded, char *name)
+{
+	off64_t count = pbrec_count;
+	size_t frame_bytes = bits_per_frame / 8;
+	size_t c, pos = 0;
+	ssize_t r;
+
+	/* keep the frames aligned across the files */
+	count -= count % frame_bytes;
+	if ((off64_t)loaded > count)
+		loaded = count;
+	count -= loaded;
+	while (loaded > 0 || count > 0) {
+		c = chunk_bytes - fill;
+		if (loaded > 0) {
+			/* the data read together with the header */
+			if (c > loaded)
+				c = loaded;
+			memcpy(buf + fill, audiobuf + pos, c);
+			pos += c;
+			loaded -= c;
+			r = c;
+		} else {
+			if ((off64_t)c > count)
+				c = count;
+			r = safe_read(fd, buf + fill, c);
+			if (r < 0) {
+				perror(name);
+				prg_exit(EXIT_FAILURE);
+			}
+			if (r == 0)
+				break;
+			fdcount += r;
+			count -= r;
+		}
+		fill += r;
+		if (fill == chunk_bytes) {
+			if (pcm_write(buf, chunk_size) != (ssize_t)chunk_size) {
+				error(_("write error"));
+				prg_exit(EXIT_FAILURE);
+			}
+			fill = 0;
+		}
+	}
+	/* a truncated file may end in the middle of a frame */
+	if (fill % frame_bytes)
+		fill -= fill % frame_bytes;
+	return fill;
+}
+
+static void gapless_drain(u_char *buf, size_t fill)
+{
+	if (fill > 0 && pcm_write(buf, fill * 8 / bits_per_frame) < 0) {
+		error(_("write error"));
+		prg_exit(EXIT_FAILURE);
+	}
+	resampler_drain();
+	snd_pcm_nonblock(handle, 0);
+	snd_pcm_drain(handle);
+	snd_pcm_nonblock(handle, nonblock);
+}
+
+static void playback_gapless(char **names, unsigned int count)
+{
+	snd_pcm_format_t format = SND_PCM_FORMAT_UNKNOWN;
+	unsigned int channels = 0, rate = 0, i;
+	u_char *buf = NULL;
+	size_t fill = 0, loaded;
+	int ofs, rtype, configured = 0;
+	char *name;
+
+	for (i = 0; i < count; i++) {
+		name = names[i];
+		rtype = playback_open(&name, &loaded, &ofs);
+		if (rtype == FORMAT_VOC) {
+			/* VOC blocks carry their own parameters */
+			if (configured)
+				gapless_drain(buf, fill);
+			fill = 0;
+			configured = 0;
+			voc_play(fd, ofs, name);
+		} else {
+			if (!configured || format != hwparams.format ||
+			    channels != hwparams.channels || rate != hwparams.rate) {
+				if (configured)
+					gapless_drain(buf, fill);
+				fill = 0;
+				format = hwparams.format;
+				channels = hwparams.channels;
+				rate = hwparams.rate;
+				header(rtype, name);
+				set_params();
+				buf = realloc(buf, chunk_bytes);
+				if (buf == NULL) {
+					error(_("not enough memory"));
+					prg_exit(EXIT_FAILURE);
+				}
+				configured = 1;
+			} else {
+				header(rtype, name);
+			}
+			fill = gapless_feed(buf, fill, loaded, name);
+		}
+		if (fd != 0)
+			close(fd);
+	}
+	if (configured)
+		gapless_drain(buf, fill);
+	free(buf);
+}
+
+/*
+ * linked multi-device playback
+ *
+ * Every device given with -D plays its own slice of the file channels.
+ * The PCMs are linked and started together once all ring buffers are
+ * filled.  The data are copied from the shared read buffer straight to
+ * the mmap areas of each device, the source areas just point to the
+ * channels of the slice.  The start skew is computed from the status
+ * timestamps and delays of the devices.
+ */
+
+static void linked_open(void)
+{
+	unsigned int i;
+	int err;
+
+	linked.pcm[0].handle = handle;
+	for (i = 1; i < linked.count; i++) {
+		err = snd_pcm_open(&linked.pcm[i].handle, linked.pcm[i].name,
+				   stream, open_mode);
+		if (err < 0) {
+			error(_("audio open error on %s: %s"), linked.pcm[i].name,
+			      snd_strerror(err));
+			prg_exit(EXIT_FAILURE);
+		}
+	}
+	/* the transfers use the mmap areas */
+	mmap_flag = 1;
+}
+
+static void linked_close(void)
+{
+	unsigned int i;
+
+	for (i = 1; i < linked.count; i++) {
+		if (linked.pcm[i].handle) {
+			if (linked.linked)
+				snd_pcm_unlink(linked.pcm[i].handle);
+			snd_pcm_close(linked.pcm[i].handle);
+			linked.pcm[i].handle = NULL;
+		}
+	}
+	linked.linked = 0;
+}
+
+/* split the file channels among the devices */
+static void linked_slices(void)
+{
+	unsigned int i, first = 0;
+	char *p = device_channels;
+
+	for (i = 0; i < linked.count; i++) {
+		if (p) {
+			linked.pcm[i].channels = strtol(p, &p, 0);
+			if (*p == ',')
+				p++;
+		} else {
+			if (hwparams.channels % linked.count) {
+				error(_("%i channels cannot be split evenly to %i devices, use --device-channels"),
+				      hwparams.channels, linked.count);
+				prg_exit(EXIT_FAILURE);
+			}
+			linked.pcm[i].channels = hwparams.channels / linked.count;
+		}
+		if (linked.pcm[i].channels < 1) {
+			error(_("invalid channel count for %s"), linked.pcm[i].name);
+			prg_exit(EXIT_FAILURE);
+		}
+		linked.pcm[i].first = first;
+		first += linked.pcm[i].channels;
+	}
+	if (first != hwparams.channels) {
+		error(_("the devices take %i channels, the file has %i"),
+		      first, hwparams.channels);
+		prg_exit(EXIT_FAILURE);
+	}
+}
+
+static void linked_set_params(void)
+{
+	snd_pcm_sw_params_t *swparams;
+	snd_pcm_uframes_t chunk = 0, buffer = 0, boundary;
+	unsigned int channels = hwparams.channels, rate = hwparams.rate, rate0 = 0, i;
+	int err;
+
+	snd_pcm_sw_params_alloca(&swparams);
+	linked_slices();
+	for (i = 0; i < linked.count; i++) {
+		handle = linked.pcm[i].handle;
+		hwparams.channels = linked.pcm[i].channels;
+		hwparams.rate = rate;
+		set_params();
+		if (conv.to) {
+			error(_("format conversion is not supported with multiple devices"));
+			prg_exit(EXIT_FAILURE);
+		}
+		if (i == 0)
+			rate0 = hwparams.rate;
+		else if (hwparams.rate != rate0) {
+			error(_("%s runs at %i Hz, %s at %i Hz"),
+			      linked.pcm[0].name, rate0,
+			      linked.pcm[i].name, hwparams.rate);
+			prg_exit(EXIT_FAILURE);
+		}
+		if (!chunk || chunk_size < chunk)
+			chunk = chunk_size;
+		if (!buffer || buffer_frames < buffer)
+			buffer = buffer_frames;
+		/* started explicitly when all buffers are filled */
+		snd_pcm_sw_params_current(handle, swparams);
+		snd_pcm_sw_params_get_boundary(swparams, &boundary);
+		snd_pcm_sw_params_set_start_threshold(handle, swparams, boundary);
+		err = snd_pcm_sw_params(handle, swparams);
+		if (err < 0) {
+			error(_("unable to install sw params: %s"), snd_strerror(err));
+			prg_exit(EXIT_FAILURE);
+		}
+	}
+	handle = linked.pcm[0].handle;
+	hwparams.channels = channels;
+	chunk_size = chunk;
+	buffer_frames = buffer;
+	bits_per_frame = bits_per_sample * channels;
+	chunk_bytes = chunk_size * bits_per_frame / 8;
+	audiobuf = realloc(audiobuf, chunk_bytes);
+	if (audiobuf == NULL) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	peak_meter_init();
+	if (!linked.linked) {
+		for (i = 1; i < linked.count; i++) {
+			err = snd_pcm_link(linked.pcm[0].handle, linked.pcm[i].handle);
+			if (err < 0) {
+				error(_("unable to link %s to %s: %s"), linked.pcm[i].name,
+				      linked.pcm[0].name, snd_strerror(err));
+				prg_exit(EXIT_FAILURE);
+			}
+		}
+		linked.linked = 1;
+	}
+}
+
+/* print the position of each device relative to the first one */
+static void linked_skew(const char *when)
+{
+	snd_pcm_status_t *status;
+	snd_htimestamp_t ts, ts0 = { 0, 0 };
+	double pos, pos0 = 0;
+	unsigned int i;
+
+	if (quiet_mode)
+		return;
+	snd_pcm_status_alloca(&status);
+	fprintf(stderr, _("Skew at %s:"), when);
+	for (i = 0; i < linked.count; i++) {
+		if (snd_pcm_status(linked.pcm[i].handle, status) < 0)
+			continue;
+		snd_pcm_status_get_htstamp(status, &ts);
+		pos = (double)linked.pcm[i].written - snd_pcm_status_get_delay(status);
+		if (i == 0) {
+			ts0 = ts;
+			pos0 = pos;
+			continue;
+		}
+		/* the position at the time of the first status */
+		pos += ((ts0.tv_sec - ts.tv_sec) +
+			(ts0.tv_nsec - ts.tv_nsec) / 1000000000.0) * hwparams.rate;
+		fprintf(stderr, " %s %+.1f", linked.pcm[i].name, pos - pos0);
+	}
+	fprintf(stderr, _(" frames\n"));
+}
+
+/* copy the slice of the device from the shared buffer, returns 0 on xrun */
+static int linked_write(struct linked_pcm *l, size_t frames)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_channel_area_t src[l->channels];
+	snd_pcm_uframes_t offset, size, done = 0;
+	snd_pcm_sframes_t avail;
+	unsigned int c;
+	int err;
+
+	for (c = 0; c < l->channels; c++) {
+		src[c].addr = audiobuf;
+		src[c].first = (l->first + c) * bits_per_sample;
+		src[c].step = bits_per_frame;
+	}
+	while (done < frames) {
+		avail = snd_pcm_avail_update(l->handle);
+		if (avail < 0)
+			return 0;
+		if (avail == 0) {
+			snd_pcm_wait(l->handle, 1000);
+			continue;
+		}
+		size = frames - done;
+		err = snd_pcm_mmap_begin(l->handle, &areas, &offset, &size);
+		if (err < 0)
+			return 0;
+		snd_pcm_areas_copy(areas, offset, src, done, l->channels, size,
+				   hwparams.format);
+		avail = snd_pcm_mmap_commit(l->handle, offset, size);
+		if (avail < 0 || (snd_pcm_uframes_t)avail != size)
+			return 0;
+		done += size;
+	}
+	l->written += frames;
+	return 1;
+}
+
+static void playback_linked(int fd, size_t loaded, off64_t count, int rtype, char *name)
+{
+	snd_pcm_uframes_t buffer_size;
+	snd_pcm_sframes_t avail;
+	int started = 0, skew_reported = 0;
+	off64_t written = 0;
+	size_t l, c, frames;
+	ssize_t r;
+	unsigned int i;
+
+	header(rtype, name);
+	linked_set_params();
+	for (i = 0; i < linked.count; i++)
+		linked.pcm[i].written = 0;
+	snd_pcm_prepare(handle);
+	buffer_size = buffer_frames;
+
+	l = loaded;
+	while (written < count || l > 0) {
+		/* fill the shared buffer with one chunk */
+		while (l < chunk_bytes && written + (off64_t)l < count) {
+			c = count - written - l;
+			if (c > chunk_bytes - l)
+				c = chunk_bytes - l;
+			r = safe_read(fd, audiobuf + l, c);
+			if (r < 0) {
+				perror(name);
+				prg_exit(EXIT_FAILURE);
+			}
+			if (r == 0)
+				break;
+			fdcount += r;
+			l += r;
+		}
+		if (l == 0)
+			break;
+		frames = l * 8 / bits_per_frame;
+		if (frames < chunk_size)
+			snd_pcm_format_set_silence(hwparams.format,
+						   audiobuf + frames * bits_per_frame / 8,
+						   (chunk_size - frames) * hwparams.channels);
+		if (vumeter || meter_file)
+			compute_max_peak(audiobuf, frames * hwparams.channels);
+		for (i = 0; i < linked.count; i++) {
+			if (!linked_write(&linked.pcm[i], chunk_size))
+				break;
+		}
+		if (i < linked.count) {
+			/* prepare acts on the whole group, refill and start again */
+			fprintf(stderr, _("underrun on %s, restarting all devices\n"),
+				linked.pcm[i].name);
+			snd_pcm_drop(handle);
+			snd_pcm_prepare(handle);
+			for (i = 0; i < linked.count; i++)
+				linked.pcm[i].written = 0;
+			started = 0;
+			skew_reported = 0;
+			continue;
+		}
+		written += l;
+		l = 0;
+		if (!started) {
+			/* start when the smallest ring cannot take another chunk */
+			int full = linked.pcm[0].written + chunk_size > buffer_size ||
+				   written >= count;
+			for (i = 0; !full && i < linked.count; i++) {
+				avail = snd_pcm_avail_update(linked.pcm[i].handle);
+				full = avail < (snd_pcm_sframes_t)chunk_size;
+			}
+			if (full) {
+				snd_pcm_start(handle);
+				started = 1;
+			}
+		} else if (!skew_reported &&
+			   linked.pcm[0].written >= buffer_size + chunk_size) {
+			linked_skew(_("start"));
+			skew_reported = 1;
+		}
+	}
+	if (!started && linked.pcm[0].written)
+		snd_pcm_start(handle);
+	if (linked.pcm[0].written > buffer_size)
+		linked_skew(_("end"));
+	for (i = 0; i < linked.count; i++) {
+		snd_pcm_nonblock(linked.pcm[i].handle, 0);
+		snd_pcm_drain(linked.pcm[i].handle);
+		snd_pcm_nonblock(linked.pcm[i].handle, nonblock);
+	}
+}
+
+/**
+ * mystrftime
+ *
+ *   Variant of strftime(3) that supports additional format
+ *   specifiers in the format string.
+ *
+ * Parameters:
+ *
+ *   s	  - destination string
  *   max	- max number of bytes to write
  *   userformat - format string
  *   tm	 - time information
@@ -2573,95 +5802,1378 @@ static int new_capture_file(char *name, char *namebuf, size_t namelen,
 			perror("localtime");
 			prg_exit(EXIT_FAILURE);
 		}
-		if (mystrftime(namebuf, namelen, name, tmp, filecount+1) == 0) {
-			fprintf(stderr, "mystrftime returned 0");
+		if (mystrftime(namebuf, namelen, name, tmp, filecount+1) == 0) {
+			fprintf(stderr, "mystrftime returned 0");
+			prg_exit(EXIT_FAILURE);
+		}
+		return filecount;
+	}
+
+	/* get a copy of the original filename */
+	strncpy(buf, name, sizeof(buf));
+
+	/* separate extension from filename */
+	s = buf + strlen(buf);
+	while (s > buf && *s != '.' && *s != '/')
+		--s;
+	if (*s == '.')
+		*s++ = 0;
+	else if (*s == '/')
+		s = buf + strlen(buf);
+
+	/* upon first jump to this if block rename the first file,
+	 * triggered capture numbers all files */
+	if (filecount == 1 && !trigger_level) {
+		if (*s)
+			snprintf(namebuf, namelen, "%s-01.%s", buf, s);
+		else
+			snprintf(namebuf, namelen, "%s-01", buf);
+		remove(namebuf);
+		rename(name, namebuf);
+		if (seek_index_frames) {
+			/* the index follows the data file */
+			char idxname[PATH_MAX+1], newidx[PATH_MAX+1];
+
+			snprintf(idxname, sizeof(idxname), "%s.idx", name);
+			snprintf(newidx, sizeof(newidx), "%s.idx", namebuf);
+			rename(idxname, newidx);
+		}
+		filecount = 2;
+	}
+
+	/* name of the current file */
+	if (*s)
+		snprintf(namebuf, namelen, "%s-%02i.%s", buf, filecount, s);
+	else
+		snprintf(namebuf, namelen, "%s-%02i", buf, filecount);
+
+	return filecount;
+}
+
+/**
+ * create_path
+ *
+ *   This function creates a file path, like mkdir -p. 
+ *
+ * Parameters:
+ *
+ *   path - the path to create
+ *
+ * Returns: 0 on success, -1 on failure
+ * On failure, a message has been printed to stderr.
+ */
+int create_path(const char *path)
+{
+	char *start;
+	mode_t mode = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+
+	if (path[0] == '/')
+		start = strchr(path + 1, '/');
+	else
+		start = strchr(path, '/');
+
+	while (start) {
+		char *buffer = strdup(path);
+		buffer[start-path] = 0x00;
+
+		if (mkdir(buffer, mode) == -1 && errno != EEXIST) {
+			fprintf(stderr, "Problem creating directory %s", buffer);
+			perror(" ");
+			free(buffer);
+			return -1;
+		}
+		free(buffer);
+		start = strchr(start + 1, '/');
+	}
+	return 0;
+}
+
+static int safe_open(const char *name)
+{
+	int fd;
+
+	fd = open64(name, O_WRONLY | O_CREAT, 0644);
+	if (fd == -1) {
+		if (errno != ENOENT || !use_strftime)
+			return -1;
+		if (create_path(name) == 0)
+			fd = open64(name, O_WRONLY | O_CREAT, 0644);
+	}
+	return fd;
+}
+
+/*
+ * asynchronous capture writer
+ *
+ * The capture thread reads the PCM data directly into the slots of a
+ * single-producer/single-consumer ring and the writer thread drains the
+ * slots to the output file, so pcm_read() never waits for the disk.
+ * The ring indexes are free running counters, only the writer thread
+ * sleeps (on a semaphore posted for every filled slot).
+ */
+
+static struct capture_writer {
+	pthread_t thread;
+	sem_t filled;
+	u_char *buf;
+	size_t *len;			/* used bytes in each slot */
+	int *fds;			/* output file of each slot */
+	unsigned int slots;
+	unsigned int head;		/* next slot to fill (capture thread) */
+	unsigned int tail;		/* next slot to write (writer thread) */
+	int fd;				/* current output file */
+	int err;			/* errno of the failed write */
+	int quit;
+	/* statistics */
+	unsigned int peak;		/* max. used slots */
+	unsigned int stalls;		/* writes longer than one chunk */
+	long long stall_max;		/* longest write in us */
+	unsigned int full;		/* capture waited for free slot */
+	long long full_time;		/* total capture wait in us */
+} capture_writer;
+
+static void *capture_writer_thread(void *arg)
+{
+	struct capture_writer *w = arg;
+	long long chunk_us = (long long)chunk_size * 1000000 / hwparams.rate;
+	long long t;
+	unsigned int slot;
+	size_t len;
+	ssize_t r;
+	u_char *data;
+
+	while (1) {
+		while (sem_wait(&w->filled) < 0 && errno == EINTR)
+			;
+		if (w->tail == __atomic_load_n(&w->head, __ATOMIC_ACQUIRE)) {
+			if (__atomic_load_n(&w->quit, __ATOMIC_ACQUIRE))
+				break;
+			continue;
+		}
+		slot = w->tail % w->slots;
+		data = w->buf + slot * chunk_bytes;
+		len = w->len[slot];
+		t = time_us();
+		while (len > 0) {
+			r = write(w->fds[slot], data, len);
+			if (r < 0) {
+				if (errno == EINTR)
+					continue;
+				__atomic_store_n(&w->err, errno, __ATOMIC_RELEASE);
+				return NULL;
+			}
+			data += r;
+			len -= r;
+		}
+		t = time_us() - t;
+		if (t > w->stall_max)
+			w->stall_max = t;
+		if (t > chunk_us)
+			w->stalls++;
+		__atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static void capture_writer_start(void)
+{
+	struct capture_writer *w = &capture_writer;
+	sigset_t all, old;
+	int err;
+
+	memset(w, 0, sizeof(*w));
+	w->slots = (unsigned long long)async_write_time * hwparams.rate / chunk_size;
+	if (w->slots < 2)
+		w->slots = 2;
+	w->buf = malloc((size_t)w->slots * chunk_bytes);
+	w->len = malloc(w->slots * sizeof(*w->len));
+	w->fds = malloc(w->slots * sizeof(*w->fds));
+	if (w->buf == NULL || w->len == NULL || w->fds == NULL) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	sem_init(&w->filled, 0, 0);
+	/* signals must be handled by the capture thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	err = pthread_create(&w->thread, NULL, capture_writer_thread, w);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		error(_("unable to create writer thread: %s"), strerror(err));
+		prg_exit(EXIT_FAILURE);
+	}
+}
+
+static void capture_writer_check(const char *name)
+{
+	int err = __atomic_load_n(&capture_writer.err, __ATOMIC_ACQUIRE);
+
+	if (err) {
+		errno = err;
+		perror(name);
+		prg_exit(EXIT_FAILURE);
+	}
+}
+
+/* returns the slot for the next chunk, waits only when the ring is full */
+static u_char *capture_writer_slot(const char *name)
+{
+	struct capture_writer *w = &capture_writer;
+	long long t = 0;
+
+	while (w->head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) >= w->slots) {
+		capture_writer_check(name);
+		if (!t) {
+			t = time_us();
+			w->full++;
+		}
+		usleep(1000);
+	}
+	if (t)
+		w->full_time += time_us() - t;
+	return w->buf + (w->head % w->slots) * chunk_bytes;
+}
+
+static void capture_writer_commit(size_t len)
+{
+	struct capture_writer *w = &capture_writer;
+	unsigned int used;
+
+	w->len[w->head % w->slots] = len;
+	w->fds[w->head % w->slots] = w->fd;
+	__atomic_store_n(&w->head, w->head + 1, __ATOMIC_RELEASE);
+	used = w->head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE);
+	if (used > w->peak)
+		w->peak = used;
+	sem_post(&w->filled);
+}
+
+/* wait until all queued data are written (also called from signal handler) */
+static void capture_writer_flush(void)
+{
+	struct capture_writer *w = &capture_writer;
+
+	if (w->buf == NULL)
+		return;
+	while (__atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) != w->head &&
+	       !__atomic_load_n(&w->err, __ATOMIC_ACQUIRE))
+		usleep(1000);
+}
+
+static void capture_writer_stop(void)
+{
+	struct capture_writer *w = &capture_writer;
+
+	if (w->buf == NULL)
+		return;
+	capture_writer_flush();
+	__atomic_store_n(&w->quit, 1, __ATOMIC_RELEASE);
+	sem_post(&w->filled);
+	pthread_join(w->thread, NULL);
+	sem_destroy(&w->filled);
+	if (verbose)
+		fprintf(stderr, _("Writer: peak ring usage %u/%u chunks (%.1f%%), "
+				  "longest write %.3f ms, %u stalled writes, "
+				  "capture waited %u times (%.3f ms)\n"),
+			w->peak, w->slots, w->peak * 100.0 / w->slots,
+			w->stall_max / 1000.0, w->stalls,
+			w->full, w->full_time / 1000.0);
+	free(w->buf);
+	free(w->len);
+	free(w->fds);
+	w->buf = NULL;
+	w->len = NULL;
+	w->fds = NULL;
+}
+
+/*
+ * capture file rotation
+ *
+ * A helper thread opens, preallocates and starts the next output file
+ * shortly before the running one reaches its size limit, so the capture
+ * thread only swaps the descriptors at the rotation point.  The header
+ * fix-up, fsync and close of the finished file are queued to the same
+ * thread.  With the asynchronous writer, a finished file is finalized
+ * only after the writer has drained the chunks committed before the swap.
+ * The next file is opened up to ROTATION_LEAD seconds ahead of the
+ * rotation.  A --use-strftime name is generated only at the swap, the
+ * file is prepared under a temporary name and renamed then.
+ */
+
+#define ROTATION_LEAD	2	/* seconds */
+#define ROTATION_RESERVE 10	/* seconds preallocated */
+#define ROTATION_JOBS	8
+
+static struct capture_rotation {
+	pthread_t thread;
+	sem_t wake;
+	int running;
+	/* finished files (capture thread -> helper) */
+	struct rotation_job {
+		int fd;
+		off64_t count;		/* data bytes */
+		unsigned int until;	/* writer slots of this file */
+	} jobs[ROTATION_JOBS];
+	unsigned int head;
+	unsigned int tail;
+	/* next file: 0 = none, 1 = requested, 2 = ready */
+	int state;
+	char *orig_name;
+	char name[PATH_MAX+1];
+	int filecount;
+	off64_t size;			/* expected data bytes */
+	int fd;
+	int err;
+	int quit;
+	/* statistics */
+	unsigned int rotations;
+	unsigned int late;		/* next file was not ready in time */
+	long long finalize_max;		/* longest finalization in us */
+} capture_rotation;
+
+static void capture_file_prepare(struct capture_rotation *r)
+{
+#ifdef FALLOC_FL_KEEP_SIZE
+	off64_t reserve;
+#endif
+
+	r->filecount = new_capture_file(r->orig_name, r->name,
+					sizeof(r->name), r->filecount);
+	if (use_strftime)
+		strncat(r->name, ".part", sizeof(r->name) - strlen(r->name) - 1);
+	remove(r->name);
+	r->fd = safe_open(r->name);
+	if (r->fd < 0) {
+		r->err = errno;
+		return;
+	}
+#ifdef FALLOC_FL_KEEP_SIZE
+	/* reserve the first blocks, the file size grows with the data */
+	reserve = snd_pcm_format_size(hwparams.format, ROTATION_RESERVE *
+				      hwparams.rate * hwparams.channels);
+	if (reserve > r->size)
+		reserve = r->size;
+	fallocate(r->fd, FALLOC_FL_KEEP_SIZE, 0, reserve + 4096);
+#endif
+	if (fmt_rec_table[file_type].start)
+		fmt_rec_table[file_type].start(r->fd, r->size);
+}
+
+static void capture_file_finalize(struct capture_rotation *r,
+				  struct rotation_job *job)
+{
+	struct capture_writer *w = &capture_writer;
+	long long t = time_us();
+	off64_t end;
+
+	/* the header update needs all data on the disk */
+	if (w->buf) {
+		while ((int)(__atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) - job->until) < 0 &&
+		       !__atomic_load_n(&w->err, __ATOMIC_ACQUIRE))
+			usleep(1000);
+	}
+	if (fmt_rec_table[file_type].end)
+		fmt_rec_table[file_type].end(job->fd, job->count);
+#ifdef FALLOC_FL_KEEP_SIZE
+	/* release the blocks reserved beyond the data */
+	end = lseek64(job->fd, 0, SEEK_END);
+	if (end > 0)
+		ftruncate(job->fd, end);
+#endif
+	fsync(job->fd);
+	close(job->fd);
+	t = time_us() - t;
+	if (t > r->finalize_max)
+		r->finalize_max = t;
+}
+
+static void *capture_rotation_thread(void *arg)
+{
+	struct capture_rotation *r = arg;
+
+	while (1) {
+		while (sem_wait(&r->wake) < 0 && errno == EINTR)
+			;
+		if (__atomic_load_n(&r->state, __ATOMIC_ACQUIRE) == 1) {
+			capture_file_prepare(r);
+			__atomic_store_n(&r->state, 2, __ATOMIC_RELEASE);
+		}
+		while (r->tail != __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+			capture_file_finalize(r, &r->jobs[r->tail % ROTATION_JOBS]);
+			__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+		}
+		if (__atomic_load_n(&r->quit, __ATOMIC_ACQUIRE))
+			break;
+	}
+	return NULL;
+}
+
+static void capture_rotation_start(char *orig_name)
+{
+	struct capture_rotation *r = &capture_rotation;
+	sigset_t all, old;
+	int err;
+
+	memset(r, 0, sizeof(*r));
+	r->orig_name = orig_name;
+	r->fd = -1;
+	sem_init(&r->wake, 0, 0);
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	err = pthread_create(&r->thread, NULL, capture_rotation_thread, r);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		error(_("unable to create rotation thread: %s"), strerror(err));
+		prg_exit(EXIT_FAILURE);
+	}
+	r->running = 1;
+}
+
+/* ask the helper to open the next file */
+static void capture_rotation_request(int filecount, off64_t size)
+{
+	struct capture_rotation *r = &capture_rotation;
+
+	if (__atomic_load_n(&r->state, __ATOMIC_ACQUIRE) != 0)
+		return;
+	r->filecount = filecount;
+	r->size = size;
+	r->err = 0;
+	__atomic_store_n(&r->state, 1, __ATOMIC_RELEASE);
+	sem_post(&r->wake);
+}
+
+/* give a strftime name the number of the file, "name-NN.ext" */
+static void capture_file_number(char *namebuf, size_t namelen, int filecount)
+{
+	char buf[PATH_MAX+1];
+	char *s;
+
+	strncpy(buf, namebuf, sizeof(buf));
+	buf[sizeof(buf) - 1] = 0;
+	s = buf + strlen(buf);
+	while (s > buf && *s != '.' && *s != '/')
+		--s;
+	if (*s == '.') {
+		*s++ = 0;
+		snprintf(namebuf, namelen, "%s-%02i.%s", buf, filecount, s);
+	} else {
+		snprintf(namebuf, namelen, "%s-%02i", buf, filecount);
+	}
+}
+
+/*
+ * returns the descriptor of the next file with the header written,
+ * namebuf holds the name of the running (or last) file on entry
+ */
+static int capture_rotation_take(char *namebuf, size_t namelen, int *filecount,
+				 off64_t size)
+{
+	struct capture_rotation *r = &capture_rotation;
+	char active[PATH_MAX+1];
+
+	switch (__atomic_load_n(&r->state, __ATOMIC_ACQUIRE)) {
+	case 0:
+		/* not requested (SIGUSR1), open it here */
+		r->filecount = *filecount;
+		r->size = size;
+		r->err = 0;
+		capture_file_prepare(r);
+		r->late++;
+		break;
+	case 1:
+		r->late++;
+		while (__atomic_load_n(&r->state, __ATOMIC_ACQUIRE) != 2)
+			usleep(1000);
+		break;
+	}
+	__atomic_store_n(&r->state, 0, __ATOMIC_RELEASE);
+	strncpy(active, namebuf, sizeof(active));
+	active[sizeof(active) - 1] = 0;
+	strncpy(namebuf, r->name, namelen);
+	*filecount = r->filecount;
+	if (r->fd < 0) {
+		errno = r->err;
+		perror(namebuf);
+		prg_exit(EXIT_FAILURE);
+	}
+	if (use_strftime) {
+		/* the time of the swap names the file, never the running one */
+		new_capture_file(r->orig_name, namebuf, namelen, r->filecount);
+		if (strcmp(namebuf, active) == 0)
+			capture_file_number(namebuf, namelen, r->filecount + 1);
+		if (rename(r->name, namebuf) < 0 &&
+		    (errno != ENOENT || create_path(namebuf) < 0 ||
+		     rename(r->name, namebuf) < 0)) {
+			perror(namebuf);
+			prg_exit(EXIT_FAILURE);
+		}
+	}
+	r->rotations++;
+	return r->fd;
+}
+
+/* queue the finished file for the header update and close */
+static void capture_rotation_finish(int fd, off64_t count)
+{
+	struct capture_rotation *r = &capture_rotation;
+	struct rotation_job *job;
+
+	while (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= ROTATION_JOBS)
+		usleep(1000);
+	job = &r->jobs[r->head % ROTATION_JOBS];
+	job->fd = fd;
+	job->count = count;
+	job->until = capture_writer.head;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+	sem_post(&r->wake);
+}
+
+/* wait for the queued files (also called from signal handler) */
+static void capture_rotation_flush(void)
+{
+	struct capture_rotation *r = &capture_rotation;
+
+	if (!r->running)
+		return;
+	while (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) != r->head ||
+	       __atomic_load_n(&r->state, __ATOMIC_ACQUIRE) == 1)
+		usleep(1000);
+	/* drop the unused next file */
+	if (__atomic_load_n(&r->state, __ATOMIC_ACQUIRE) == 2 && r->fd >= 0) {
+		close(r->fd);
+		remove(r->name);
+		r->state = 0;
+	}
+}
+
+static void capture_rotation_stop(void)
+{
+	struct capture_rotation *r = &capture_rotation;
+
+	if (!r->running)
+		return;
+	capture_rotation_flush();
+	__atomic_store_n(&r->quit, 1, __ATOMIC_RELEASE);
+	sem_post(&r->wake);
+	pthread_join(r->thread, NULL);
+	sem_destroy(&r->wake);
+	r->running = 0;
+	if (verbose && r->rotations)
+		fprintf(stderr, _("Rotation: %u file changes, %u not prepared in time, "
+				  "longest finalization %.3f ms\n"),
+			r->rotations, r->late, r->finalize_max / 1000.0);
+}
+
+/*
+ * seek index (--seek-index, --start-time)
+ *
+ * A text sidecar FILE.idx is written next to each captured file.  Every
+ * seek_index_frames frames it gets a "t" line with the wall clock time
+ * of the PCM status timestamp, the frame captured at that time and its
+ * byte offset in the file.  The xruns are recorded as "x" lines with the
+ * time the stream stopped and the minimal count of lost frames.
+ *
+ *	aplay-index 1
+ *	rate 48000
+ *	frame-bytes 4
+ *	data-offset 44
+ *	t 1697530000.123456789 0 44
+ *	x 1697530002.000000000 96000 1200
+ */
+
+static struct seek_index {
+	FILE *file;
+	snd_pcm_uframes_t frames;	/* frames read to the current file */
+	snd_pcm_uframes_t next;		/* frames of the next entry */
+	off64_t data_offset;
+	size_t frame_bytes;
+} seek_index;
+
+/* the wall clock time of a PCM timestamp */
+static void seek_index_wallclock(snd_htimestamp_t *ts)
+{
+	struct timespec rt, mt;
+
+	if (ts->tv_sec == 0 && ts->tv_nsec == 0) {
+		clock_gettime(CLOCK_REALTIME, ts);
+		return;
+	}
+	if (!monotonic)
+		return;
+	clock_gettime(CLOCK_REALTIME, &rt);
+	clock_gettime(CLOCK_MONOTONIC, &mt);
+	ts->tv_sec += rt.tv_sec - mt.tv_sec;
+	ts->tv_nsec += rt.tv_nsec - mt.tv_nsec;
+	if (ts->tv_nsec < 0) {
+		ts->tv_sec--;
+		ts->tv_nsec += 1000000000;
+	} else if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static void seek_index_open(const char *name, int fd)
+{
+	struct seek_index *x = &seek_index;
+	char idxname[PATH_MAX+1];
+
+	if (!seek_index_frames)
+		return;
+	snprintf(idxname, sizeof(idxname), "%s.idx", name);
+	x->file = fopen(idxname, "w");
+	if (x->file == NULL) {
+		perror(idxname);
+		prg_exit(EXIT_FAILURE);
+	}
+	/* nothing but the header is written to the file yet */
+	x->data_offset = lseek64(fd, 0, SEEK_CUR);
+	if (x->data_offset < 0)
+		x->data_offset = 0;
+	x->frame_bytes = bits_per_frame / 8;
+	x->frames = 0;
+	x->next = 0;
+	fprintf(x->file, "aplay-index 1\nrate %u\nframe-bytes %zu\ndata-offset %lld\n",
+		hwparams.rate, x->frame_bytes, (long long)x->data_offset);
+}
+
+/* account frames written to the file, adds the due entries */
+static void seek_index_update(snd_pcm_uframes_t frames)
+{
+	struct seek_index *x = &seek_index;
+	snd_pcm_status_t *status;
+	snd_htimestamp_t ts;
+	snd_pcm_uframes_t pos;
+
+	if (!x->file)
+		return;
+	x->frames += frames;
+	if (x->frames >= x->next) {
+		snd_pcm_status_alloca(&status);
+		if (snd_pcm_status(handle, status) < 0)
+			return;
+		snd_pcm_status_get_htstamp(status, &ts);
+		/* the frames in the buffer were captured before the timestamp */
+		pos = x->frames + snd_pcm_status_get_delay(status);
+		seek_index_wallclock(&ts);
+		fprintf(x->file, "t %lld.%09ld %lu %lld\n", (long long)ts.tv_sec,
+			ts.tv_nsec, (unsigned long)pos,
+			(long long)(x->data_offset + (off64_t)pos * x->frame_bytes));
+		fflush(x->file);
+		x->next = x->frames + seek_index_frames;
+	}
+}
+
+static void seek_index_xrun(snd_pcm_status_t *status)
+{
+	struct seek_index *x = &seek_index;
+	snd_htimestamp_t ts, now;
+	double lost;
+
+	if (!x->file || stream != SND_PCM_STREAM_CAPTURE)
+		return;
+	snd_pcm_status_get_trigger_htstamp(status, &ts);
+	seek_index_wallclock(&ts);
+	clock_gettime(CLOCK_REALTIME, &now);
+	lost = ((now.tv_sec - ts.tv_sec) +
+		(now.tv_nsec - ts.tv_nsec) / 1000000000.0) * hwparams.rate;
+	fprintf(x->file, "x %lld.%09ld %lu %lu\n", (long long)ts.tv_sec,
+		ts.tv_nsec, (unsigned long)x->frames,
+		lost > 0 ? (unsigned long)lost : 0UL);
+	fflush(x->file);
+	/* the next data start a new entry */
+	x->next = x->frames;
+}
+
+static void seek_index_close(void)
+{
+	struct seek_index *x = &seek_index;
+
+	if (!x->file)
+		return;
+	fclose(x->file);
+	x->file = NULL;
+}
+
+struct seek_entry {
+	double time;
+	off64_t frame;
+};
+
+/* returns the time in seconds, *mode: '+' relative, 'd' time of day, 'a' absolute */
+static double parse_start_time(const char *str, int *mode)
+{
+	struct tm tm;
+	double t = 0;
+	const char *p = str;
+	char *end;
+	int fields = 0;
+
+	if (*p == '+') {
+		*mode = '+';
+		p++;
+	} else if (strchr(p, '-')) {
+		memset(&tm, 0, sizeof(tm));
+		end = strptime(p, "%Y-%m-%d %H:%M:%S", &tm);
+		if (end == NULL)
+			end = strptime(p, "%Y-%m-%dT%H:%M:%S", &tm);
+		if (end == NULL || *end) {
+			error(_("invalid start time %s"), str);
+			prg_exit(EXIT_FAILURE);
+		}
+		tm.tm_isdst = -1;
+		*mode = 'a';
+		return mktime(&tm);
+	} else {
+		*mode = 'd';
+	}
+	/* [[H:]M:]S */
+	for (;;) {
+		double v = strtod(p, &end);
+		if (end == p) {
+			error(_("invalid start time %s"), str);
+			prg_exit(EXIT_FAILURE);
+		}
+		t = t * 60 + v;
+		fields++;
+		if (*end != ':')
+			break;
+		p = end + 1;
+	}
+	if (*end) {
+		error(_("invalid start time %s"), str);
+		prg_exit(EXIT_FAILURE);
+	}
+	/* H:M means hours and minutes for the time of day */
+	if (*mode == 'd' && fields == 2)
+		t *= 60;
+	return t;
+}
+
+/* loads the "t" entries, returns their count */
+static size_t seek_index_load(const char *idxname, struct seek_entry **entries,
+			      off64_t *data_offset, size_t *frame_bytes)
+{
+	char line[128];
+	struct seek_entry *e = NULL;
+	size_t n = 0, alloc = 0;
+	double t;
+	long long frame, v;
+	FILE *f;
+
+	f = fopen(idxname, "r");
+	if (f == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "data-offset %lld", &v) == 1) {
+			*data_offset = v;
+		} else if (sscanf(line, "frame-bytes %lld", &v) == 1) {
+			*frame_bytes = v;
+		} else if (sscanf(line, "t %lf %lld", &t, &frame) == 2) {
+			if (n == alloc) {
+				alloc = alloc ? alloc * 2 : 1024;
+				e = realloc(e, alloc * sizeof(*e));
+				if (e == NULL) {
+					error(_("not enough memory"));
+					prg_exit(EXIT_FAILURE);
+				}
+			}
+			e[n].time = t;
+			e[n].frame = frame;
+			n++;
+		}
+	}
+	fclose(f);
+	*entries = e;
+	return n;
+}
+
+/* position the played file to --start-time */
+static void seek_start(const char *name, size_t *loaded)
+{
+	char idxname[PATH_MAX+1];
+	struct seek_entry *e = NULL;
+	size_t n, lo, hi, mid, frame_bytes = bits_per_frame / 8;
+	off64_t data_offset, frame, offset;
+	double t, target;
+	struct tm tm;
+	time_t day;
+	int mode;
+
+	t = parse_start_time(start_time, &mode);
+	data_offset = lseek64(fd, 0, SEEK_CUR);
+	if (data_offset < 0) {
+		error(_("--start-time needs a seekable file"));
+		prg_exit(EXIT_FAILURE);
+	}
+	data_offset -= *loaded;
+	snprintf(idxname, sizeof(idxname), "%s.idx", name);
+	n = seek_index_load(idxname, &e, &data_offset, &frame_bytes);
+	if (n == 0) {
+		/* without the index only the stream position is known */
+		if (mode != '+') {
+			error(_("cannot read the index %s"), idxname);
+			prg_exit(EXIT_FAILURE);
+		}
+		frame = t * hwparams.rate;
+	} else {
+		if (mode == '+') {
+			target = e[0].time + t;
+		} else if (mode == 'd') {
+			day = e[0].time;
+			localtime_r(&day, &tm);
+			tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+			tm.tm_isdst = -1;
+			target = mktime(&tm) + t;
+			if (target < e[0].time)
+				target += 24 * 3600;
+		} else {
+			target = t;
+		}
+		if (target < e[0].time) {
+			error(_("%s is before the start of the recording"), start_time);
+			prg_exit(EXIT_FAILURE);
+		}
+		/* the last entry not after the target */
+		lo = 0;
+		hi = n;
+		while (hi - lo > 1) {
+			mid = (lo + hi) / 2;
+			if (e[mid].time <= target)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		frame = e[lo].frame + (off64_t)((target - e[lo].time) * hwparams.rate);
+		/* the time of an xrun gap has no frames */
+		if (lo + 1 < n && frame > e[lo + 1].frame)
+			frame = e[lo + 1].frame;
+		free(e);
+	}
+	offset = data_offset + frame * (off64_t)frame_bytes;
+	if (lseek64(fd, offset, SEEK_SET) != offset) {
+		perror(name);
+		prg_exit(EXIT_FAILURE);
+	}
+	if (!timelimit && pbrec_count != LLONG_MAX) {
+		pbrec_count -= frame * (off64_t)frame_bytes;
+		if (pbrec_count < 0)
+			pbrec_count = 0;
+	}
+	*loaded = 0;
+	if (verbose)
+		fprintf(stderr, _("Starting at frame %lld (offset %lld)\n"),
+			(long long)frame, (long long)offset);
+}
+
+/*
+ * level triggered capture
+ *
+ * The PCM runs all the time into a ring of chunks holding the pre-roll.
+ * A file is started when the peak (or RMS) level of a chunk reaches the
+ * trigger level; it gets the pre-roll chunks first and is closed after
+ * the level stayed below the trigger for the hang time.  The event files
+ * are opened and finalized by the rotation thread, so the next one is
+ * always prepared while waiting for the signal.
+ */
+
+/* levels of the current chunk, collected by the meter in pcm_read() */
+static struct trigger_chunk {
+	float *peak;
+	double *sumsq;
+	size_t frames;
+} trigger_chunk;
+
+static void trigger_fold(size_t frames)
+{
+	struct trigger_chunk *t = &trigger_chunk;
+	unsigned int c;
+
+	if (t->peak == NULL)
+		return;
+	for (c = 0; c < hwparams.channels; c++) {
+		if (peak_meter.peak[c] > t->peak[c])
+			t->peak[c] = peak_meter.peak[c];
+		t->sumsq[c] += peak_meter.sumsq[c];
+	}
+	t->frames += frames;
+}
+
+static double trigger_measure(const u_char *data, size_t frames)
+{
+	struct trigger_chunk *t = &trigger_chunk;
+	struct peak_meter *m = &peak_meter;
+	unsigned int c, channels = hwparams.channels;
+	double level = 0, v;
+
+	if (t->frames == 0) {
+		/* the meter is off, scan the chunk here */
+		peak_compute(data, frames * channels, channels);
+		for (c = 0; c < channels; c++) {
+			t->peak[c] = m->peak[c];
+			t->sumsq[c] = m->sumsq[c];
+		}
+		t->frames = frames;
+	}
+	for (c = 0; c < channels; c++) {
+		v = trigger_rms ? sqrt(t->sumsq[c] / t->frames) : t->peak[c];
+		if (v > level)
+			level = v;
+		t->peak[c] = 0;
+		t->sumsq[c] = 0;
+	}
+	t->frames = 0;
+	return level;
+}
+
+static void trigger_write(int fd, u_char *data, size_t len, const char *name)
+{
+	if (async_write_time) {
+		memcpy(capture_writer_slot(name), data, len);
+		capture_writer_check(name);
+		capture_writer_commit(len);
+	} else if (write(fd, data, len) != (ssize_t)len) {
+		perror(name);
+		prg_exit(EXIT_FAILURE);
+	}
+	fdcount += len;
+}
+
+static void capture_triggered(off64_t count)
+{
+	char namebuf[PATH_MAX+1] = "";
+	snd_pcm_uframes_t hang_frames, left = 0;
+	off64_t size;
+	unsigned long long head = 0, i, n;
+	unsigned int slots;
+	int filecount = 1, active = 0;
+	u_char *ring;
+	size_t c, f;
+	double level;
+
+	if (peak_meter.kind == PEAK_NONE) {
+		error(_("level trigger is not supported for the sample format %s"),
+		      snd_pcm_format_name(hwparams.format));
+		prg_exit(EXIT_FAILURE);
+	}
+	/* the pre-roll chunks and the current one */
+	slots = ((snd_pcm_uframes_t)pre_roll_time * hwparams.rate / 1000 +
+		 chunk_size - 1) / chunk_size + 1;
+	ring = malloc((size_t)slots * chunk_bytes);
+	trigger_chunk.peak = calloc(hwparams.channels, sizeof(*trigger_chunk.peak));
+	trigger_chunk.sumsq = calloc(hwparams.channels, sizeof(*trigger_chunk.sumsq));
+	trigger_chunk.frames = 0;
+	if (ring == NULL || !trigger_chunk.peak || !trigger_chunk.sumsq) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	hang_frames = (snd_pcm_uframes_t)hang_time * hwparams.rate / 1000;
+	size = fmt_rec_table[file_type].max_filesize;
+	if (max_file_size && size > max_file_size)
+		size = max_file_size;
+	/* strftime names are taken when the event starts */
+	if (!use_strftime)
+		capture_rotation_request(filecount, size);
+
+	while (count > 0) {
+		u_char *buf = ring + (head % slots) * chunk_bytes;
+
+		c = (count <= (off64_t)chunk_bytes) ? (size_t)count : chunk_bytes;
+		f = c * 8 / bits_per_frame;
+		if (pcm_read(buf, f) != f)
+			break;
+		head++;
+		count -= c;
+		level = trigger_measure(buf, f);
+
+		if (!active) {
+			if (level < trigger_level)
+				continue;
+			fd = capture_rotation_take(namebuf, sizeof(namebuf),
+						   &filecount, size);
+			filecount++;
+			capture_writer.fd = fd;
+			fdcount = 0;
+			active = 1;
+			left = hang_frames;
+			if (!quiet_mode)
+				fprintf(stderr, _("Triggered, recording to '%s'\n"), namebuf);
+			/* the pre-roll, the current chunk is the last one */
+			n = head < slots ? head : slots;
+			for (i = head - n; i < head - 1; i++)
+				trigger_write(fd, ring + (i % slots) * chunk_bytes,
+					      chunk_bytes, namebuf);
+			trigger_write(fd, buf, c, namebuf);
+			continue;
+		}
+
+		trigger_write(fd, buf, c, namebuf);
+		if (level >= trigger_level) {
+			left = hang_frames;
+		} else if (left > f) {
+			left -= f;
+		} else {
+			/* the event is over, prepare the file of the next one */
+			capture_rotation_finish(fd, fdcount);
+			fd = -1;
+			active = 0;
+			if (!use_strftime)
+				capture_rotation_request(filecount, size);
+			continue;
+		}
+		/* a long event continues in the next file */
+		if (fdcount + (off64_t)chunk_bytes > size || recycle_capture_file) {
+			if (recycle_capture_file) {
+				recycle_capture_file = 0;
+				signal(SIGUSR1, signal_handler_recycle);
+			}
+			capture_rotation_finish(fd, fdcount);
+			fd = capture_rotation_take(namebuf, sizeof(namebuf),
+						   &filecount, size);
+			filecount++;
+			capture_writer.fd = fd;
+			fdcount = 0;
+		}
+	}
+	capture_writer_check(namebuf);
+	if (active) {
+		capture_rotation_finish(fd, fdcount);
+		fd = -1;
+	}
+	free(ring);
+	free(trigger_chunk.peak);
+	free(trigger_chunk.sumsq);
+	trigger_chunk.peak = NULL;
+	trigger_chunk.sumsq = NULL;
+}
+
+/*
+ * tee outputs (--tee)
+ *
+ * The chunks read from the PCM are put to a ring shared by all tee
+ * outputs, each output has its own writer thread and a queue of slot
+ * references.  A slot is reused only when no queue references it.  When
+ * the queue of an output is full, the capture waits for it, or with the
+ * drop policy the chunk is skipped for this output and counted.  The
+ * peak type writes the levels like --meter instead of the samples.
+ * On stop the writers drain their queues, a drop output leaves the rest.
+ */
+
+#define TEE_DEPTH	32		/* queued chunks per output */
+#define TEE_PEAK	-2
+
+static struct tee {
+	unsigned int count;
+	unsigned int slots;
+	u_char *buf;
+	size_t *len;
+	int *refs;
+	int quit;
+	struct tee_output {
+		char *name;
+		int type;
+		int drop;
+		int fd;
+		FILE *file;			/* peak output */
+		struct peak_meter meter;
+		pthread_t thread;
+		sem_t filled;
+		sem_t space;
+		unsigned int queue[TEE_DEPTH];
+		unsigned int head;		/* capture thread only */
+		unsigned int tail;		/* writer thread only */
+		off64_t written;
+		unsigned long long dropped;
+		int err;
+		int done;			/* the writer left its loop */
+		int closed;
+	} out[TEE_MAX];
+} capture_tee;
+
+static void tee_parse(struct tee_output *o, char *spec)
+{
+	char *opt;
+
+	o->name = strdup(spec);
+	if (o->name == NULL) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	o->type = file_type;
+	opt = strchr(o->name, ',');
+	if (opt)
+		*opt++ = '\0';
+	while (opt && *opt) {
+		char *next = strchr(opt, ',');
+		if (next)
+			*next++ = '\0';
+		if (strcmp(opt, "drop") == 0) {
+			o->drop = 1;
+		} else if (strncmp(opt, "type=", 5) == 0) {
+			if (strcasecmp(opt + 5, "peak") == 0)
+				o->type = TEE_PEAK;
+			else
+				o->type = parse_file_type(opt + 5);
+			if (o->type == FORMAT_DEFAULT) {
+				error(_("unrecognized file format %s"), opt + 5);
+				prg_exit(EXIT_FAILURE);
+			}
+		} else {
+			error(_("unknown tee option %s"), opt);
+			prg_exit(EXIT_FAILURE);
+		}
+		opt = next;
+	}
+}
+
+static void tee_write(struct tee_output *o, const u_char *data, size_t len)
+{
+	if (o->type == TEE_PEAK) {
+		if (peak_compute_meter(&o->meter, data, len * 8 / bits_per_sample,
+				       hwparams.channels) == 0)
+			peak_meter_stream(&o->meter, o->file, 0, hwparams.channels,
+					  len * 8 / bits_per_frame);
+		return;
+	}
+	/* the container is full, nothing more fits */
+	if (o->written + (off64_t)len > fmt_rec_table[o->type].max_filesize) {
+		o->dropped++;
+		return;
+	}
+	if (write(o->fd, data, len) != (ssize_t)len) {
+		if (!o->err)
+			o->err = errno ? errno : EIO;
+		return;
+	}
+	o->written += len;
+}
+
+static void *tee_thread(void *arg)
+{
+	struct tee *t = &capture_tee;
+	struct tee_output *o = arg;
+	unsigned int slot;
+
+	for (;;) {
+		while (sem_wait(&o->filled) < 0 && errno == EINTR)
+			;
+		if (o->tail == __atomic_load_n(&o->head, __ATOMIC_ACQUIRE)) {
+			if (__atomic_load_n(&t->quit, __ATOMIC_ACQUIRE))
+				break;
+			continue;
+		}
+		if (o->drop && __atomic_load_n(&t->quit, __ATOMIC_ACQUIRE))
+			break;
+		slot = o->queue[o->tail % TEE_DEPTH];
+		tee_write(o, t->buf + slot * chunk_bytes, t->len[slot]);
+		__atomic_sub_fetch(&t->refs[slot], 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&o->tail, o->tail + 1, __ATOMIC_RELEASE);
+		if (!o->drop)
+			sem_post(&o->space);
+	}
+	__atomic_store_n(&o->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void tee_start(int tostdout)
+{
+	struct tee *t = &capture_tee;
+	struct tee_output *o;
+	sigset_t all, old;
+	unsigned int i;
+	int err;
+
+	if (!tee_count)
+		return;
+	memset(t, 0, sizeof(*t));
+	t->slots = TEE_DEPTH * tee_count + 1;
+	t->buf = malloc((size_t)t->slots * chunk_bytes);
+	t->len = calloc(t->slots, sizeof(*t->len));
+	t->refs = calloc(t->slots, sizeof(*t->refs));
+	if (!t->buf || !t->len || !t->refs) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < tee_count; i++) {
+		o = &t->out[i];
+		tee_parse(o, tee_specs[i]);
+		/* one writer for stdout */
+		if (strcmp(o->name, "-") == 0) {
+			if (tostdout) {
+				error(_("--tee=- cannot be used when recording to stdout"));
+				prg_exit(EXIT_FAILURE);
+			}
+			tostdout = 1;
+		}
+		if (o->type == TEE_PEAK) {
+			o->file = strcmp(o->name, "-") ? fopen(o->name, "w") : stdout;
+			if (o->file == NULL) {
+				perror(o->name);
+				prg_exit(EXIT_FAILURE);
+			}
+			o->meter = peak_meter;
+			o->meter.channels = 0;
+			o->meter.peak = o->meter.speak = o->meter.accp = o->meter.accs = NULL;
+			o->meter.sumsq = o->meter.ssumsq = NULL;
+			peak_meter_alloc(&o->meter, hwparams.channels);
+		} else {
+			if (strcmp(o->name, "-") == 0) {
+				o->fd = fileno(stdout);
+			} else {
+				remove(o->name);
+				o->fd = safe_open(o->name);
+				if (o->fd < 0) {
+					perror(o->name);
+					prg_exit(EXIT_FAILURE);
+				}
+			}
+			if (fmt_rec_table[o->type].start)
+				fmt_rec_table[o->type].start(o->fd,
+					fmt_rec_table[o->type].max_filesize);
+		}
+		sem_init(&o->filled, 0, 0);
+		sem_init(&o->space, 0, TEE_DEPTH);
+	}
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 0; i < tee_count; i++) {
+		err = pthread_create(&t->out[i].thread, NULL, tee_thread, &t->out[i]);
+		if (err) {
+			pthread_sigmask(SIG_SETMASK, &old, NULL);
+			error(_("unable to create tee thread: %s"), strerror(err));
 			prg_exit(EXIT_FAILURE);
 		}
-		return filecount;
+		t->count++;
 	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
 
-	/* get a copy of the original filename */
-	strncpy(buf, name, sizeof(buf));
-
-	/* separate extension from filename */
-	s = buf + strlen(buf);
-	while (s > buf && *s != '.' && *s != '/')
-		--s;
-	if (*s == '.')
-		*s++ = 0;
-	else if (*s == '/')
-		s = buf + strlen(buf);
-
-	/* upon first jump to this if block rename the first file */
-	if (filecount == 1) {
-		if (*s)
-			snprintf(namebuf, namelen, "%s-01.%s", buf, s);
-		else
-			snprintf(namebuf, namelen, "%s-01", buf);
-		remove(namebuf);
-		rename(name, namebuf);
-		filecount = 2;
+/* a free slot of the shared ring to capture the next chunk to */
+static u_char *tee_slot(void)
+{
+	struct tee *t = &capture_tee;
+	unsigned int i;
+
+	for (;;) {
+		for (i = 0; i < t->slots; i++)
+			if (__atomic_load_n(&t->refs[i], __ATOMIC_ACQUIRE) == 0)
+				return t->buf + i * chunk_bytes;
+		usleep(1000);
 	}
-
-	/* name of the current file */
-	if (*s)
-		snprintf(namebuf, namelen, "%s-%02i.%s", buf, filecount, s);
-	else
-		snprintf(namebuf, namelen, "%s-%02i", buf, filecount);
-
-	return filecount;
 }
 
-/**
- * create_path
- *
- *   This function creates a file path, like mkdir -p. 
- *
- * Parameters:
- *
- *   path - the path to create
- *
- * Returns: 0 on success, -1 on failure
- * On failure, a message has been printed to stderr.
- */
-int create_path(const char *path)
+/* queue a captured chunk to all outputs */
+static void tee_put(u_char *data, size_t len)
 {
-	char *start;
-	mode_t mode = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
-
-	if (path[0] == '/')
-		start = strchr(path + 1, '/');
-	else
-		start = strchr(path, '/');
-
-	while (start) {
-		char *buffer = strdup(path);
-		buffer[start-path] = 0x00;
+	struct tee *t = &capture_tee;
+	struct tee_output *o;
+	unsigned int i, slot;
 
-		if (mkdir(buffer, mode) == -1 && errno != EEXIST) {
-			fprintf(stderr, "Problem creating directory %s", buffer);
-			perror(" ");
-			free(buffer);
-			return -1;
+	if (!t->count)
+		return;
+	if (data < t->buf || data >= t->buf + t->slots * chunk_bytes) {
+		/* captured to another buffer (--async-write) */
+		u_char *buf = tee_slot();
+		memcpy(buf, data, len);
+		data = buf;
+	}
+	slot = (data - t->buf) / chunk_bytes;
+	t->len[slot] = len;
+	for (i = 0; i < t->count; i++) {
+		o = &t->out[i];
+		if (o->drop) {
+			if (o->head - __atomic_load_n(&o->tail, __ATOMIC_ACQUIRE) >= TEE_DEPTH) {
+				o->dropped++;
+				continue;
+			}
+		} else {
+			while (sem_wait(&o->space) < 0 && errno == EINTR)
+				;
 		}
-		free(buffer);
-		start = strchr(start + 1, '/');
+		__atomic_add_fetch(&t->refs[slot], 1, __ATOMIC_RELEASE);
+		o->queue[o->head % TEE_DEPTH] = slot;
+		__atomic_store_n(&o->head, o->head + 1, __ATOMIC_RELEASE);
+		sem_post(&o->filled);
 	}
-	return 0;
 }
 
-static int safe_open(const char *name)
+/* drain and close all outputs (also called from signal handler) */
+static void tee_flush(void)
 {
-	int fd;
+	struct tee *t = &capture_tee;
+	struct tee_output *o;
+	unsigned int i, wait;
+
+	__atomic_store_n(&t->quit, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < t->count; i++)
+		sem_post(&t->out[i].filled);
+	for (i = 0; i < t->count; i++) {
+		o = &t->out[i];
+		if (o->closed)
+			continue;
+		/* a stuck output must not hold the capture either */
+		for (wait = 0; !__atomic_load_n(&o->done, __ATOMIC_ACQUIRE) &&
+			       (!o->drop || wait < 1000); wait++)
+			usleep(1000);
+		if (!__atomic_load_n(&o->done, __ATOMIC_ACQUIRE))
+			continue;
+		if (o->type == TEE_PEAK) {
+			if (o->meter.sframes)
+				peak_meter_write(&o->meter, o->file);
+			if (o->file != stdout)
+				fclose(o->file);
+		} else {
+			if (fmt_rec_table[o->type].end)
+				fmt_rec_table[o->type].end(o->fd, o->written);
+			if (o->fd != fileno(stdout))
+				close(o->fd);
+		}
+		o->closed = 1;
+	}
+}
 
-	fd = open64(name, O_WRONLY | O_CREAT, 0644);
-	if (fd == -1) {
-		if (errno != ENOENT || !use_strftime)
-			return -1;
-		if (create_path(name) == 0)
-			fd = open64(name, O_WRONLY | O_CREAT, 0644);
+static void tee_stop(void)
+{
+	struct tee *t = &capture_tee;
+	struct tee_output *o;
+	unsigned int i;
+	int stuck = 0;
+
+	tee_flush();
+	for (i = 0; i < t->count; i++) {
+		o = &t->out[i];
+		o->dropped += o->head - __atomic_load_n(&o->tail, __ATOMIC_ACQUIRE);
+		if (o->closed) {
+			pthread_join(o->thread, NULL);
+			sem_destroy(&o->filled);
+			sem_destroy(&o->space);
+		} else {
+			/* still in write(), it keeps the ring and the file */
+			pthread_detach(o->thread);
+			fprintf(stderr, _("Tee %s: output is stuck, not finalized\n"),
+				o->name);
+			stuck = 1;
+		}
+		if (o->err) {
+			errno = o->err;
+			perror(o->name);
+		}
+		if (o->dropped && !quiet_mode)
+			fprintf(stderr, _("Tee %s: %llu chunks dropped\n"),
+				o->name, o->dropped);
+		if (o->closed)
+			free(o->name);
 	}
-	return fd;
+	t->count = 0;
+	if (stuck)
+		return;
+	free(t->buf);
+	free(t->len);
+	free(t->refs);
+	t->buf = NULL;
+	t->len = NULL;
+	t->refs = NULL;
 }
 
 static void capture(char *orig_name)
@@ -2671,6 +7183,8 @@ static void capture(char *orig_name)
 	char *name = orig_name;	/* current filename */
 	char namebuf[PATH_MAX+1];
 	off64_t count, rest;		/* number of bytes to capture */
+	off64_t next, lead;		/* next file size, prepare point */
+	int direct = 0;			/* capture from the ring buffer */
 
 	/* get number of bytes to capture */
 	count = calc_count();
@@ -2703,11 +7217,59 @@ static void capture(char *orig_name)
 	}
 	init_stdin();
 
+	if (async_write_time)
+		capture_writer_start();
+	else if (mmap_direct && !conv.to && !tee_count)
+		direct = mmap_direct_check();
+	tee_start(tostdout);
+	if (!tostdout)
+		capture_rotation_start(orig_name);
+	if (seek_index_frames && tostdout) {
+		error(_("--seek-index needs an output file"));
+		prg_exit(EXIT_FAILURE);
+	}
+	if (trigger_level) {
+		if (tee_count) {
+			error(_("--tee cannot be used with level triggered capture"));
+			prg_exit(EXIT_FAILURE);
+		}
+		if (tostdout) {
+			error(_("level triggered capture needs a file name"));
+			prg_exit(EXIT_FAILURE);
+		}
+		capture_triggered(count);
+		capture_rotation_stop();
+		capture_writer_stop();
+		return;
+	}
+	lead = snd_pcm_format_size(hwparams.format,
+				   ROTATION_LEAD * hwparams.rate * hwparams.channels);
+
 	do {
+		rest = count;
+		if (rest > fmt_rec_table[file_type].max_filesize)
+			rest = fmt_rec_table[file_type].max_filesize;
+		if (max_file_size && (rest > max_file_size)) 
+			rest = max_file_size;
+		/* size of the following file, zero when this is the last one */
+		next = count - rest;
+		if (next > fmt_rec_table[file_type].max_filesize)
+			next = fmt_rec_table[file_type].max_filesize;
+		if (max_file_size && (next > max_file_size))
+			next = max_file_size;
+		if (file_type == FORMAT_RAW && !timelimit && !next)
+			next = max_file_size ? max_file_size : LLONG_MAX;
+
 		/* open a file to write */
-		if(!tostdout) {
+		if (!tostdout && filecount) {
+			/* swap to the file prepared by the rotation thread */
+			fd = capture_rotation_take(namebuf, sizeof(namebuf),
+						   &filecount, rest);
+			name = namebuf;
+			filecount++;
+		} else if (!tostdout) {
 			/* upon the second file we start the numbering scheme */
-			if (filecount || use_strftime) {
+			if (use_strftime) {
 				filecount = new_capture_file(orig_name, namebuf,
 							     sizeof(namebuf),
 							     filecount);
@@ -2722,17 +7284,16 @@ static void capture(char *orig_name)
 				prg_exit(EXIT_FAILURE);
 			}
 			filecount++;
-		}
-
-		rest = count;
-		if (rest > fmt_rec_table[file_type].max_filesize)
-			rest = fmt_rec_table[file_type].max_filesize;
-		if (max_file_size && (rest > max_file_size)) 
-			rest = max_file_size;
-
-		/* setup sample header */
-		if (fmt_rec_table[file_type].start)
+			/* setup sample header */
+			if (fmt_rec_table[file_type].start)
+				fmt_rec_table[file_type].start(fd, rest);
+		} else if (fmt_rec_table[file_type].start) {
 			fmt_rec_table[file_type].start(fd, rest);
+		}
+		capture_writer.fd = fd;
+		if (direct)
+			capture_splice_init(fd);
+		seek_index_open(name, fd);
 
 		/* capture */
 		fdcount = 0;
@@ -2740,16 +7301,37 @@ static void capture(char *orig_name)
 			size_t c = (rest <= (off64_t)chunk_bytes) ?
 				(size_t)rest : chunk_bytes;
 			size_t f = c * 8 / bits_per_frame;
-			if (pcm_read(audiobuf, f) != f)
-				break;
-			if (write(fd, audiobuf, c) != c) {
-				perror(name);
-				prg_exit(EXIT_FAILURE);
+			u_char *buf = audiobuf;
+			if (direct) {
+				if (capture_direct(fd, name, c) != (ssize_t)c)
+					break;
+			} else {
+				if (async_write_time)
+					buf = capture_writer_slot(name);
+				else if (capture_tee.count)
+					buf = tee_slot();
+				if (pcm_read(buf, f) != f)
+					break;
+				tee_put(buf, c);
+				if (async_write_time) {
+					capture_writer_check(name);
+					capture_writer_commit(c);
+				} else if (write(fd, buf, c) != c) {
+					perror(name);
+					prg_exit(EXIT_FAILURE);
+				}
 			}
 			count -= c;
 			rest -= c;
 			fdcount += c;
+			seek_index_update(f);
+			if (!tostdout && next && rest <= lead)
+				capture_rotation_request(filecount, next);
 		}
+		capture_writer_check(name);
+		if (direct)
+			capture_splice_sync(fd);
+		seek_index_close();
 
 		/* re-enable SIGUSR1 signal */
 		if (recycle_capture_file) {
@@ -2757,9 +7339,9 @@ static void capture(char *orig_name)
 			signal(SIGUSR1, signal_handler_recycle);
 		}
 
-		/* finish sample container */
-		if (fmt_rec_table[file_type].end && !tostdout) {
-			fmt_rec_table[file_type].end(fd);
+		/* finish sample container in the background */
+		if (!tostdout) {
+			capture_rotation_finish(fd, fdcount);
 			fd = -1;
 		}
 
@@ -2767,6 +7349,313 @@ static void capture(char *orig_name)
 		 * requested counts of data are recorded
 		 */
 	} while ((file_type == FORMAT_RAW && !timelimit) || count > 0);
+
+	tee_stop();
+	capture_rotation_stop();
+	capture_writer_stop();
+}
+
+/*
+ * parallel channel file I/O for separate channels (-I)
+ *
+ * The channel files are shared among io_threads workers.  The files are
+ * ordered by device and inode and each worker gets a contiguous part of
+ * the list, so the files of one device are accessed in order by as few
+ * workers as possible.  Two chunk buffers are used: the workers fill (or
+ * drain) one of them while the PCM transfers the other.
+ */
+
+static struct chanio_pool {
+	unsigned int threads;
+	pthread_t *thread;
+	sem_t *start;			/* one per worker */
+	sem_t done;
+	int *fds;
+	unsigned int channels;
+	unsigned int *order;		/* channels sorted by device */
+	/* the current job */
+	int writing;
+	u_char **bufs;
+	size_t size;			/* bytes per channel */
+	ssize_t *len;			/* result per channel */
+	int *err;			/* errno per channel */
+	int quit;
+	int pending;
+	unsigned int waited;		/* PCM waited for the workers */
+} chanio;
+
+static void chanio_job(struct chanio_pool *p, unsigned int ch)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	if (p->writing) {
+		r = write(p->fds[ch], p->bufs[ch], p->size);
+		p->len[ch] = r;
+		p->err[ch] = r < 0 ? errno : 0;
+		return;
+	}
+	while (done < p->size) {
+		r = safe_read(p->fds[ch], p->bufs[ch] + done, p->size - done);
+		if (r < 0) {
+			p->len[ch] = -1;
+			p->err[ch] = errno;
+			return;
+		}
+		if (r == 0)
+			break;
+		done += r;
+	}
+	p->len[ch] = done;
+	p->err[ch] = 0;
+}
+
+static void *chanio_thread(void *arg)
+{
+	struct chanio_pool *p = &chanio;
+	unsigned int w = (unsigned long)arg;
+	unsigned int i, first, last;
+
+	first = w * p->channels / p->threads;
+	last = (w + 1) * p->channels / p->threads;
+	for (;;) {
+		while (sem_wait(&p->start[w]) < 0 && errno == EINTR)
+			;
+		if (__atomic_load_n(&p->quit, __ATOMIC_ACQUIRE))
+			break;
+		for (i = first; i < last; i++)
+			chanio_job(p, p->order[i]);
+		sem_post(&p->done);
+	}
+	return NULL;
+}
+
+struct chanio_file {
+	dev_t dev;
+	ino_t ino;
+	unsigned int channel;
+};
+
+static int chanio_compare(const void *a, const void *b)
+{
+	const struct chanio_file *fa = a, *fb = b;
+
+	if (fa->dev != fb->dev)
+		return fa->dev < fb->dev ? -1 : 1;
+	if (fa->ino != fb->ino)
+		return fa->ino < fb->ino ? -1 : 1;
+	return fa->channel < fb->channel ? -1 : 1;
+}
+
+static void chanio_start(int *fds, unsigned int channels)
+{
+	struct chanio_pool *p = &chanio;
+	struct chanio_file files[channels];
+	struct stat st;
+	sigset_t all, old;
+	unsigned int i;
+	int err;
+
+	memset(p, 0, sizeof(*p));
+	p->threads = (unsigned int)io_threads < channels ? io_threads : channels;
+	p->fds = fds;
+	p->channels = channels;
+	p->thread = calloc(p->threads, sizeof(*p->thread));
+	p->start = calloc(p->threads, sizeof(*p->start));
+	p->order = calloc(channels, sizeof(*p->order));
+	p->len = calloc(channels, sizeof(*p->len));
+	p->err = calloc(channels, sizeof(*p->err));
+	if (!p->thread || !p->start || !p->order || !p->len || !p->err) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < channels; i++) {
+		if (fstat(fds[i], &st) < 0)
+			memset(&st, 0, sizeof(st));
+		files[i].dev = st.st_dev;
+		files[i].ino = st.st_ino;
+		files[i].channel = i;
+	}
+	qsort(files, channels, sizeof(files[0]), chanio_compare);
+	for (i = 0; i < channels; i++)
+		p->order[i] = files[i].channel;
+	sem_init(&p->done, 0, 0);
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 0; i < p->threads; i++) {
+		sem_init(&p->start[i], 0, 0);
+		err = pthread_create(&p->thread[i], NULL, chanio_thread,
+				     (void *)(unsigned long)i);
+		if (err) {
+			pthread_sigmask(SIG_SETMASK, &old, NULL);
+			error(_("unable to create I/O thread: %s"), strerror(err));
+			prg_exit(EXIT_FAILURE);
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* read or write size bytes of each channel in the background */
+static void chanio_submit(int writing, u_char **bufs, size_t size)
+{
+	struct chanio_pool *p = &chanio;
+	unsigned int i;
+
+	p->writing = writing;
+	p->bufs = bufs;
+	p->size = size;
+	p->pending = 1;
+	for (i = 0; i < p->threads; i++)
+		sem_post(&p->start[i]);
+}
+
+/* wait for the submitted job, returns the bytes per channel */
+static ssize_t chanio_wait(char **names)
+{
+	struct chanio_pool *p = &chanio;
+	unsigned int i;
+
+	if (!p->pending)
+		return 0;
+	if (sem_trywait(&p->done) < 0) {
+		p->waited++;
+		while (sem_wait(&p->done) < 0 && errno == EINTR)
+			;
+	}
+	for (i = 1; i < p->threads; i++)
+		while (sem_wait(&p->done) < 0 && errno == EINTR)
+			;
+	p->pending = 0;
+	for (i = 0; i < p->channels; i++) {
+		if (p->len[i] < 0) {
+			errno = p->err[i];
+			perror(names[i]);
+			prg_exit(EXIT_FAILURE);
+		}
+		if (p->writing && (size_t)p->len[i] != p->size) {
+			error(_("%s: short write (%li of %lu bytes)"), names[i],
+			      (long)p->len[i], (unsigned long)p->size);
+			prg_exit(EXIT_FAILURE);
+		}
+		if (p->len[i] != p->len[0]) {
+			error(_("%s: length differs from %s (%li and %li bytes)"),
+			      names[i], names[0], (long)p->len[i], (long)p->len[0]);
+			prg_exit(EXIT_FAILURE);
+		}
+	}
+	return p->len[0];
+}
+
+static void chanio_stop(char **names)
+{
+	struct chanio_pool *p = &chanio;
+	unsigned int i;
+
+	chanio_wait(names);
+	__atomic_store_n(&p->quit, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < p->threads; i++) {
+		sem_post(&p->start[i]);
+		pthread_join(p->thread[i], NULL);
+		sem_destroy(&p->start[i]);
+	}
+	sem_destroy(&p->done);
+	if (verbose)
+		fprintf(stderr, _("I/O threads: %u, PCM waited for the files %u times\n"),
+			p->threads, p->waited);
+	free(p->thread);
+	free(p->start);
+	free(p->order);
+	free(p->len);
+	free(p->err);
+	memset(p, 0, sizeof(*p));
+}
+
+/* allocate the second chunk buffer for the double buffering */
+static u_char *chanio_buffers(unsigned int channels, u_char *bufs[2][channels])
+{
+	size_t vsize = chunk_bytes / channels;
+	unsigned int channel;
+	u_char *buf;
+
+	buf = malloc(chunk_bytes);
+	if (buf == NULL) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	for (channel = 0; channel < channels; ++channel) {
+		bufs[0][channel] = audiobuf + vsize * channel;
+		bufs[1][channel] = buf + vsize * channel;
+	}
+	return buf;
+}
+
+static void playbackv_go_threads(int *fds, unsigned int channels, off64_t count,
+				 char **names)
+{
+	size_t vsize = chunk_bytes / channels;
+	u_char *bufs[2][channels];
+	u_char *buf;
+	size_t expected, c;
+	ssize_t r;
+	int cur = 0;
+
+	buf = chanio_buffers(channels, bufs);
+	chanio_start(fds, channels);
+	expected = count / channels;
+	if (expected > vsize)
+		expected = vsize;
+	chanio_submit(0, bufs[cur], expected);
+	while (count > 0) {
+		r = chanio_wait(names);
+		if (r == 0)
+			break;
+		count -= r * channels;
+		/* read the next chunk while this one is played */
+		expected = count / channels;
+		if (expected > vsize)
+			expected = vsize;
+		if (expected > 0)
+			chanio_submit(0, bufs[cur ^ 1], expected);
+		c = r * 8 / bits_per_sample;
+		if ((size_t)pcm_writev(bufs[cur], channels, c) != c)
+			break;
+		cur ^= 1;
+	}
+	chanio_stop(names);
+	free(buf);
+	snd_pcm_nonblock(handle, 0);
+	snd_pcm_drain(handle);
+	snd_pcm_nonblock(handle, nonblock);
+}
+
+static void capturev_go_threads(int *fds, unsigned int channels, off64_t count,
+				char **names)
+{
+	u_char *bufs[2][channels];
+	u_char *buf;
+	size_t c;
+	ssize_t r;
+	int cur = 0;
+
+	buf = chanio_buffers(channels, bufs);
+	chanio_start(fds, channels);
+	while (count > 0) {
+		c = count;
+		if (c > chunk_bytes)
+			c = chunk_bytes;
+		c = c * 8 / bits_per_frame;
+		/* the previous chunk is written while this one is captured */
+		if ((size_t)(r = pcm_readv(bufs[cur], channels, c)) != c)
+			break;
+		chanio_wait(names);
+		chanio_submit(1, bufs[cur], r * bits_per_sample / 8);
+		r = r * bits_per_frame / 8;
+		count -= r;
+		fdcount += r;
+		cur ^= 1;
+	}
+	chanio_stop(names);
+	free(buf);
 }
 
 static void playbackv_go(int* fds, unsigned int channels, size_t loaded, off64_t count, int rtype, char **names)
@@ -2785,6 +7674,31 @@ static void playbackv_go(int* fds, unsigned int channels, size_t loaded, off64_t
 	// Not yet implemented
 	assert(loaded == 0);
 
+	if (io_threads) {
+		playbackv_go_threads(fds, channels, count, names);
+		return;
+	}
+
+	if (read_ahead) {
+		u_char *data;
+		ssize_t l;
+
+		playback_reader_start(fds, channels, count, 0);
+		while ((l = playback_reader_get(&data, names)) > 0) {
+			size_t c = l * 8 / bits_per_sample;
+			for (channel = 0; channel < channels; ++channel)
+				bufs[channel] = data + vsize * channel;
+			if ((size_t)pcm_writev(bufs, channels, c) != c)
+				break;
+			playback_reader_put();
+		}
+		playback_reader_stop();
+		snd_pcm_nonblock(handle, 0);
+		snd_pcm_drain(handle);
+		snd_pcm_nonblock(handle, nonblock);
+		return;
+	}
+
 	for (channel = 0; channel < channels; ++channel)
 		bufs[channel] = audiobuf + vsize * channel;
 
@@ -2834,6 +7748,11 @@ static void capturev_go(int* fds, unsigned int channels, off64_t count, int rtyp
 
 	vsize = chunk_bytes / channels;
 
+	if (io_threads) {
+		capturev_go_threads(fds, channels, count, names);
+		return;
+	}
+
 	for (channel = 0; channel < channels; ++channel)
 		bufs[channel] = audiobuf + vsize * channel;
 
@@ -0,0 +1,151 @@
+#!/bin/sh
+#
+#  Offline throughput benchmark of aplay/arecord
+#
+#  The transfers run against the alsa-lib null and file plugins, so no
+#  sound hardware is needed.  The null plugin does not pace the stream,
+#  every run is as fast as aplay and alsa-lib can move the data.
+#
+#  usage: bench.sh [APLAY]
+#
+#  The sweep is set from the environment, the defaults are in brackets:
+#
+#    BENCH_STREAMS    playback capture         [playback capture]
+#    BENCH_DEVICES    null file                [null file]
+#    BENCH_FORMATS    sample formats           [S16_LE S32_LE FLOAT_LE]
+#    BENCH_CHANNELS   channel counts           [2 8]
+#    BENCH_RATES      rates                    [48000]
+#    BENCH_PERIODS    period sizes in frames   [256 4096]
+#    BENCH_ACCESS     rw mmap                  [rw mmap]
+#    BENCH_LAYOUTS    interleaved separate     [interleaved separate]
+#    BENCH_SECONDS    audio time per run       [60]
+#
+#  Output columns:
+#
+#    frames/s   frames transferred per second of wall clock time
+#    ns/frame   user + system CPU time per frame
+#    sys/s      system calls per second of audio, counted in a second
+#               run under strace(1); "-" when strace is not installed
+#
+
+APLAY=${1:-./aplay}
+BENCH_STREAMS=${BENCH_STREAMS:-"playback capture"}
+BENCH_DEVICES=${BENCH_DEVICES:-"null file"}
+BENCH_FORMATS=${BENCH_FORMATS:-"S16_LE S32_LE FLOAT_LE"}
+BENCH_CHANNELS=${BENCH_CHANNELS:-"2 8"}
+BENCH_RATES=${BENCH_RATES:-"48000"}
+BENCH_PERIODS=${BENCH_PERIODS:-"256 4096"}
+BENCH_ACCESS=${BENCH_ACCESS:-"rw mmap"}
+BENCH_LAYOUTS=${BENCH_LAYOUTS:-"interleaved separate"}
+BENCH_SECONDS=${BENCH_SECONDS:-60}
+
+TMP=$(mktemp -d "${TMPDIR:-/tmp}/aplay-bench.XXXXXX") || exit 1
+trap 'rm -rf "$TMP"' 0
+STRACE=$(command -v strace)
+failed=0
+
+# user + system CPU time of the finished children in ns, from times output
+cpu_time() {
+	awk 'NR == 2 {
+		ns = 0
+		for (i = 1; i <= 2; i++) {
+			split($i, t, "m")
+			ns += (t[1] * 60 + t[2]) * 1e9
+		}
+		printf "%.0f\n", ns
+	}' "$1"
+}
+
+# the number of calls in the total line of strace -c
+syscalls() {
+	awk '$NF == "total" {
+		n = 0
+		for (i = 3; i < NF; i++)
+			if ($i ~ /^[0-9]+$/ && $i + 0 > n)
+				n = $i + 0
+		print n
+	}' "$1"
+}
+
+# run the aplay command line in "$@", print the numbers for the frames in $1
+bench() {
+	frames=$1
+	shift
+	times > "$TMP/times0"
+	w0=$(date +%s%N)
+	if ! "$@" > /dev/null 2> "$TMP/log"; then
+		echo "failed: $*" >&2
+		cat "$TMP/log" >&2
+		return 1
+	fi
+	w1=$(date +%s%N)
+	times > "$TMP/times1"
+	c0=$(cpu_time "$TMP/times0")
+	c1=$(cpu_time "$TMP/times1")
+	sys=-
+	if [ -n "$STRACE" ] &&
+	   "$STRACE" -f -c -q -o "$TMP/strace" "$@" > /dev/null 2>&1; then
+		sys=$(syscalls "$TMP/strace")
+	fi
+	awk -v f="$frames" -v w="$((w1 - w0))" -v c="$((c1 - c0))" \
+	    -v sys="$sys" -v sec="$BENCH_SECONDS" 'BEGIN {
+		printf "%12.0f %9.2f %9s\n", f * 1e9 / (w ? w : 1), c / f,
+			sys == "-" ? "-" : sprintf("%.0f", sys / sec)
+	}'
+}
+
+printf "%-8s %-4s %-5s %-11s %-9s %3s %6s %6s %12s %9s %9s\n" \
+	stream dev acc layout format ch rate period frames/s ns/frame sys/s
+for stream in $BENCH_STREAMS; do
+for device in $BENCH_DEVICES; do
+for access in $BENCH_ACCESS; do
+for layout in $BENCH_LAYOUTS; do
+for format in $BENCH_FORMATS; do
+for channels in $BENCH_CHANNELS; do
+for rate in $BENCH_RATES; do
+for period in $BENCH_PERIODS; do
+	# one channel file would be named FILE.0
+	[ "$layout" = separate ] && [ "$channels" -lt 2 ] && continue
+	case $device in
+	file)	pcm="file:'/dev/null',raw" ;;
+	*)	pcm=$device ;;
+	esac
+	set -- "$APLAY" -q -D "$pcm" -t raw -f "$format" -c "$channels" \
+		-r "$rate" --period-size="$period" \
+		--buffer-size="$((period * 4))" -d "$BENCH_SECONDS"
+	[ "$access" = mmap ] && set -- "$@" -M
+	# capture never gets a device node, arecord removes and recreates
+	# its output file; interleaved data go to stdout, which bench()
+	# discards, the channel files to $TMP
+	if [ "$stream" = capture ]; then
+		set -- "$@" -C
+		file=-
+	else
+		file=/dev/zero
+	fi
+	if [ "$layout" = separate ]; then
+		set -- "$@" -I
+		i=0
+		while [ $i -lt "$channels" ]; do
+			[ "$stream" = capture ] && file="$TMP/capture.$i"
+			set -- "$@" "$file"
+			i=$((i + 1))
+		done
+	else
+		set -- "$@" "$file"
+	fi
+	result=$(bench "$((rate * BENCH_SECONDS))" "$@") || failed=1
+	rm -f "$TMP"/capture.*
+	[ -n "$result" ] || continue
+	printf "%-8s %-4s %-5s %-11s %-9s %3s %6s %6s %s\n" \
+		"$stream" "$device" "$access" "$layout" "$format" "$channels" \
+		"$rate" "$period" "$result"
+done
+done
+done
+done
+done
+done
+done
+done
+exit $failed
@@ -48,14 +48,18 @@ typedef struct voc_ext_block {
 #define COMPOSE_ID(a,b,c,d)	((a) | ((b)<<8) | ((c)<<16) | ((d)<<24))
 #define LE_SHORT(v)		(v)
 #define LE_INT(v)		(v)
+#define LE_LONG(v)		(v)
 #define BE_SHORT(v)		bswap_16(v)
 #define BE_INT(v)		bswap_32(v)
+#define BE_LONG(v)		bswap_64(v)
 #elif __BYTE_ORDER == __BIG_ENDIAN
 #define COMPOSE_ID(a,b,c,d)	((d) | ((c)<<8) | ((b)<<16) | ((a)<<24))
 #define LE_SHORT(v)		bswap_16(v)
 #define LE_INT(v)		bswap_32(v)
+#define LE_LONG(v)		bswap_64(v)
 #define BE_SHORT(v)		(v)
 #define BE_INT(v)		(v)
+#define BE_LONG(v)		(v)
 #else
 #error "Wrong endian"
 #endif
@@ -64,6 +68,9 @@ typedef struct voc_ext_block {
 #define WAV_WAVE		COMPOSE_ID('W','A','V','E')
 #define WAV_FMT			COMPOSE_ID('f','m','t',' ')
 #define WAV_DATA		COMPOSE_ID('d','a','t','a')
+#define WAV_RF64		COMPOSE_ID('R','F','6','4')
+#define WAV_DS64		COMPOSE_ID('d','s','6','4')
+#define WAV_JUNK		COMPOSE_ID('J','U','N','K')
 
 /* WAVE fmt block constants from Microsoft mmreg.h header */
 #define WAV_FMT_PCM             0x0001
@@ -107,6 +114,37 @@ typedef struct {
 	u_int length;		/* samplecount */
 } WaveChunkHeader;
 
+/* RF64 (EBU Tech 3306): 'RF64' instead of 'RIFF', the 32-bit sizes are
+   0xffffffff and the real ones are stored in the first chunk 'ds64' */
+typedef struct {
+	u_int riff_size_low;
+	u_int riff_size_high;
+	u_int data_size_low;
+	u_int data_size_high;
+	u_int sample_count_low;
+	u_int sample_count_high;
+	u_int table_length;	/* entries for other chunks, not used */
+} WaveDs64Body;
+
+/* Sony Wave64: the chunk ids are GUIDs, the sizes are 64-bit and include
+   the chunk header, the chunks are aligned to 8 bytes */
+#define W64_GUID_RIFF		"riff\x2E\x91\xCF\x11\xA5\xD6\x28\xDB\x04\xC1\x00\x00"
+#define W64_GUID_WAVE		"wave\xF3\xAC\xD3\x11\x8C\xD1\x00\xC0\x4F\x8E\xDB\x8A"
+#define W64_GUID_FMT		"fmt \xF3\xAC\xD3\x11\x8C\xD1\x00\xC0\x4F\x8E\xDB\x8A"
+#define W64_GUID_DATA		"data\xF3\xAC\xD3\x11\x8C\xD1\x00\xC0\x4F\x8E\xDB\x8A"
+#define W64_GUID_TAG		"\xF3\xAC\xD3\x11\x8C\xD1\x00\xC0\x4F\x8E\xDB\x8A"
+
+typedef struct {
+	u_char guid[16];	/* W64_GUID_* */
+	u_int64_t length;	/* chunk size including this header */
+} W64ChunkHeader;
+
+typedef struct {
+	u_char guid[16];	/* W64_GUID_RIFF */
+	u_int64_t length;	/* filelen */
+	u_char type[16];	/* W64_GUID_WAVE */
+} W64Header;
+
 /* Definitions for Sparc .au header */
 
 #define AU_MAGIC		COMPOSE_ID('.','s','n','d')